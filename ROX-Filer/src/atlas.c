@@ -0,0 +1,351 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* atlas.c - thumbnails packed into shared surfaces for drawing */
+
+/* Drawing a GdkPixbuf with cairo converts it to a new image surface every
+ * time, and draw_huge_icon() used to scale a copy first, too. Instead,
+ * images up to the thumbnail size are converted once into a tile of a
+ * large shared surface (a page), and drawn from there, scaled by cairo.
+ * Only a few pages are needed for a whole window of thumbnails, and the
+ * X server can keep its copy of each one between exposes.
+ *
+ * A tile belongs to its pixbuf until the pixbuf is finalised. Once the
+ * pages fill the memory budget (the 'thumb_atlas_size' option, in MB) the
+ * least recently drawn tile is reused.
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+
+#include "global.h"
+
+#include "atlas.h"
+#include "options.h"
+#include "pixmaps.h"
+
+/* Pages are about this many pixels wide and high (and hold at least one
+ * tile).
+ */
+#define PAGE_SIDE 1024
+
+/* The strength of the selection colour; as for create_spotlight_pixbuf() */
+#define SPOTLIGHT_OPACITY 88
+
+typedef struct _AtlasPage AtlasPage;
+typedef struct _AtlasTile AtlasTile;
+
+struct _AtlasPage {
+	cairo_surface_t	*surface;
+	AtlasTile	*tiles;
+};
+
+struct _AtlasTile {
+	AtlasPage	*page;
+	int		x, y;		/* Position in the page */
+	GdkPixbuf	*pixbuf;	/* Not a ref; NULL when free */
+	cairo_surface_t	*image;		/* Just the pixbuf's part of the page */
+	GList		link;		/* In lru or free_tiles */
+};
+
+static Option o_atlas_size;
+
+static int tile_size = 0;		/* Pages are for thumbs this big */
+static int page_tiles = 0;		/* Tiles along each side of a page */
+static GPtrArray *pages = NULL;
+static GQueue lru = G_QUEUE_INIT;	/* Tiles in use, last drawn first */
+static GQueue free_tiles = G_QUEUE_INIT;
+static GQuark atlas_quark = 0;
+
+/* Static prototypes */
+static void atlas_flush(void);
+static void options_changed(void);
+static AtlasTile *get_tile(GdkPixbuf *pixbuf);
+static gboolean add_page(void);
+static void tile_released(gpointer data);
+static void upload(AtlasTile *tile, GdkPixbuf *pixbuf);
+
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+void atlas_init(void)
+{
+	atlas_quark = g_quark_from_static_string("rox-atlas-tile");
+	pages = g_ptr_array_new();
+
+	option_add_int(&o_atlas_size, "thumb_atlas_size", 64);
+	option_add_notify(options_changed);
+}
+
+/* Draw pixbuf with cr, scaled to fill the rectangle given, and tinted with
+ * the 'spotlight' colour if not NULL.
+ * Returns FALSE, having drawn nothing, if the pixbuf isn't a thumbnail-sized
+ * RGB(A) image or the atlas is turned off; use the pixbuf directly instead.
+ */
+gboolean atlas_draw(cairo_t *cr, GdkPixbuf *pixbuf,
+		    int x, int y, int width, int height,
+		    GdkColor *spotlight)
+{
+	AtlasTile *tile;
+	int w, h;
+
+	w = gdk_pixbuf_get_width(pixbuf);
+	h = gdk_pixbuf_get_height(pixbuf);
+
+	if (o_atlas_size.int_value <= 0 || width <= 0 || height <= 0 ||
+	    w > thumb_size || h > thumb_size ||
+	    gdk_pixbuf_get_colorspace(pixbuf) != GDK_COLORSPACE_RGB ||
+	    gdk_pixbuf_get_bits_per_sample(pixbuf) != 8 ||
+	    gdk_pixbuf_get_n_channels(pixbuf) !=
+			(gdk_pixbuf_get_has_alpha(pixbuf) ? 4 : 3))
+		return FALSE;
+
+	if (tile_size != thumb_size)
+	{
+		atlas_flush();
+		tile_size = thumb_size;
+		page_tiles = MAX(1, PAGE_SIDE / tile_size);
+	}
+
+	tile = get_tile(pixbuf);
+	if (!tile)
+		return FALSE;
+
+	cairo_save(cr);
+	cairo_rectangle(cr, x, y, width, height);
+	cairo_clip(cr);
+
+	if (spotlight)
+		cairo_push_group(cr);
+
+	cairo_save(cr);
+	cairo_translate(cr, x, y);
+	cairo_scale(cr, width / (double) w, height / (double) h);
+	cairo_set_source_surface(cr, tile->image, 0, 0);
+	cairo_paint(cr);
+	cairo_restore(cr);
+
+	if (spotlight)
+	{
+		/* Tint just the image, not what's behind it */
+		cairo_set_operator(cr, CAIRO_OPERATOR_ATOP);
+		gdk_cairo_set_source_color(cr, spotlight);
+		cairo_paint_with_alpha(cr, SPOTLIGHT_OPACITY / 255.0);
+		cairo_pop_group_to_source(cr);
+		cairo_paint(cr);
+	}
+
+	cairo_restore(cr);
+
+	return TRUE;
+}
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+/* Give back every tile and free the pages */
+static void atlas_flush(void)
+{
+	AtlasTile *tile;
+	guint i;
+
+	while (lru.head)
+	{
+		tile = lru.head->data;
+		/* (calls tile_released) */
+		g_object_set_qdata(G_OBJECT(tile->pixbuf), atlas_quark, NULL);
+	}
+
+	g_queue_init(&free_tiles);
+
+	for (i = 0; i < pages->len; i++)
+	{
+		AtlasPage *page = pages->pdata[i];
+
+		cairo_surface_destroy(page->surface);
+		g_free(page->tiles);
+		g_free(page);
+	}
+	g_ptr_array_set_size(pages, 0);
+}
+
+static void options_changed(void)
+{
+	/* Pages aren't given back one at a time; start again */
+	if (o_atlas_size.has_changed)
+		atlas_flush();
+}
+
+/* Find the tile holding pixbuf, or give it one. NULL if there's no room. */
+static AtlasTile *get_tile(GdkPixbuf *pixbuf)
+{
+	AtlasTile *tile;
+	GList *link;
+
+	tile = g_object_get_qdata(G_OBJECT(pixbuf), atlas_quark);
+	if (tile)
+	{
+		g_queue_unlink(&lru, &tile->link);
+		g_queue_push_head_link(&lru, &tile->link);
+		return tile;
+	}
+
+	if (!free_tiles.head && !add_page() && lru.tail)
+	{
+		/* Full; take the tile drawn longest ago */
+		tile = lru.tail->data;
+		g_object_set_qdata(G_OBJECT(tile->pixbuf), atlas_quark, NULL);
+	}
+
+	link = g_queue_pop_head_link(&free_tiles);
+	if (!link)
+		return NULL;
+
+	tile = link->data;
+	upload(tile, pixbuf);
+	tile->pixbuf = pixbuf;
+	g_queue_push_head_link(&lru, &tile->link);
+	g_object_set_qdata_full(G_OBJECT(pixbuf), atlas_quark,
+				tile, tile_released);
+
+	return tile;
+}
+
+/* Add a page, if there's room in the budget, and put its tiles on the free
+ * list.
+ */
+static gboolean add_page(void)
+{
+	gsize page_bytes = (gsize) page_tiles * tile_size *
+			   page_tiles * tile_size * 4;
+	AtlasPage *page;
+	int i, n = page_tiles * page_tiles;
+
+	if ((pages->len + 1) * page_bytes >
+	    (gsize) o_atlas_size.int_value << 20)
+	{
+		/* Always allow one page, so we don't thrash */
+		if (pages->len)
+			return FALSE;
+	}
+
+	page = g_new(AtlasPage, 1);
+	page->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+			page_tiles * tile_size, page_tiles * tile_size);
+	if (cairo_surface_status(page->surface) != CAIRO_STATUS_SUCCESS)
+	{
+		cairo_surface_destroy(page->surface);
+		g_free(page);
+		return FALSE;
+	}
+	page->tiles = g_new0(AtlasTile, n);
+
+	for (i = 0; i < n; i++)
+	{
+		AtlasTile *tile = &page->tiles[i];
+
+		tile->page = page;
+		tile->x = (i % page_tiles) * tile_size;
+		tile->y = (i / page_tiles) * tile_size;
+		tile->link.data = tile;
+		g_queue_push_tail_link(&free_tiles, &tile->link);
+	}
+
+	g_ptr_array_add(pages, page);
+
+	return TRUE;
+}
+
+/* The tile's pixbuf is being finalised, or the tile is wanted back */
+static void tile_released(gpointer data)
+{
+	AtlasTile *tile = (AtlasTile *) data;
+
+	g_queue_unlink(&lru, &tile->link);
+	tile->pixbuf = NULL;
+	cairo_surface_destroy(tile->image);
+	tile->image = NULL;
+	g_queue_push_head_link(&free_tiles, &tile->link);
+}
+
+/* c * a / 255, rounded, without dividing */
+static inline guint premultiply(guint c, guint a)
+{
+	guint t = c * a + 128;
+
+	return ((t >> 8) + t) >> 8;
+}
+
+/* Copy pixbuf into the tile, as premultiplied ARGB */
+static void upload(AtlasTile *tile, GdkPixbuf *pixbuf)
+{
+	cairo_surface_t *surface = tile->page->surface;
+	int width = gdk_pixbuf_get_width(pixbuf);
+	int height = gdk_pixbuf_get_height(pixbuf);
+	int n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+	int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+	int stride = cairo_image_surface_get_stride(surface);
+	const guchar *src_row = gdk_pixbuf_get_pixels(pixbuf);
+	guchar *dst_row;
+	int x, y;
+
+	/* (in case cairo is still using it) */
+	cairo_surface_flush(surface);
+
+	dst_row = cairo_image_surface_get_data(surface) +
+		  tile->y * stride + tile->x * 4;
+
+	for (y = 0; y < height; y++)
+	{
+		const guchar *src = src_row;
+		guint32 *dst = (guint32 *) dst_row;
+
+		if (n_channels == 3)
+		{
+			for (x = 0; x < width; x++, src += 3)
+				dst[x] = 0xff000000 |
+					(src[0] << 16) | (src[1] << 8) | src[2];
+		}
+		else
+		{
+			for (x = 0; x < width; x++, src += 4)
+			{
+				guint a = src[3];
+
+				dst[x] = (a << 24) |
+					 (premultiply(src[0], a) << 16) |
+					 (premultiply(src[1], a) << 8) |
+					 premultiply(src[2], a);
+			}
+		}
+
+		src_row += rowstride;
+		dst_row += stride;
+	}
+
+	cairo_surface_mark_dirty_rectangle(surface, tile->x, tile->y,
+					   width, height);
+
+	tile->image = cairo_surface_create_for_rectangle(surface,
+			tile->x, tile->y, width, height);
+}
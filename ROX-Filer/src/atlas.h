@@ -0,0 +1,14 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * By Thomas Leonard, <tal197@users.sourceforge.net>.
+ */
+
+#ifndef _ATLAS_H
+#define _ATLAS_H
+
+void atlas_init(void);
+gboolean atlas_draw(cairo_t *cr, GdkPixbuf *pixbuf,
+		    int x, int y, int width, int height,
+		    GdkColor *spotlight);
+
+#endif /* _ATLAS_H */
@@ -25,6 +25,7 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <gtk/gtk.h>
 #include <gdk/gdkkeysyms.h>
@@ -40,6 +41,9 @@
 
 #define MAX_WINKS 7		/* Should be an odd number */
 
+/* Above this many, redraw the whole window instead of each item */
+#define MAX_SINGLE_REDRAWS 256
+
 /* Macro to emit the "selection_changed" signal only if allowed */
 #define EMIT_SELECTION_CHANGED(collection, time) \
 	if (!collection->block_selection_changed) \
@@ -160,6 +164,84 @@ static inline int collection_get_cols(const Collection *collection)
 		return collection->columns;
 }
 
+/* The selection is a bitset, one bit per item. Bits past the last item are
+ * always clear.
+ */
+#define SELECTION_WORDS(n) (((n) + 63) / 64)
+
+static inline guint popcount64(guint64 word)
+{
+	word -= (word >> 1) & G_GUINT64_CONSTANT(0x5555555555555555);
+	word = (word & G_GUINT64_CONSTANT(0x3333333333333333)) +
+	       ((word >> 2) & G_GUINT64_CONSTANT(0x3333333333333333));
+	word = (word + (word >> 4)) & G_GUINT64_CONSTANT(0x0f0f0f0f0f0f0f0f);
+	return (word * G_GUINT64_CONSTANT(0x0101010101010101)) >> 56;
+}
+
+static inline void set_selected_bit(Collection *collection, int item,
+				    gboolean selected)
+{
+	guint64 bit = G_GUINT64_CONSTANT(1) << (item % 64);
+
+	if (selected)
+		collection->selection[item / 64] |= bit;
+	else
+		collection->selection[item / 64] &= ~bit;
+}
+
+/* Bits [start, end) of word 'i' */
+static inline guint64 range_mask(int i, int start, int end)
+{
+	guint64 mask = ~G_GUINT64_CONSTANT(0);
+
+	if (start > i * 64)
+		mask &= mask << (start - i * 64);
+	if (end < (i + 1) * 64)
+		mask &= ~(~G_GUINT64_CONSTANT(0) << (end - i * 64));
+
+	return mask;
+}
+
+/* Number of items in [start, end) which are selected */
+static guint count_selected(Collection *collection, int start, int end)
+{
+	guint64 *words = collection->selection;
+	guint count = 0;
+	int i;
+
+	for (i = start / 64; i < SELECTION_WORDS(end); i++)
+		count += popcount64(words[i] & range_mask(i, start, end));
+
+	return count;
+}
+
+/* Select (or toggle, if 'invert') items [start, end). Updates
+ * number_selected but doesn't redraw anything.
+ */
+static void select_range(Collection *collection, int start, int end,
+			 gboolean invert)
+{
+	guint64 *words = collection->selection;
+	guint before;
+	int i;
+
+	if (end <= start)
+		return;
+
+	before = count_selected(collection, start, end);
+
+	for (i = start / 64; i < SELECTION_WORDS(end); i++)
+	{
+		if (invert)
+			words[i] ^= range_mask(i, start, end);
+		else
+			words[i] |= range_mask(i, start, end);
+	}
+
+	collection->number_selected += invert ? end - start - 2 * before
+					      : end - start - before;
+}
+
 static void draw_one_item(Collection *collection, int item, GdkRectangle *area)
 {
 	if (item < collection->number_of_items)
@@ -292,6 +374,7 @@ static void collection_init(GTypeInstance *instance, gpointer g_class)
 	object->vadj = NULL;
 
 	object->items = g_new(CollectionItem, MINIMUM_ITEMS);
+	object->selection = g_new0(guint64, SELECTION_WORDS(MINIMUM_ITEMS));
 	object->cursor_item = -1;
 	object->cursor_item_old = -1;
 	object->wink_item = -1;
@@ -341,6 +424,7 @@ static void collection_finalize(GObject *object)
 	g_return_if_fail(collection->number_of_items == 0);
 
 	g_free(collection->items);
+	g_free(collection->selection);
 
 	if (G_OBJECT_CLASS(parent_class)->finalize)
 		G_OBJECT_CLASS(parent_class)->finalize(object);
@@ -630,7 +714,7 @@ static void default_draw_item(
 		gboolean cursor)
 {
 	gdk_draw_arc(widget->window,
-			COLLECTION(widget)->items[idx].selected ?
+			collection_item_selected(COLLECTION(widget), idx) ?
 				widget->style->white_gc :
 				widget->style->black_gc,
 			TRUE,
@@ -743,6 +827,13 @@ static void resize_arrays(Collection *collection, guint new_size)
 
 	collection->items = g_realloc(collection->items,
 					sizeof(CollectionItem) * new_size);
+	collection->selection = g_realloc(collection->selection,
+				sizeof(guint64) * SELECTION_WORDS(new_size));
+	if (SELECTION_WORDS(new_size) > SELECTION_WORDS(collection->array_size))
+		memset(collection->selection +
+				SELECTION_WORDS(collection->array_size), 0,
+			sizeof(guint64) * (SELECTION_WORDS(new_size) -
+				SELECTION_WORDS(collection->array_size)));
 	collection->array_size = new_size;
 }
 
@@ -972,11 +1063,12 @@ static void collection_process_area(Collection	 *collection,
 				    GdkFunction  fn,
 				    guint32	 time)
 {
-	int		x, y;
 	int             rows = collection_get_rows(collection);
 	int             cols = collection->columns;
+	int		last_x = MIN(area->x + area->width, cols);
+	int		last_y = MIN(area->y + area->height, rows);
 	guint32		stacked_time;
-	int		item;
+	int		line;
 	gboolean	changed = FALSE;
 	guint		old_selected;
 
@@ -989,23 +1081,38 @@ static void collection_process_area(Collection	 *collection,
 
 	collection->block_selection_changed++;
 
-	for (y = area->y; y < area->y + area->height && y < rows; y++)
-		for (x = area->x; x < area->x + area->width && x < cols; x++)
+	/* Each row (or column, in vertical order) of the area is a run of
+	 * items, done a word of the selection at a time.
+	 */
+	for (line = collection->vertical_order ? area->x : area->y;
+	     line < (collection->vertical_order ? last_x : last_y); line++)
 	{
-		item = collection_rowcol_to_item(collection, y, x);
-		if (item < collection->number_of_items)
-		{
-			if (fn == GDK_INVERT)
-					collection_item_set_selected(
-					    collection, item,
-					    !collection-> items[item].selected,
-					FALSE);
-			else
-					collection_item_set_selected(
-						collection, item, TRUE, FALSE);
+		int start, end, item;
 
-			changed = TRUE;
+		if (collection->vertical_order)
+		{
+			start = collection_rowcol_to_item(collection,
+							  area->y, line);
+			end = start + last_y - area->y;
+		}
+		else
+		{
+			start = collection_rowcol_to_item(collection,
+							  line, area->x);
+			end = start + last_x - area->x;
 		}
+		end = MIN(end, collection->number_of_items);
+		if (start >= end)
+			continue;
+
+		changed = TRUE;
+		if (fn == GDK_SET &&
+		    count_selected(collection, start, end) == end - start)
+			continue;
+
+		select_range(collection, start, end, fn == GDK_INVERT);
+		for (item = start; item < end; item++)
+			collection_draw_item(collection, item, TRUE);
 	}
 
 	if (collection->number_selected && !old_selected)
@@ -1169,6 +1276,14 @@ static void get_visible_limits(Collection *collection, int *first, int *last)
 	}
 }
 
+/* As get_visible_limits(), for views that want to deal with what's on
+ * screen first.
+ */
+void collection_get_visible_rows(Collection *collection, int *first, int *last)
+{
+	get_visible_limits(collection, first, last);
+}
+
 /* Cancel the current wink effect. */
 static void cancel_wink(Collection *collection)
 {
@@ -1247,10 +1362,10 @@ static void collection_item_set_selected(Collection *collection,
 	g_return_if_fail(IS_COLLECTION(collection));
 	g_return_if_fail(item >= 0 && item < collection->number_of_items);
 
-	if (collection->items[item].selected == selected)
+	if (collection_item_selected(collection, item) == !!selected)
 		return;
 
-	collection->items[item].selected = selected;
+	set_selected_bit(collection, item, selected);
 	collection_draw_item(collection, item, TRUE);
 
 	if (selected)
@@ -1303,7 +1418,7 @@ gint collection_insert(Collection *collection, gpointer data, gpointer view)
 
 	collection->items[item].data = data;
 	collection->items[item].view_data = view;
-	collection->items[item].selected = FALSE;
+	set_selected_bit(collection, item, FALSE);
 
 	collection->number_of_items++;
 
@@ -1324,25 +1439,15 @@ void collection_select_item(Collection *collection, gint item)
 /* Select all items in the collection */
 void collection_select_all(Collection *collection)
 {
-	int		item = 0;
-
 	g_return_if_fail(collection != NULL);
 	g_return_if_fail(IS_COLLECTION(collection));
 
 	if (collection->number_selected == collection->number_of_items)
 		return;		/* Nothing to do */
 
-	while (collection->number_selected < collection->number_of_items)
-	{
-		while (collection->items[item].selected)
-			item++;
-
-		collection->items[item].selected = TRUE;
-		collection_draw_item(collection, item, TRUE);
-		item++;
+	select_range(collection, 0, collection->number_of_items, FALSE);
 
-		collection->number_selected++;
-	}
+	gtk_widget_queue_draw(GTK_WIDGET(collection));
 
 	g_signal_emit(collection, collection_signals[GAIN_SELECTION], 0,
 			current_event_time);
@@ -1352,8 +1457,6 @@ void collection_select_all(Collection *collection)
 /* Toggle all items in the collection */
 void collection_invert_selection(Collection *collection)
 {
-	int		item;
-
 	g_return_if_fail(collection != NULL);
 	g_return_if_fail(IS_COLLECTION(collection));
 
@@ -1368,12 +1471,7 @@ void collection_invert_selection(Collection *collection)
 		return;
 	}
 
-	for (item = 0; item < collection->number_of_items; item++)
-		collection->items[item].selected =
-			!collection->items[item].selected;
-
-	collection->number_selected = collection->number_of_items -
-				      collection->number_selected;
+	select_range(collection, 0, collection->number_of_items, TRUE);
 
 	/* Have to redraw everything... */
 	gtk_widget_queue_draw(GTK_WIDGET(collection));
@@ -1386,7 +1484,8 @@ void collection_invert_selection(Collection *collection)
  */
 void collection_clear_except(Collection *collection, gint item)
 {
-	int		i = 0;
+	guint64		*words = collection->selection;
+	int		i;
 	int		end;		/* Selected items to end up with */
 
 	g_return_if_fail(collection != NULL);
@@ -1404,18 +1503,34 @@ void collection_clear_except(Collection *collection, gint item)
 	if (collection->number_selected == 0)
 		return;
 
-	while (collection->number_selected > end)
+	/* Redraw just the items that change, unless that's a lot of them */
+	if (collection->number_selected - end > MAX_SINGLE_REDRAWS)
+		gtk_widget_queue_draw(GTK_WIDGET(collection));
+	else
 	{
-		while (i == item || !collection->items[i].selected)
-			i++;
+		for (i = 0; i < SELECTION_WORDS(collection->number_of_items);
+		     i++)
+		{
+			guint64 word = words[i];
 
-		collection->items[i].selected = FALSE;
-		collection_draw_item(collection, i, TRUE);
-		i++;
+			while (word)
+			{
+				int bit = popcount64((word & -word) - 1);
 
-		collection->number_selected--;
+				if (i * 64 + bit != item)
+					collection_draw_item(collection,
+							i * 64 + bit, TRUE);
+				word &= word - 1;
+			}
+		}
 	}
 
+	memset(words, 0, sizeof(guint64) *
+			SELECTION_WORDS(collection->number_of_items));
+	if (end)
+		set_selected_bit(collection, item, TRUE);
+	collection->number_selected = end;
+
 	if (end == 0)
 		g_signal_emit(collection, collection_signals[LOSE_SELECTION], 0,
 				current_event_time);
@@ -1500,6 +1615,18 @@ static int collection_rcmp(const void *a, const void *b)
 			     ((CollectionItem *) b)->data);
 }
 
+static CollectionItem *cmp_items = NULL;
+static int collection_cmp_index(const void *a, const void *b)
+{
+	return cmp_callback(cmp_items[*(guint *) a].data,
+			    cmp_items[*(guint *) b].data);
+}
+static int collection_rcmp_index(const void *a, const void *b)
+{
+	return -cmp_callback(cmp_items[*(guint *) a].data,
+			     cmp_items[*(guint *) b].data);
+}
+
 /* Cursor is positioned on item with the same data as before the sort.
  * Same for the wink item.
  */
@@ -1507,10 +1634,8 @@ void collection_qsort(Collection *collection,
 		      int (*compar)(const void *, const void *),
 		      GtkSortType order)
 {
-	int	cursor, wink, items, wink_on_map;
-	gpointer cursor_data = NULL;
-	gpointer wink_data = NULL;
-	gpointer wink_on_map_data = NULL;
+	int	items;
+	guint	*perm;
 	CollectionItem *array;
 	int	i;
 	int	mul = order == GTK_SORT_ASCENDING ? 1 : -1;
@@ -1533,54 +1658,180 @@ void collection_qsort(Collection *collection,
 	if (i == collection->number_of_items)
 		return;		/* Already sorted */
 
+	/* Sort item numbers, so that the selection can follow */
 	items = collection->number_of_items;
+	perm = g_new(guint, items);
+	for (i = 0; i < items; i++)
+		perm[i] = i;
 
-	wink_on_map = collection->wink_on_map;
-	if (wink_on_map >= 0 && wink_on_map < items)
+	cmp_items = array;
+	cmp_callback = compar;
+	qsort(perm, items, sizeof(guint),
+			order == GTK_SORT_ASCENDING ? collection_cmp_index
+						    : collection_rcmp_index);
+	cmp_callback = NULL;
+
+	collection_reorder(collection, perm);
+	g_free(perm);
+}
+
+/* As collection_qsort(), when only the items from 'first_new' on (just
+ * added with collection_insert()) may be out of order. They are sorted on
+ * their own and then merged into the others in a single pass, which also
+ * moves the cursor and wink along with their items.
+ */
+void collection_merge_sort(Collection *collection, int first_new,
+			   int (*compar)(const void *, const void *),
+			   GtkSortType order)
+{
+	CollectionItem *array, *added;
+	int	items, n_added, i, j, dest;
+	int	cursor, wink, wink_on_map;
+	gpointer cursor_data, wink_data, wink_on_map_data;
+	int	mul = order == GTK_SORT_ASCENDING ? 1 : -1;
+
+	g_return_if_fail(collection != NULL);
+	g_return_if_fail(IS_COLLECTION(collection));
+	g_return_if_fail(compar != NULL);
+	g_return_if_fail(cmp_callback == NULL);
+
+	items = collection->number_of_items;
+	n_added = items - first_new;
+	array = collection->items;
+
+	if (n_added <= 0)
+		return;
+
+	/* The others must be in order already (an update may have
+	 * changed one since they were sorted), and the new ones unselected.
+	 */
+	for (i = 1; i < first_new; i++)
 	{
-		wink_on_map_data = collection->items[wink_on_map].data;
-		collection->wink_on_map = -1;
+		if (mul * compar(array[i - 1].data, array[i].data) > 0)
+			break;
 	}
-
-	wink = collection->wink_item;
-	if (wink >= 0 && wink < items)
+	if (first_new <= 0 || i < first_new ||
+	    count_selected(collection, first_new, items))
 	{
-		wink_data = collection->items[wink].data;
-		collection->wink_item = -1;
+		collection_qsort(collection, compar, order);
+		return;
 	}
-	else
-		wink = -1;
 
 	cursor = collection->cursor_item;
-	if (cursor >= 0 && cursor < items)
-		cursor_data = collection->items[cursor].data;
-	else
-		cursor = -1;
+	cursor_data = cursor >= 0 && cursor < items ? array[cursor].data : NULL;
+	wink = collection->wink_item;
+	wink_data = wink >= 0 && wink < items ? array[wink].data : NULL;
+	wink_on_map = collection->wink_on_map;
+	wink_on_map_data = wink_on_map >= 0 && wink_on_map < items ?
+				array[wink_on_map].data : NULL;
 
 	cmp_callback = compar;
-	qsort(collection->items, items, sizeof(collection->items[0]),
+	qsort(array + first_new, n_added, sizeof(array[0]),
 			order == GTK_SORT_ASCENDING ? collection_cmp
 						    : collection_rcmp);
 	cmp_callback = NULL;
 
-	if (cursor > -1 || wink > -1 || wink_on_map > -1)
+	/* Fill from the end, taking the larger of the last old item and the
+	 * last new one each time. Old items before the first new one's
+	 * place never move. Often, the new ones all go at the end anyway.
+	 */
+	if (mul * compar(array[first_new - 1].data, array[first_new].data) > 0)
+		added = g_memdup(array + first_new,
+				 n_added * sizeof(array[0]));
+	else
+		added = NULL;
+	i = first_new - 1;
+	j = n_added - 1;
+	for (dest = items - 1; j >= 0; dest--)
 	{
-		int	item;
-
-		for (item = 0; item < items; item++)
+		if (!added)
+			j--;
+		else if (i >= 0 && mul * compar(array[i].data,
+						added[j].data) > 0)
 		{
-			if (collection->items[item].data == cursor_data)
-				collection_set_cursor_item(collection, item,
-						TRUE);
-			if (collection->items[item].data == wink_on_map_data)
-				collection->wink_on_map = item;
-			if (collection->items[item].data == wink_data)
-			{
-				collection->cursor_item_old = item;
-				collection->wink_item = item;
-				scroll_to_show(collection, item);
-			}
+			set_selected_bit(collection, dest,
+					 collection_item_selected(collection, i));
+			array[dest] = array[i--];
 		}
+		else
+		{
+			set_selected_bit(collection, dest, FALSE);
+			array[dest] = added[j--];
+		}
+
+		if (array[dest].data == cursor_data)
+			cursor = dest;
+		if (array[dest].data == wink_data)
+			wink = dest;
+		if (array[dest].data == wink_on_map_data)
+			wink_on_map = dest;
+	}
+	g_free(added);
+
+	if (cursor_data && cursor != collection->cursor_item)
+		collection_set_cursor_item(collection, cursor, TRUE);
+	if (wink_on_map_data)
+		collection->wink_on_map = wink_on_map;
+	if (wink_data && wink != collection->wink_item)
+	{
+		collection->cursor_item_old = wink;
+		collection->wink_item = wink;
+		scroll_to_show(collection, wink);
+	}
+
+	gtk_widget_queue_draw(GTK_WIDGET(collection));
+}
+
+/* Puts the items in a new order, where the i-th is the one that was at
+ * perm[i] before (see display_sort_order()). The cursor, wink and
+ * selection stay on the same items.
+ */
+void collection_reorder(Collection *collection, const guint *perm)
+{
+	int	items = collection->number_of_items;
+	int	cursor = -1, wink = -1, wink_on_map = -1;
+	CollectionItem *old;
+	guint64	*was_selected = NULL;
+	int	i;
+
+	g_return_if_fail(collection != NULL);
+	g_return_if_fail(IS_COLLECTION(collection));
+
+	old = g_memdup(collection->items, items * sizeof(old[0]));
+	if (collection->number_selected)
+	{
+		was_selected = collection->selection;
+		collection->selection = g_new0(guint64,
+				SELECTION_WORDS(collection->array_size));
+	}
+
+	for (i = 0; i < items; i++)
+	{
+		int from = perm[i];
+
+		collection->items[i] = old[from];
+		if (was_selected && (was_selected[from / 64] >> (from % 64)) & 1)
+			set_selected_bit(collection, i, TRUE);
+
+		if (from == collection->cursor_item)
+			cursor = i;
+		if (from == collection->wink_item)
+			wink = i;
+		if (from == collection->wink_on_map)
+			wink_on_map = i;
+	}
+	g_free(old);
+	g_free(was_selected);
+
+	if (cursor > -1)
+		collection_set_cursor_item(collection, cursor, TRUE);
+	if (wink_on_map > -1)
+		collection->wink_on_map = wink_on_map;
+	if (wink > -1)
+	{
+		collection->cursor_item_old = wink;
+		collection->wink_item = wink;
+		scroll_to_show(collection, wink);
 	}
 
 	gtk_widget_queue_draw(GTK_WIDGET(collection));
@@ -1756,13 +2007,12 @@ void collection_delete_if(Collection *collection,
 		if (test && !test(collection->items[in].data, data))
 		{
 			/* Keep item */
-			if (collection->items[in].selected)
-			{
-				collection->items[out].selected = TRUE;
+			gboolean is_selected =
+				collection_item_selected(collection, in);
+
+			set_selected_bit(collection, out, is_selected);
+			if (is_selected)
 				selected++;
-			}
-			else
-				collection->items[out].selected = FALSE;
 
 			collection->items[out].data =
 				collection->items[in].data;
@@ -1793,6 +2043,10 @@ void collection_delete_if(Collection *collection,
 			g_source_remove(collection->wink_timeout);
 		}
 
+		/* Keep the bits past the end clear */
+		for (in = out; in < collection->number_of_items; in++)
+			set_selected_bit(collection, in, FALSE);
+
 		collection->number_of_items = out;
 		if (collection->number_selected && !selected)
 		{
@@ -1860,7 +2114,8 @@ void collection_move_cursor(Collection *collection, int drow, int dcol, int even
 		if (event_state & (GDK_CONTROL_MASK | GDK_SHIFT_MASK))
 		{
 			collection_item_set_selected(collection, item,
-					!(collection->items[item].selected &&
+					!(collection_item_selected(collection,
+								   item) &&
 						(event_state & GDK_CONTROL_MASK)),
 					TRUE);
 		}
@@ -36,8 +36,8 @@ enum
 
 typedef struct _Collection Collection;
 
-/* Each item in a Collection has one of these, which stores its selected
- * state, data, and view_data.
+/* Each item in a Collection has one of these, which stores its data and
+ * view_data. Whether it's selected is kept in the Collection's selection.
  */
 typedef struct _CollectionItem   CollectionItem;
 
@@ -62,7 +62,6 @@ struct _CollectionItem
 {
 	gpointer	data;
 	gpointer	view_data;
-	gboolean	selected;
 };
 
 struct _Collection
@@ -85,6 +84,8 @@ struct _Collection
 	GdkGC		*xor_gc;
 
 	CollectionItem	*items;
+	guint64		*selection;	/* Bit per item. Use
+					 * collection_item_selected() */
 	gint		cursor_item;		/* -1 if not shown */
 	gint		cursor_item_old;	/* May be -1 */
 	gint		wink_item;		/* -1 if not active */
@@ -118,6 +119,12 @@ struct _CollectionClass
 					     gint	time);
 };
 
+static inline gboolean collection_item_selected(Collection *collection,
+						int item)
+{
+	return (collection->selection[item / 64] >> (item % 64)) & 1;
+}
+
 GType	collection_get_type   		(void);
 GtkWidget *collection_new		(void);
 void    collection_clear           	(Collection *collection);
@@ -139,6 +146,13 @@ void 	collection_qsort		(Collection *collection,
 					 int (*compar)(const void *,
 						       const void *),
 					 GtkSortType order);
+void	collection_merge_sort		(Collection *collection,
+					 int first_new,
+					 int (*compar)(const void *,
+						       const void *),
+					 GtkSortType order);
+void	collection_reorder		(Collection *collection,
+					 const guint *perm);
 int 	collection_find_item		(Collection *collection,
 					 gpointer data,
 					 int (*compar)(const void *,
@@ -166,6 +180,8 @@ void    collection_item_to_rowcol       (const Collection *collection,
 					 int item, int *row, int *col);
 int     collection_rowcol_to_item       (const Collection *collection,
 					 int row, int col);
+void    collection_get_visible_rows     (Collection *collection,
+					 int *first, int *last);
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -53,8 +53,15 @@
 #include <gtk/gtk.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_SYSCALL_H
+# include <sys/syscall.h>
+#endif
 
 #include "global.h"
 
@@ -69,14 +76,73 @@
 #include "type.h"
 #include "main.h"
 #include "options.h"
+#include "dirsnap.h"
 
 /* For debugging. Can't detach when this is non-zero. */
 static int in_callback = 0;
 
 GFSCache *dir_cache = NULL;
 
+/* Directories that exist, by (a copy of) pathname. Finding a directory's thumbnail
+ * hashes through this doesn't need the stat() of a dir_cache lookup.
+ * hash_lock covers this and every Directory's thumb_hashes, which are used
+ * from the thumbnailing threads too.
+ */
+static GHashTable *dirs_by_path = NULL;
+static GMutex hash_lock;
+
 static Option o_purge_dir_cache;
 static Option o_close_dir_when_missing;
+static Option o_dir_lazy_stat;
+static Option o_dir_io_depth;
+static Option o_dir_snapshots;
+
+/* Items are restatted by a pool shared by all directories. Each scan thread
+ * hands it a batch, waits for the batch and merges the results.
+ */
+#define RESTAT_BATCH 64
+static GThreadPool *restat_pool = NULL;
+
+typedef struct _RestatBatch RestatBatch;
+typedef struct _RestatJob RestatJob;
+
+struct _RestatJob {
+	RestatBatch	*batch;
+	DirItem		*item;
+	DirItem		fresh;		/* Restatted copy of item */
+	DirItem		old;		/* Details before the restat */
+	gboolean	do_compare;	/* (old is filled in) */
+	gboolean	in_list;	/* Still on recheck_list, further on */
+	gboolean	is_new;		/* Not in known_items unless it exists */
+};
+
+struct _RestatBatch {
+	Directory	*dir;
+	gchar		*pathname;
+	gboolean	lazy_stat;
+	int		stat_fields;
+	RestatJob	jobs[RESTAT_BATCH];
+	int		n_jobs;
+
+	GMutex		m;
+	GCond		done;
+	int		pending;
+};
+
+#if defined(__linux__) && defined(SYS_getdents64)
+/* Read directories a buffer-full at a time rather than one readdir() per
+ * name. This is the kernel's record layout (glibc only exports it since 2.30).
+ */
+# define USE_GETDENTS64
+# define DENTS_BUF_SIZE (256 * 1024)
+struct linux_dirent64 {
+	guint64		d_ino;
+	gint64		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+};
+#endif
 
 /* Static prototypes */
 static void fsupdate(Directory *dir, gchar *pathname, gpointer data);
@@ -84,18 +150,42 @@ static void call_scan_t(Directory *dir);
 static DirItem *_insert_item(Directory *dir, DirItem *item, const guchar *leafname, gboolean examine_now);
 static DirItem *insert_item(Directory *dir, const guchar *leafname, gboolean examine_now);
 static GPtrArray *hash_to_array(GHashTable *hash);
+static gboolean compare_items(DirItem *item, DirItem *old);
 static void dir_force_update_item(Directory *dir,
 		const gchar *leaf, gboolean thumb);
 static void dir_scan(Directory *dir);
+static void restat_job(gpointer data, gpointer unused);
+static void dir_options_changed(void);
+static Directory *hashed_dir(const char *path, const char **leaf);
 
 
 void dir_init(void)
 {
 	option_add_int(&o_purge_dir_cache, "purge_dir_cache", FALSE);
 	option_add_int(&o_close_dir_when_missing, "close_dir_when_missing", FALSE);
+	option_add_int(&o_dir_lazy_stat, "dir_lazy_stat", FALSE);
+	option_add_int(&o_dir_io_depth, "dir_io_depth", 0);
+	option_add_int(&o_dir_snapshots, "dir_snapshots", FALSE);
+	option_add_notify(dir_options_changed);
 
 	dir_cache = g_fscache_new((GFSLoadFunc) dir_new,
-				(GFSUpdateFunc) fsupdate, NULL);
+				(GFSUpdateFunc) fsupdate, NULL, 0, NULL);
+	dirs_by_path = g_hash_table_new_full(g_str_hash, g_str_equal,
+					     g_free, NULL);
+}
+
+/* Number of items to restat at once. 0 means one per processor. */
+static gint restat_threads(void)
+{
+	gint n = o_dir_io_depth.int_value;
+
+	return n > 0 ? MIN(n, 256) : g_get_num_processors();
+}
+
+static void dir_options_changed(void)
+{
+	if (restat_pool && o_dir_io_depth.has_changed)
+		g_thread_pool_set_max_threads(restat_pool, restat_threads(), NULL);
 }
 
 
@@ -112,17 +202,129 @@ static gint rescan_timeout_cb(gpointer data)
 	return FALSE;
 }
 
+/* More pending changes than this and we just rescan the whole directory */
+#define MAX_CHANGES 1000
+
+/* Number of times monitorcb()'s changes were restatted instead of rescanning */
+static guint rescans_avoided = 0;
+
 static void rescan_soon(Directory *dir)
 {
 	dir->needs_update = TRUE;
 	if (dir->rescan_timeout != -1) return;
 	dir->rescan_timeout = g_timeout_add(300, rescan_timeout_cb, dir);
 }
+
+/* Have the scan thread restat the items monitorcb() reported. */
+static gint changes_timeout_cb(gpointer data)
+{
+	Directory *dir = (Directory *) data;
+	guint n_changes;
+
+	dir->change_timeout = -1;
+
+	if (dir->needs_update)
+	{
+		/* A full rescan is coming anyway */
+		g_mutex_lock(&dir->mutex);
+		g_hash_table_remove_all(dir->changed_items);
+		g_mutex_unlock(&dir->mutex);
+		return FALSE;
+	}
+
+	/* The restats mark items recent against this, even if the scan
+	 * thread is running already (take_batch() will find them then).
+	 */
+	time(&diritem_recent_time);
+
+	g_mutex_lock(&dir->mutex);
+	n_changes = g_hash_table_size(dir->changed_items);
+	g_mutex_unlock(&dir->mutex);
+
+	if (!dir->t_scan)
+		call_scan_t(dir);
+
+	rescans_avoided++;
+	g_debug("%s: restatting %u changed items (%u rescans avoided so far)",
+			dir->pathname, n_changes, rescans_avoided);
+
+	return FALSE;
+}
+
+/* Note that file (from monitorcb) needs checking. Returns FALSE if it
+ * isn't in dir, or there are so many changes that rescanning is quicker.
+ */
+static gboolean change_soon(Directory *dir, GFile *file)
+{
+	if (!file)
+		return FALSE;
+
+	GFile *parent = g_file_get_parent(file);
+	gchar *parent_path = parent ? g_file_get_path(parent) : NULL;
+	gboolean ours = parent_path && strcmp(parent_path, dir->pathname) == 0;
+
+	g_free(parent_path);
+	if (parent)
+		g_object_unref(parent);
+
+	if (!ours)
+		return FALSE;
+
+	g_mutex_lock(&dir->mutex);
+	gboolean room = g_hash_table_size(dir->changed_items) < MAX_CHANGES;
+	if (room)
+		g_hash_table_add(dir->changed_items, g_file_get_basename(file));
+	g_mutex_unlock(&dir->mutex);
+
+	if (!room)
+		return FALSE;
+
+	if (dir->change_timeout == -1)
+		dir->change_timeout = g_timeout_add(300, changes_timeout_cb, dir);
+
+	return TRUE;
+}
+
 static void monitorcb(GFileMonitor *m, GFile *f,
 		GFile *o, GFileMonitorEvent e, Directory *dir)
 {
-	//don't rescan untile G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT
-	if (e != G_FILE_MONITOR_EVENT_CHANGED)
+	gboolean handled = FALSE;
+
+	/* Until the first scan, or while a rescan is waiting, there's no
+	 * point tracking single items.
+	 */
+	if (dir->have_scanned && !dir->needs_update)
+	{
+		switch (e)
+		{
+			case G_FILE_MONITOR_EVENT_CHANGED:
+				//don't check until G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT
+				return;
+			case G_FILE_MONITOR_EVENT_CREATED:
+			case G_FILE_MONITOR_EVENT_DELETED:
+			case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+			case G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED:
+#if GLIB_CHECK_VERSION(2, 46, 0)
+			case G_FILE_MONITOR_EVENT_MOVED_IN:
+			case G_FILE_MONITOR_EVENT_MOVED_OUT:
+#endif
+				handled = change_soon(dir, f);
+				break;
+#if GLIB_CHECK_VERSION(2, 46, 0)
+			case G_FILE_MONITOR_EVENT_RENAMED:
+				handled = change_soon(dir, f) &&
+					change_soon(dir, o);
+				break;
+#endif
+			default:
+				/* Unmounts, or the directory itself changing */
+				break;
+		}
+	}
+	else if (e == G_FILE_MONITOR_EVENT_CHANGED)
+		return;
+
+	if (!handled)
 		rescan_soon(dir);
 }
 
@@ -150,8 +352,11 @@ void dir_attach(Directory *dir, DirCallback callback, gpointer data)
 	{
 		GFile *gf = g_file_new_for_path(dir->pathname);
 		dir->monitor = g_file_monitor_directory(gf,
-				G_FILE_MONITOR_WATCH_MOUNTS, //doesn't work?
-				NULL, NULL);
+				G_FILE_MONITOR_WATCH_MOUNTS //doesn't work?
+#if GLIB_CHECK_VERSION(2, 46, 0)
+				| G_FILE_MONITOR_WATCH_MOVES
+#endif
+				, NULL, NULL);
 		g_object_unref(gf);
 
 		g_signal_connect(dir->monitor, "changed", G_CALLBACK(monitorcb), dir);
@@ -338,6 +543,100 @@ void dir_queue_recheck(Directory *dir, DirItem *item)
 	}
 }
 
+/* The item is being shown before it has been statted. Have the scan thread
+ * do it before anything further down the recheck_list.
+ */
+void dir_restat_first(Directory *dir, DirItem *item)
+{
+	if (!dir->t_scan || !(item->flags & ITEM_FLAG_IN_RESCAN_QUEUE))
+		return;
+
+	g_mutex_lock(&dir->mergem);
+	if (!g_hash_table_contains(dir->urgent_items, item->leafname))
+		g_hash_table_add(dir->urgent_items, g_strdup(item->leafname));
+	g_mutex_unlock(&dir->mergem);
+}
+
+/* The thumbnail MD5 of 'path', if it has been worked out before, or NULL.
+ * g_free() the result. Safe to call from any thread.
+ */
+gchar *dir_thumb_hash(const char *path)
+{
+	const char *leaf;
+	Directory *dir;
+	gchar *md5 = NULL;
+
+	g_mutex_lock(&hash_lock);
+	dir = hashed_dir(path, &leaf);
+	if (dir)
+		md5 = g_strdup(g_hash_table_lookup(dir->thumb_hashes, leaf));
+	g_mutex_unlock(&hash_lock);
+
+	return md5;
+}
+
+/* Remember 'md5' as the thumbnail MD5 of 'path' while its directory
+ * exists. Safe to call from any thread.
+ */
+void dir_add_thumb_hash(const char *path, const char *md5)
+{
+	const char *leaf;
+	Directory *dir;
+
+	g_mutex_lock(&hash_lock);
+	dir = hashed_dir(path, &leaf);
+	if (dir && !g_hash_table_contains(dir->thumb_hashes, leaf))
+		g_hash_table_insert(dir->thumb_hashes,
+				g_strdup(leaf), g_strdup(md5));
+	g_mutex_unlock(&hash_lock);
+}
+
+/* Which of these leafnames in 'dirpath' have no thumbnail MD5 yet?
+ * NULL if there is no such Directory to remember them in.
+ * g_ptr_array_free() the result; the strings are those of 'leafnames'.
+ */
+GPtrArray *dir_unhashed_thumbs(const char *dirpath, GPtrArray *leafnames)
+{
+	Directory *dir;
+	GPtrArray *missing = NULL;
+	guint i;
+
+	g_mutex_lock(&hash_lock);
+	dir = g_hash_table_lookup(dirs_by_path, dirpath);
+	if (dir)
+	{
+		missing = g_ptr_array_new();
+		for (i = 0; i < leafnames->len; i++)
+			if (!g_hash_table_contains(dir->thumb_hashes,
+						leafnames->pdata[i]))
+				g_ptr_array_add(missing, leafnames->pdata[i]);
+	}
+	g_mutex_unlock(&hash_lock);
+
+	return missing;
+}
+
+/* Remember many hashes at once. Takes the strings in 'md5s'. */
+void dir_add_thumb_hashes(const char *dirpath, GPtrArray *leafnames,
+			  char **md5s)
+{
+	Directory *dir;
+	guint i;
+
+	g_mutex_lock(&hash_lock);
+	dir = g_hash_table_lookup(dirs_by_path, dirpath);
+	for (i = 0; i < leafnames->len; i++)
+	{
+		if (dir && !g_hash_table_contains(dir->thumb_hashes,
+						  leafnames->pdata[i]))
+			g_hash_table_insert(dir->thumb_hashes,
+					g_strdup(leafnames->pdata[i]), md5s[i]);
+		else
+			g_free(md5s[i]);
+	}
+	g_mutex_unlock(&hash_lock);
+}
+
 static void tousers(Directory *dir, DirAction action, GPtrArray *items)
 {
 	in_callback++;
@@ -358,6 +657,13 @@ static void dir_set_scanning(Directory *dir, gboolean scanning)
 	dir->scanning = scanning;
 	tousers(dir, scanning ? DIR_START_SCAN : DIR_END_SCAN, NULL);
 
+	if (!scanning && dir->snap_dirty && !dir->error &&
+			o_dir_snapshots.int_value)
+	{
+		dir->snap_dirty = FALSE;
+		dirsnap_save(dir);
+	}
+
 #if 0
 	/* Useful for profiling */
 	if (!scanning)
@@ -384,10 +690,9 @@ static void stop_scan_t(Directory *dir)
 	}
 }
 
-static void stop_scan(gpointer key, gpointer data, gpointer user_data)
+static void stop_scan(gpointer data, gpointer user_data)
 {
-	GFSCacheData *fsdata = (GFSCacheData *) data;
-	Directory *dir = (Directory *) fsdata->data;
+	Directory *dir = (Directory *) data;
 
 	stop_scan_t(dir);
 	dir_set_scanning(dir, FALSE);
@@ -395,7 +700,30 @@ static void stop_scan(gpointer key, gpointer data, gpointer user_data)
 
 void dir_stop(void)
 {
-	g_hash_table_foreach(dir_cache->inode_to_stats, stop_scan, NULL);
+	g_fscache_foreach(dir_cache, stop_scan, NULL);
+}
+
+/* The Directory holding thumbnail hashes for 'path', with 'leaf' set to
+ * its key there. NULL unless path is exactly that directory's pathname, a
+ * slash and a leafname (so that the hash, which is of the whole string,
+ * is the same for everyone who finds it). Call with hash_lock held.
+ */
+static Directory *hashed_dir(const char *path, const char **leaf)
+{
+	const char *slash;
+	Directory *dir;
+	gchar *dirpath;
+
+	slash = strrchr(path, '/');
+	if (!slash || !slash[1] || (slash > path && slash[-1] == '/'))
+		return NULL;
+
+	dirpath = slash == path ? g_strdup("/") : g_strndup(path, slash - path);
+	dir = g_hash_table_lookup(dirs_by_path, dirpath);
+	g_free(dirpath);
+
+	*leaf = slash + 1;
+	return dir;
 }
 
 static const guchar *make_path_to_buf(GString *buffer, const char *dir, const char *leaf)
@@ -442,34 +770,278 @@ static void delayed_notify(Directory *dir, gboolean mainthread)
 	dir->notify_active = g_timeout_add(dir->notify_time, notify_timeout, dir);
 }
 
-/* This is called in the background when there are items on the
- * dir->recheck_list to process.
+static void add_job(RestatBatch *batch, DirItem *item, gboolean in_list)
+{
+	RestatJob *job = &batch->jobs[batch->n_jobs++];
+
+	job->batch = batch;
+	job->item = item;
+	job->in_list = in_list;
+	job->is_new = FALSE;
+	job->do_compare = item->base_type != TYPE_UNKNOWN;
+	if (job->do_compare)
+		job->old = *item;	/* Preserve the old details so we can compare */
+	diritem_restat_copy(&job->fresh, item);
+}
+
+static gboolean in_batch(RestatBatch *batch, DirItem *item)
+{
+	for (int i = 0; i < batch->n_jobs; i++)
+		if (batch->jobs[i].item == item)
+			return TRUE;
+	return FALSE;
+}
+
+/* Move up to RESTAT_BATCH items into the batch: first any the views have
+ * asked for (see dir_restat_first), then those the monitor reported (see
+ * change_soon), then from the recheck_list.
+ * dir->mutex must be held.
  */
-static gboolean do_recheck(gpointer data)
+static void take_batch(Directory *dir, RestatBatch *batch)
 {
-	Directory *dir = (Directory *) data;
+	GHashTableIter iter;
+	gpointer key;
 
-	g_return_val_if_fail(dir != NULL, FALSE);
+	g_mutex_lock(&dir->mergem);
+	g_hash_table_iter_init(&iter, dir->urgent_items);
+	while (batch->n_jobs < RESTAT_BATCH &&
+			g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		DirItem *item = g_hash_table_lookup(dir->known_items, key);
+		g_hash_table_iter_remove(&iter);
 
-	if (dir->recheck_list->len > dir->rechecki)
+		if (item && (item->flags & ITEM_FLAG_IN_RESCAN_QUEUE) &&
+		    !(item->flags & (ITEM_FLAG_RESTAT_EARLY | ITEM_FLAG_GONE)))
+		{
+			item->flags |= ITEM_FLAG_RESTAT_EARLY;
+			add_job(batch, item, TRUE);
+		}
+	}
+	g_mutex_unlock(&dir->mergem);
+
+	g_hash_table_iter_init(&iter, dir->changed_items);
+	while (batch->n_jobs < RESTAT_BATCH &&
+			g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		DirItem *item = g_hash_table_lookup(dir->known_items, key);
+
+		if (!item)
+		{
+			/* Only shown once we know it's there */
+			item = diritem_new_in(dir->arena, key);
+			item->flags |= ITEM_FLAG_IN_RESCAN_QUEUE;
+			add_job(batch, item, FALSE);
+			batch->jobs[batch->n_jobs - 1].is_new = TRUE;
+		}
+		else if (!(item->flags & ITEM_FLAG_IN_RESCAN_QUEUE))
+		{
+			item->flags |= ITEM_FLAG_IN_RESCAN_QUEUE;
+			add_job(batch, item, FALSE);
+		}
+		else if ((item->flags & ITEM_FLAG_RESTAT_EARLY) &&
+				!in_batch(batch, item))
+		{
+			/* Done out of order before this change. Do it again
+			 * when the recheck_list gets to it.
+			 */
+			item->flags &= ~ITEM_FLAG_RESTAT_EARLY;
+		}
+		/* (else it's still waiting on the recheck_list) */
+
+		g_hash_table_iter_remove(&iter);
+	}
+
+	while (batch->n_jobs < RESTAT_BATCH &&
+			dir->recheck_list->len > dir->rechecki)
 	{
-		g_mutex_lock(&dir->mutex);
 		DirItem *item = dir->recheck_list->pdata[dir->rechecki];
 		                dir->recheck_list->pdata[dir->rechecki++] = NULL;
 
-		if (item->flags & ITEM_FLAG_GONE)
+		if (item->flags & ITEM_FLAG_RESTAT_EARLY)
+		{
+			/* Already done out of order. If it's still in this
+			 * batch, that job now owns the item.
+			 */
+			int i;
+			for (i = 0; i < batch->n_jobs; i++)
+				if (batch->jobs[i].item == item)
+				{
+					batch->jobs[i].in_list = FALSE;
+					break;
+				}
+			if (i < batch->n_jobs)
+				continue;
+
+			item->flags &= ~(ITEM_FLAG_RESTAT_EARLY |
+					 ITEM_FLAG_IN_RESCAN_QUEUE);
+			if (item->flags & ITEM_FLAG_GONE)
+				diritem_free(item);
+		}
+		else if (item->flags & ITEM_FLAG_GONE)
 			diritem_free(item);
 		else
+			add_job(batch, item, FALSE);
+	}
+}
+
+/* In restat_pool. Only the job's copy of the item is written here; the
+ * main thread may change the item's flags meanwhile, so merge_batch()
+ * copies the results back under dir->mutex. The item is never freed while
+ * it's in a batch because ITEM_FLAG_IN_RESCAN_QUEUE stays set until then.
+ */
+static void restat_job(gpointer data, gpointer unused)
+{
+	RestatJob *job = (RestatJob *) data;
+	RestatBatch *batch = job->batch;
+	DirItem *item = &job->fresh;
+	gchar *path = g_build_filename(batch->pathname, item->leafname, NULL);
+
+	if (!(batch->lazy_stat && item->d_type == DT_DIR &&
+			diritem_restat_dtype(path, item)))
+		diritem_restat_fields(path, item, &batch->dir->stat_info,
+				FALSE, batch->stat_fields | DIRITEM_TYPE_LATER);
+	g_free(path);
+
+	g_mutex_lock(&batch->m);
+	if (--batch->pending == 0)
+		g_cond_signal(&batch->done);
+	g_mutex_unlock(&batch->m);
+}
+
+/* Like the second half of _insert_item, for a whole batch at once.
+ * dir->mutex must be held.
+ */
+static void merge_batch(Directory *dir, RestatBatch *batch)
+{
+	gboolean changed = FALSE;
+
+	g_mutex_lock(&dir->mergem);
+	for (int i = 0; i < batch->n_jobs; i++)
+	{
+		RestatJob *job = &batch->jobs[i];
+		DirItem *item = job->item;
+
+		diritem_restat_apply(item, &job->fresh);
+
+		if (!job->in_list)
+		{
+			item->flags &= ~(ITEM_FLAG_RESTAT_EARLY |
+					 ITEM_FLAG_IN_RESCAN_QUEUE);
+			if (item->flags & ITEM_FLAG_GONE)
+			{
+				diritem_free(item);
+				continue;
+			}
+		}
+		else if (item->flags & ITEM_FLAG_GONE)
+			continue;	/* Freed when the list gets to it */
+
+		if (job->is_new)
+		{
+			if ((item->base_type == TYPE_ERROR &&
+			     item->lstat_errno == ENOENT) ||
+			    g_hash_table_contains(dir->known_items,
+						  item->leafname))
+			{
+				/* Gone again, or added meanwhile */
+				diritem_free(item);
+				continue;
+			}
+
+			g_hash_table_insert(dir->known_items,
+					item->leafname, item);
+			g_ptr_array_add(dir->new_items, item);
+			changed = TRUE;
+		}
+		else if (item->base_type == TYPE_ERROR &&
+				item->lstat_errno == ENOENT)
+		{
+			/* Item has been deleted */
+			if (g_hash_table_remove(dir->known_items, item->leafname))
+			{
+				g_hash_table_insert(dir->gone_items,
+						item->leafname, item);
+				changed = TRUE;
+			}
+			continue;
+		}
+
+		if (item->flags & ITEM_FLAG_NEED_EXAMINE)
 		{
-			item->flags &= ~ITEM_FLAG_IN_RESCAN_QUEUE;
-			item = _insert_item(dir, item, item->leafname, FALSE);
-			if (item && item->flags & ITEM_FLAG_NEED_EXAMINE
-					&& !(item->flags & ITEM_FLAG_IN_EXAMINE))
+			job->old.flags |= ITEM_FLAG_NEED_EXAMINE;
+
+			if (!(item->flags & ITEM_FLAG_IN_EXAMINE))
 			{
 				g_ptr_array_add(dir->examine_list, item);
 				item->flags |= ITEM_FLAG_IN_EXAMINE;
 			}
 		}
+
+		if (job->is_new)
+			continue;
+
+		if (job->do_compare && compare_items(item, &job->old))
+			continue;
+
+		g_ptr_array_add(dir->up_items, item);
+		changed = TRUE;
+	}
+	g_mutex_unlock(&dir->mergem);
+
+	if (changed)
+		delayed_notify(dir, FALSE);
+}
+
+/* This is called in the background when there are items on the
+ * dir->recheck_list to process.
+ */
+static gboolean do_recheck(gpointer data)
+{
+	Directory *dir = (Directory *) data;
+
+	g_return_val_if_fail(dir != NULL, FALSE);
+
+	if (dir->recheck_list->len > dir->rechecki ||
+			g_hash_table_size(dir->urgent_items) ||
+			g_hash_table_size(dir->changed_items))
+	{
+		RestatBatch *batch = g_new(RestatBatch, 1);
+
+		batch->dir = dir;
+		batch->n_jobs = 0;
+		g_mutex_init(&batch->m);
+		g_cond_init(&batch->done);
+
+		g_mutex_lock(&dir->mutex);
+		batch->pathname = g_strdup(dir->pathname);
+		batch->lazy_stat = dir->lazy_stat;
+		batch->stat_fields = dir->stat_fields;
+		take_batch(dir, batch);
+		g_mutex_unlock(&dir->mutex);
+
+		/* Stat them all at once; on network filesystems this
+		 * overlaps the round trips.
+		 */
+		batch->pending = batch->n_jobs;
+		for (int i = 0; i < batch->n_jobs; i++)
+			g_thread_pool_push(restat_pool, &batch->jobs[i], NULL);
+
+		g_mutex_lock(&batch->m);
+		while (batch->pending)
+			g_cond_wait(&batch->done, &batch->m);
+		g_mutex_unlock(&batch->m);
+
+		/* Then look inside the files whose names didn't say what
+		 * they are, all together.
+		 */
+		DirItem *items[RESTAT_BATCH];
+		for (int i = 0; i < batch->n_jobs; i++)
+			items[i] = &batch->jobs[i].fresh;
+		diritem_type_batch(batch->pathname, items, batch->n_jobs);
+
+		g_mutex_lock(&dir->mutex);
+		merge_batch(dir, batch);
+
 		if (dir->recheck_list->len == dir->rechecki)
 		{
 			dir->rechecki = 0;
@@ -481,6 +1053,11 @@ static gboolean do_recheck(gpointer data)
 		g_mutex_unlock(&dir->mutex);
 		g_thread_yield();
 
+		g_mutex_clear(&batch->m);
+		g_cond_clear(&batch->done);
+		g_free(batch->pathname);
+		g_free(batch);
+
 		return TRUE;
 	}
 
@@ -495,7 +1072,7 @@ static gboolean do_recheck(gpointer data)
 			diritem_free(item);
 		else if (item->flags & ITEM_FLAG_NEED_EXAMINE)
 		{
-			if (diritem_examine_dir(
+			if (diritem_examine_dir_at(dir->fd,
 						make_path_to_buf(dir->strbuf, dir->pathname, item->leafname), item))
 			{
 				g_mutex_lock(&dir->mergem);
@@ -560,11 +1137,19 @@ static gboolean recheck_callback(gpointer data)
 		g_thread_join(dir->t_scan);
 		dir->t_scan = NULL;
 
-		//added by this thread
-		if (dir->recheck_list->len || dir->examine_list->len)
-			while (do_recheck(dir));
+		if (g_hash_table_size(dir->changed_items))
+		{
+			/* Reported as it finished; don't stat them here */
+			call_scan_t(dir);
+		}
+		else
+		{
+			//added by this thread
+			if (dir->recheck_list->len || dir->examine_list->len)
+				while (do_recheck(dir));
 
-		dir_set_scanning(dir, FALSE);
+			dir_set_scanning(dir, FALSE);
+		}
 	}
 
 	if (dir->req_notify)
@@ -603,6 +1188,9 @@ static gpointer scan_thread(gpointer data)
 	if (!dir->recheck_list->len)
 		dir->req_scan_off = TRUE;
 
+	/* Subdirectories are examined from here */
+	dir->fd = open(dir->pathname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
 	while (ret)
 	{
 		if (!dir->in_scan_thread) break;
@@ -613,6 +1201,12 @@ static gpointer scan_thread(gpointer data)
 			attach_callback(dir);
 	}
 
+	if (dir->fd != -1)
+	{
+		close(dir->fd);
+		dir->fd = -1;
+	}
+
 	dir->notify_time = 0;
 	dir->in_scan_thread = FALSE;
 	attach_callback(dir);
@@ -623,7 +1217,7 @@ static gpointer scan_thread(gpointer data)
 static void gone_free(DirItem *item)
 {
 	if (item->flags & (ITEM_FLAG_IN_EXAMINE | ITEM_FLAG_IN_RESCAN_QUEUE))
-		item->flags |= ITEM_FLAG_GONE;
+		diritem_mark_gone(item);
 	else
 		diritem_free(item);
 }
@@ -677,6 +1271,9 @@ void dir_merge_new(Directory *dir)
 
 	in_callback--;
 
+	if (new->len || up->len || g_hash_table_size(gone))
+		dir->snap_dirty = TRUE;
+
 	g_ptr_array_free(new, TRUE);
 	g_ptr_array_free(up, TRUE);
 	g_ptr_array_free(exa, TRUE);
@@ -707,8 +1304,8 @@ static gboolean compare_items(DirItem  *item, DirItem  *old)
 	 && item->gid == old->gid
 	 && item->mime_type == old->mime_type
 	 && (old->_image == NULL || _diritem_get_image(item, FALSE) == old->_image)
-	 && (item->label == NULL || (
-			   item->label->red   == old->label->red
+	 && (item->label == NULL || (old->label != NULL
+			&& item->label->red   == old->label->red
 			&& item->label->green == old->label->green
 			&& item->label->blue  == old->label->blue)))
 		return TRUE;
@@ -735,7 +1332,10 @@ static DirItem *_insert_item(Directory *dir, DirItem *item, const guchar *leafna
 			old = *item;
 			do_compare = TRUE;
 		}
-		diritem_restat(full_path, item, &dir->stat_info, examine_now);
+		if (!(dir->lazy_stat && item->d_type == DT_DIR &&
+				diritem_restat_dtype(full_path, item)))
+			diritem_restat_fields(full_path, item, &dir->stat_info,
+					examine_now, dir->stat_fields);
 
 		if (item->base_type == TYPE_ERROR && item->lstat_errno == ENOENT)
 		{
@@ -764,8 +1364,9 @@ static DirItem *_insert_item(Directory *dir, DirItem *item, const guchar *leafna
 	}
 	else
 	{
-		item = diritem_new(leafname);
-		diritem_restat(full_path, item, &dir->stat_info, examine_now);
+		item = diritem_new_in(dir->arena, leafname);
+		diritem_restat_fields(full_path, item, &dir->stat_info,
+				examine_now, dir->stat_fields);
 
 		if (item->base_type == TYPE_ERROR && item->lstat_errno == ENOENT)
 		{
@@ -803,8 +1404,14 @@ static DirItem *insert_item(Directory *dir, const guchar *leafname, gboolean exa
 
 void dir_update(Directory *dir, gchar *pathname)
 {
+	/* dirs_by_path keeps its own copy of the path; move the entry */
+	g_mutex_lock(&hash_lock);
+	if (g_hash_table_lookup(dirs_by_path, dir->pathname) == dir)
+		g_hash_table_remove(dirs_by_path, dir->pathname);
 	g_free(dir->pathname);
 	dir->pathname = pathdup(pathname);
+	g_hash_table_replace(dirs_by_path, g_strdup(dir->pathname), dir);
+	g_mutex_unlock(&hash_lock);
 
 	if (dir->scanning)
 		dir->needs_update = TRUE;
@@ -828,7 +1435,8 @@ void refresh_dirs(const char *path)
 static void call_scan_t(Directory *dir)
 {
 	if (dir->users &&
-			(dir->recheck_list->len || dir->examine_list->len))
+			(dir->recheck_list->len || dir->examine_list->len ||
+			 g_hash_table_size(dir->changed_items)))
 	{
 		/* Work to do, and someone's watching */
 
@@ -841,6 +1449,11 @@ static void call_scan_t(Directory *dir)
 		dir->req_scan_off = FALSE;
 		dir->in_scan_thread = TRUE;
 		dir->req_notify = FALSE;
+
+		if (!restat_pool)
+			restat_pool = g_thread_pool_new(restat_job, NULL,
+					restat_threads(), FALSE, NULL);
+
 		dir->t_scan = g_thread_new("rescan_t", scan_thread, dir);
 	}
 	else
@@ -894,7 +1507,8 @@ static void _inlist_clear(DirItem *item, gpointer user_data)
 	if (item->flags & ITEM_FLAG_GONE)
 		diritem_free(item);
 	else
-		item->flags &= ~(ITEM_FLAG_IN_EXAMINE | ITEM_FLAG_IN_RESCAN_QUEUE);
+		item->flags &= ~(ITEM_FLAG_IN_EXAMINE | ITEM_FLAG_IN_RESCAN_QUEUE |
+				 ITEM_FLAG_RESTAT_EARLY);
 }
 static void inlist_clear(GPtrArray *pta)
 {
@@ -916,6 +1530,8 @@ static void dir_finialize(GObject *object)
 	call_scan_t(dir);
 	if (dir->rescan_timeout != -1)
 		g_source_remove(dir->rescan_timeout);
+	if (dir->change_timeout != -1)
+		g_source_remove(dir->change_timeout);
 
 	dir_merge_new(dir);	/* Ensures new, up and gone are empty */
 
@@ -930,11 +1546,21 @@ static void dir_finialize(GObject *object)
 
 	g_hash_table_foreach_remove(dir->known_items, free_items, NULL);
 	g_hash_table_destroy(dir->known_items);
+	g_hash_table_destroy(dir->urgent_items);
+	g_hash_table_destroy(dir->changed_items);
 
 	g_string_free(dir->strbuf, TRUE);
 	g_mutex_clear(&dir->mutex);
 	g_mutex_clear(&dir->mergem);
 
+	diritem_arena_free(dir->arena);
+
+	g_mutex_lock(&hash_lock);
+	if (g_hash_table_lookup(dirs_by_path, dir->pathname) == dir)
+		g_hash_table_remove(dirs_by_path, dir->pathname);
+	g_hash_table_destroy(dir->thumb_hashes);
+	g_mutex_unlock(&hash_lock);
+
 	g_free(dir->error);
 	g_free(dir->pathname);
 
@@ -957,8 +1583,16 @@ static void directory_init(GTypeInstance *object, gpointer gclass)
 	g_mutex_init(&dir->mutex);
 	g_mutex_init(&dir->mergem);
 	dir->strbuf = g_string_new(NULL);
+	dir->fd = -1;
 
+	dir->arena = diritem_arena_new();
 	dir->known_items = g_hash_table_new(g_str_hash, g_str_equal);
+	dir->urgent_items = g_hash_table_new_full(
+			g_str_hash, g_str_equal, g_free, NULL);
+	dir->changed_items = g_hash_table_new_full(
+			g_str_hash, g_str_equal, g_free, NULL);
+	dir->thumb_hashes = g_hash_table_new_full(
+			g_str_hash, g_str_equal, g_free, g_free);
 	dir->recheck_list = g_ptr_array_new();
 	dir->rechecki = 0;
 	dir->examine_list = g_ptr_array_new();
@@ -970,6 +1604,9 @@ static void directory_init(GTypeInstance *object, gpointer gclass)
 	dir->req_notify = FALSE;
 	dir->scanning = FALSE;
 	dir->have_scanned = FALSE;
+	dir->snap_dirty = FALSE;
+	dir->lazy_stat = FALSE;
+	dir->stat_fields = DIRITEM_STAT_ALL;
 
 	dir->users = NULL;
 	dir->needs_update = TRUE;
@@ -978,6 +1615,7 @@ static void directory_init(GTypeInstance *object, gpointer gclass)
 	dir->pathname = NULL;
 	dir->error = NULL;
 	dir->rescan_timeout = -1;
+	dir->change_timeout = -1;
 	dir->monitor = NULL;
 
 	dir->new_items = g_ptr_array_new();
@@ -1022,6 +1660,10 @@ Directory *dir_new(const char *pathname)
 
 	dir->pathname = g_strdup(pathname);
 
+	g_mutex_lock(&hash_lock);
+	g_hash_table_replace(dirs_by_path, g_strdup(pathname), dir);
+	g_mutex_unlock(&hash_lock);
+
 	return dir;
 }
 
@@ -1046,6 +1688,124 @@ static gboolean checkthiscb(char *path)
 	return FALSE;
 }
 
+/* Called by the readers below for each name in the directory.
+ * d_type is the type from the directory entry, or DT_UNKNOWN.
+ */
+static void scan_entry(Directory *dir, const char *name, guchar d_type)
+{
+	if (name[0] == '.')
+	{
+		if (name[1] == '\0')
+			return;		/* Ignore '.' */
+		if (name[1] == '.' && name[2] == '\0')
+			return;		/* Ignore '..' */
+	}
+
+	DirItem *old;
+	if (dir->have_scanned &&
+			(old = g_hash_table_lookup(dir->known_items, name)))
+	{
+		/* ITEM_FLAG_NEED_RESCAN_QUEUE is cleared when the item is added
+		 * to the rescan list.
+		 */
+		old->flags |= ITEM_FLAG_NEED_RESCAN_QUEUE | ITEM_FLAG_NOT_DELETE;
+		old->d_type = d_type;
+	}
+	else
+	{
+		DirItem *new;
+
+		new = diritem_new_in(dir->arena, name);
+		new->flags |= ITEM_FLAG_NEED_RESCAN_QUEUE;
+		new->d_type = d_type;
+
+		if (dir->have_scanned)
+			new->flags |= ITEM_FLAG_NOT_DELETE;
+
+		g_ptr_array_add(dir->new_items, new);
+		g_hash_table_insert(dir->known_items, new->leafname, new);
+	}
+}
+
+/* One entry at a time, through mc_readdir(). */
+static gboolean read_entries_readdir(Directory *dir, const char *pathname)
+{
+	DIR *d = mc_opendir(pathname);
+	if (!d)
+		return FALSE;
+
+	struct dirent *ent;
+	while ((ent = mc_readdir(d)))
+#ifdef _DIRENT_HAVE_D_TYPE
+		scan_entry(dir, ent->d_name, ent->d_type);
+#else
+		scan_entry(dir, ent->d_name, DT_UNKNOWN);
+#endif
+	mc_closedir(d);
+
+	return TRUE;
+}
+
+/* Pass every name in pathname to scan_entry().
+ * Returns FALSE, with errno set, if the directory can't be opened.
+ */
+static gboolean read_entries(Directory *dir, const char *pathname)
+{
+#ifdef USE_GETDENTS64
+	int fd = open(pathname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return read_entries_readdir(dir, pathname);
+
+	char *buf = g_malloc(DENTS_BUF_SIZE);
+	gboolean got_any = FALSE;
+	long n;
+
+	while ((n = syscall(SYS_getdents64, fd, buf, DENTS_BUF_SIZE)) > 0)
+	{
+		/* Names point into buf; diritem_new() takes its own copy */
+		for (long pos = 0; pos < n; )
+		{
+			struct linux_dirent64 *d = (void *) (buf + pos);
+
+			scan_entry(dir, d->d_name, d->d_type);
+			pos += d->d_reclen;
+		}
+		got_any = TRUE;
+	}
+
+	int err = errno;
+	g_free(buf);
+	close(fd);
+
+	if (n < 0 && !got_any && (err == ENOSYS || err == EINVAL))
+		return read_entries_readdir(dir, pathname); /* e.g. seccomp */
+
+	return TRUE;
+#else
+	return read_entries_readdir(dir, pathname);
+#endif
+}
+
+/* Copy the names of the items still in use to a new chunk. known_items is
+ * keyed on them, so it's refilled.
+ */
+static void compact_arena(Directory *dir)
+{
+	GPtrArray *items = hash_to_array(dir->known_items);
+
+	g_hash_table_steal_all(dir->known_items);
+	diritem_arena_compact(dir->arena);
+
+	for (guint i = 0; i < items->len; i++)
+	{
+		DirItem *item = items->pdata[i];
+
+		g_hash_table_insert(dir->known_items, item->leafname, item);
+	}
+
+	g_ptr_array_free(items, TRUE);
+}
+
 /* Get the names of all files in the directory.
  * Remove any DirItems that are no longer listed.
  * Replace the recheck_list with the items found.
@@ -1056,6 +1816,9 @@ static void dir_scan(Directory *dir)
 
 	stop_scan_t(dir);
 
+	/* Reading everything covers whatever the monitor reported */
+	g_hash_table_remove_all(dir->changed_items);
+
 	const char *pathname = dir->pathname;
 	gboolean isupdate = dir->needs_update && !dir->error;
 	dir->needs_update = FALSE;
@@ -1081,54 +1844,31 @@ static void dir_scan(Directory *dir)
 		return;		/* Report on attach */
 	}
 
-	DIR *d = mc_opendir(pathname);
-	if (!d)
+	dir_set_scanning(dir, TRUE);
+
+	/* Show the last listing while we read the real one. Items that have
+	 * gone are removed by check_delete() below, and changed ones are
+	 * updated when they are restatted.
+	 */
+	gboolean from_snap = FALSE;
+	if (!dir->have_scanned && o_dir_snapshots.int_value &&
+			dirsnap_load(dir))
 	{
-		dir->error = g_strdup_printf(_("Can't open directory: %s"),
-				g_strerror(errno));
-		dir_error_changed(dir);
-		return;		/* Report on attach */
+		dir_merge_new(dir);
+		dir->have_scanned = from_snap = TRUE;
+		dir->snap_dirty = FALSE;
 	}
 
-	dir_set_scanning(dir, TRUE);
 	gdk_flush();
 
-	struct dirent *ent;
-	while ((ent = mc_readdir(d)))
+	if (!read_entries(dir, pathname))
 	{
-		if (ent->d_name[0] == '.')
-		{
-			if (ent->d_name[1] == '\0')
-				continue;		/* Ignore '.' */
-			if (ent->d_name[1] == '.' && ent->d_name[2] == '\0')
-				continue;		/* Ignore '..' */
-		}
-
-		DirItem *old;
-		if (dir->have_scanned &&
-				(old = g_hash_table_lookup(dir->known_items, ent->d_name)))
-		{
-			/* ITEM_FLAG_NEED_RESCAN_QUEUE is cleared when the item is added
-			 * to the rescan list.
-			 */
-			old->flags |= ITEM_FLAG_NEED_RESCAN_QUEUE | ITEM_FLAG_NOT_DELETE;
-
-		}
-		else
-		{
-			DirItem *new;
-
-			new = diritem_new(ent->d_name);
-			new->flags |= ITEM_FLAG_NEED_RESCAN_QUEUE;
-
-			if (dir->have_scanned)
-				new->flags |= ITEM_FLAG_NOT_DELETE;
-
-			g_ptr_array_add(dir->new_items, new);
-			g_hash_table_insert(dir->known_items, new->leafname, new);
-		}
+		dir->error = g_strdup_printf(_("Can't open directory: %s"),
+				g_strerror(errno));
+		dir_error_changed(dir);
+		dir_set_scanning(dir, FALSE);
+		return;		/* Report on attach */
 	}
-	mc_closedir(d);
 
 	if (dir->have_scanned)
 	{
@@ -1144,18 +1884,184 @@ static void dir_scan(Directory *dir)
 
 	dir_merge_new(dir);
 
+	/* The scan thread is stopped and known_items is up to date, so
+	 * it's a good time to drop the names of those removed.
+	 */
+	if (diritem_arena_wasteful(dir->arena))
+		compact_arena(dir);
+
 	/* Ask everyone which items they need to display, and add them to
 	 * the recheck list. Typically, this means we don't waste time
 	 * scanning hidden items.
+	 * Users that show more than the names clear lazy_stat, and add
+	 * the details they show to stat_fields.
 	 */
+	dir->lazy_stat = o_dir_lazy_stat.int_value;
+	dir->stat_fields = 0;
 	tousers(dir, DIR_QUEUE_INTERESTING, NULL);
 
 	call_scan_t(dir);
 
-	if (dir->have_scanned)
+	if (dir->have_scanned && !from_snap)
 		//this means files are changed by rox
 		//by other prog, still needs the scan btn because it is very heavy.
 		//and this func is called in the lock of fscache. so have to be idle
 		g_idle_add((GSourceFunc)checkthiscb, g_strdup(dir->pathname));
 	dir->have_scanned = TRUE;
 }
+
+#ifdef UNIT_TESTS
+/* The name of entry i in a scan fixture. One in ten is a subdirectory. */
+static void fixture_entry(GString *buf, const char *dir, int i)
+{
+	g_string_printf(buf, "%s/entry-%07d%s", dir, i, i % 10 ? ".txt" : "");
+}
+
+/* A new temporary directory of n entries. remove_scan_fixture() it. */
+static gchar *make_scan_fixture(int n)
+{
+	gchar *tmp = g_dir_make_tmp("rox-scan-XXXXXX", NULL);
+	GString *buf = g_string_new(NULL);
+
+	if (!tmp)
+		g_error("Can't make temporary directory");
+
+	for (int i = 0; i < n; i++)
+	{
+		fixture_entry(buf, tmp, i);
+		if (i % 10 == 0)
+			mkdir(buf->str, 0755);
+		else
+			close(open(buf->str, O_WRONLY | O_CREAT, 0644));
+	}
+
+	g_string_free(buf, TRUE);
+	return tmp;
+}
+
+static void remove_scan_fixture(gchar *tmp, int n)
+{
+	GString *buf = g_string_new(NULL);
+
+	for (int i = 0; i < n; i++)
+	{
+		fixture_entry(buf, tmp, i);
+		if (i % 10 == 0)
+			rmdir(buf->str);
+		else
+			unlink(buf->str);
+	}
+	rmdir(tmp);
+
+	g_string_free(buf, TRUE);
+	g_free(tmp);
+}
+
+/* The tests run before dir_init(), so they bring their own dirs_by_path
+ * for dir_new() and free it again before dir_init() makes the real one.
+ */
+static void tests_begin(void)
+{
+	g_assert(dirs_by_path == NULL);
+	dirs_by_path = g_hash_table_new_full(g_str_hash, g_str_equal,
+					     g_free, NULL);
+}
+
+static void tests_end(void)
+{
+	g_assert(g_hash_table_size(dirs_by_path) == 0);
+	g_hash_table_destroy(dirs_by_path);
+	dirs_by_path = NULL;
+}
+
+/* A Directory with path's entries in new_items and known_items, as read by
+ * reader. g_object_unref() it.
+ */
+static Directory *scan_with(const char *path,
+		gboolean (*reader)(Directory *, const char *))
+{
+	Directory *dir = dir_new(path);
+
+	if (!reader(dir, path))
+		g_error("Can't read '%s': %s", path, g_strerror(errno));
+
+	return dir;
+}
+
+/* Both readers list the same names, with the same d_type hints */
+void dir_tests(void)
+{
+	int n = 500;
+	gchar *tmp = make_scan_fixture(n);
+	GString *buf = g_string_new(NULL);
+	Directory *plain, *bulk;
+
+	tests_begin();
+	plain = scan_with(tmp, read_entries_readdir);
+	bulk = scan_with(tmp, read_entries);
+
+	g_assert_cmpuint(plain->new_items->len, ==, n);
+	g_assert_cmpuint(bulk->new_items->len, ==, n);
+
+	for (int i = 0; i < n; i++)
+	{
+		const char *leaf;
+		DirItem *a, *b;
+
+		fixture_entry(buf, tmp, i);
+		leaf = strrchr(buf->str, '/') + 1;
+		a = g_hash_table_lookup(plain->known_items, leaf);
+		b = g_hash_table_lookup(bulk->known_items, leaf);
+
+		g_assert(a != NULL && b != NULL);
+		g_assert_cmpint(a->d_type, ==, b->d_type);
+	}
+
+	g_object_unref(plain);
+	g_object_unref(bulk);
+	tests_end();
+	g_string_free(buf, TRUE);
+	remove_scan_fixture(tmp, n);
+}
+
+static void bench_scan(const char *path, const char *what,
+		gboolean (*reader)(Directory *, const char *))
+{
+	gint64 start = g_get_monotonic_time();
+	Directory *dir = scan_with(path, reader);
+
+	g_print("%-10s %7u entries in %7.1f ms\n", what, dir->new_items->len,
+			(g_get_monotonic_time() - start) / 1000.0);
+
+	g_object_unref(dir);
+}
+
+/* Times the listing part of dir_scan() (reading names and creating the
+ * DirItems) with both readers. Uses $ROX_SCAN_BENCH_DIR if set, otherwise
+ * a fixture of $ROX_SCAN_BENCH_SIZE (default 200000) entries, which is
+ * removed again afterwards.
+ */
+void dir_scan_benchmark(void)
+{
+	const char *path = g_getenv("ROX_SCAN_BENCH_DIR");
+	const char *env_size = g_getenv("ROX_SCAN_BENCH_SIZE");
+	int n = env_size ? atoi(env_size) : 200000;
+	gchar *tmp = NULL;
+
+	if (!path)
+	{
+		g_print("Creating %d entries...\n", n);
+		path = tmp = make_scan_fixture(n);
+	}
+
+	tests_begin();
+	/* Once to warm the dentry cache, then for real */
+	bench_scan(path, "(warm-up)", read_entries_readdir);
+	bench_scan(path, "readdir", read_entries_readdir);
+	bench_scan(path, "bulk", read_entries);
+	tests_end();
+
+	if (tmp)
+		remove_scan_fixture(tmp, n);
+}
+#endif
@@ -67,7 +67,9 @@ struct _Directory
 	GMutex		mutex;
 	GMutex		mergem;
 	GString		*strbuf;
+	int		fd;		/* Open during scan_thread(), or -1 */
 
+	DirItemArena	*arena;		/* Holds all our DirItems */
 	GHashTable 	*known_items;	/* What our users know about */
 	GPtrArray	*new_items;	/* New items to add in */
 	GPtrArray	*up_items;	/* Items to redraw */
@@ -78,9 +80,14 @@ struct _Directory
 	int rechecki;
 	GPtrArray	*examine_list;	/* Items to examine on callback */
 	int examinei;
+	GHashTable	*urgent_items;	/* Leafnames to restat first (mergem) */
+	GHashTable	*thumb_hashes;	/* Leafname -> MD5 naming its thumbnail */
 
 	gboolean	have_scanned;	/* TRUE after first complete scan */
 	gboolean	scanning;	/* TRUE if we sent DIR_START_SCAN */
+	gboolean	snap_dirty;	/* Listing differs from the snapshot */
+	gboolean	lazy_stat;	/* No user shows more than names */
+	int		stat_fields;	/* DirItemFields any user shows */
 
 	/* Indicates that the directory needs to be rescanned.
 	 * This is cleared when scanning starts, and set when the fscache
@@ -93,6 +100,8 @@ struct _Directory
 	gboolean	needs_update;
 
 	gint		rescan_timeout;	/* See dir_rescan_soon() */
+	GHashTable	*changed_items;	/* Leafnames the monitor reported (mutex) */
+	gint		change_timeout;	/* Hands changed_items to the scan thread */
 
 	GFileMonitor *monitor;
 };
@@ -109,6 +118,17 @@ void dir_merge_new(Directory *dir);
 void dir_force_update_path(const gchar *path, gboolean icon);
 void dir_drop_all_notifies(void);
 void dir_queue_recheck(Directory *dir, DirItem *item);
+void dir_restat_first(Directory *dir, DirItem *item);
+gchar *dir_thumb_hash(const char *path);
+void dir_add_thumb_hash(const char *path, const char *md5);
+GPtrArray *dir_unhashed_thumbs(const char *dirpath, GPtrArray *leafnames);
+void dir_add_thumb_hashes(const char *dirpath, GPtrArray *leafnames,
+			  char **md5s);
 void dir_stop(void); /* stop all scan thread */
 
+#ifdef UNIT_TESTS
+void dir_tests(void);
+void dir_scan_benchmark(void);
+#endif
+
 #endif /* _DIR_H */
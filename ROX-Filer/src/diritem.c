@@ -29,8 +29,16 @@
 #include <gtk/gtk.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_STATX
+# include <sys/sysmacros.h>
+#endif
 
 #include "global.h"
 
@@ -51,6 +59,25 @@
  * the current time before calling diritem_restat().
  */
 time_t diritem_recent_time;
+
+/* Flags that belong to the Directory's queues rather than the file */
+#define ITEM_FLAGS_KEEP (ITEM_FLAG_CAPS | ITEM_FLAG_IN_RESCAN_QUEUE | \
+		ITEM_FLAG_IN_EXAMINE | ITEM_FLAG_RESTAT_EARLY)
+
+/* Arenas hand out DirItems from blocks of this many */
+#define ARENA_SLAB 1024
+
+struct _DirItemArena {
+	GMutex		m;
+	GSList		*slabs;
+	int		slab_used;	/* Items taken from slabs->data */
+	DirItem		*free_items;	/* Freed, linked through leafname */
+	GStringChunk	*strings;	/* Names and collate keys */
+	gsize		n_items;	/* In use */
+	gsize		string_bytes;
+	gsize		wasted_bytes;	/* Strings of freed items */
+};
+
 static GMutex m_diritems;
 static GSList *mfree = NULL; //free on main loop
 static GSList *munref = NULL; //unref on main loop
@@ -73,6 +100,98 @@ static gboolean onmaincb(void *notused)
 	return FALSE;
 }
 
+/* lstat() (or stat() if follow) into info. Sets *got to the DirItemFields
+ * that were filled in, and *mount_root to whether this is the root of a
+ * mounted filesystem, or -1 if that isn't known.
+ */
+static int get_stat(const char *path, gboolean follow, int fields,
+		struct stat *info, int *got, int *mount_root)
+{
+#ifdef HAVE_STATX
+	/* Only ask for what will be shown; on network filesystems the
+	 * server may not have to work out the rest. The kernel also tells
+	 * us about mount points, saving a stat() of the parent.
+	 */
+	struct statx stx;
+	unsigned int mask = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE;
+
+	/* ITEM_FLAG_RECENT (drawn in bold) always needs these two */
+	mask |= STATX_MTIME | STATX_CTIME;
+	if (fields & DIRITEM_STAT_TIMES)
+		mask |= STATX_ATIME;
+	if (fields & DIRITEM_STAT_OWNER)
+		mask |= STATX_UID | STATX_GID;
+
+	if (statx(AT_FDCWD, path, follow ? 0 : AT_SYMLINK_NOFOLLOW,
+				mask, &stx))
+		return -1;
+
+	memset(info, 0, sizeof(*info));
+	info->st_mode = stx.stx_mode;
+	info->st_ino = stx.stx_ino;
+	info->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	info->st_size = stx.stx_size;
+
+	*got = 0;
+	if (stx.stx_mask & STATX_ATIME)
+		info->st_atime = stx.stx_atime.tv_sec;
+	if (stx.stx_mask & STATX_MTIME)
+		info->st_mtime = stx.stx_mtime.tv_sec;
+	if (stx.stx_mask & STATX_CTIME)
+		info->st_ctime = stx.stx_ctime.tv_sec;
+	if ((stx.stx_mask & (STATX_ATIME | STATX_MTIME | STATX_CTIME)) ==
+			(STATX_ATIME | STATX_MTIME | STATX_CTIME))
+		*got |= DIRITEM_STAT_TIMES;
+	if ((stx.stx_mask & (STATX_UID | STATX_GID)) == (STATX_UID | STATX_GID))
+	{
+		info->st_uid = stx.stx_uid;
+		info->st_gid = stx.stx_gid;
+		*got |= DIRITEM_STAT_OWNER;
+	}
+
+	*mount_root = -1;
+# ifdef STATX_ATTR_MOUNT_ROOT
+	if (stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT)
+		*mount_root = (stx.stx_attributes & STATX_ATTR_MOUNT_ROOT) != 0;
+# endif
+	return 0;
+#else
+	*got = DIRITEM_STAT_ALL;
+	*mount_root = -1;
+	return follow ? mc_stat(path, info) : mc_lstat(path, info);
+#endif
+}
+
+/* type_from_path(), skipping the xattr lookup if the file has none */
+static MIME_type *mime_from_path(const char *path, DirItem *item)
+{
+	if (item->flags & ITEM_FLAG_HAS_XATTR)
+		return type_from_path(path);
+	return type_from_path_no_xattr(path);
+}
+
+/* Set the type of a regular file, given what its name and contents say.
+ * ITEM_FLAG_EXEC_FILE must already be set if it has an X bit.
+ */
+static void set_file_type(DirItem *item, MIME_type *type)
+{
+	if (item->flags & ITEM_FLAG_EXEC_FILE)
+	{
+		/* Note that the flag is set for ALL executable files, but
+		 * the mime_type must also be executable for clicking on the
+		 * file to run it.
+		 */
+		if (type == NULL || type == application_octet_stream)
+			type = application_executable;
+		else if (type == text_plain && !strchr(item->leafname, '.'))
+			type = application_x_shellscript;
+	}
+	else if (type == application_x_desktop)
+		item->flags |= ITEM_FLAG_EXEC_FILE;
+
+	item->mime_type = type ? type : text_plain;
+}
+
 /****************************************************************
  *			EXTERNAL INTERFACE			*
  ****************************************************************/
@@ -90,21 +209,37 @@ void diritem_restat(
 		DirItem *retitem,
 		struct stat *parent,
 		gboolean examine_now)
+{
+	diritem_restat_fields(path, retitem, parent, examine_now,
+			DIRITEM_STAT_ALL);
+}
+
+/* As diritem_restat(), but the details not in 'fields' (DirItemFields) may
+ * be left unset, in which case ITEM_FLAG_LAZY_STAT is set.
+ */
+void diritem_restat_fields(
+		const guchar *path,
+		DirItem *retitem,
+		struct stat *parent,
+		gboolean examine_now,
+		int fields)
 {
 	struct stat	info;
+	int		got;		/* DirItemFields filled in */
+	int		mount_root;	/* 1, 0 or -1 if not known */
 
 	g_mutex_lock(&m_diritems);
 	DirItem newitem = *retitem;
 	g_mutex_unlock(&m_diritems);
 
 	DirItem *item = &newitem;
+	MIME_type *old_type = item->mime_type;
 
 	item->_image = NULL;
-	item->flags &=
-		(ITEM_FLAG_CAPS | ITEM_FLAG_IN_RESCAN_QUEUE | ITEM_FLAG_IN_EXAMINE);
+	item->flags &= ITEM_FLAGS_KEEP;
 	item->mime_type = NULL;
 
-	if (mc_lstat(path, &info) == -1)
+	if (get_stat(path, FALSE, fields, &info, &got, &mount_root) == -1)
 	{
 		item->lstat_errno = errno;
 		item->base_type = TYPE_ERROR;
@@ -124,8 +259,10 @@ void diritem_restat(
 		item->atime = info.st_atime;
 		item->ctime = info.st_ctime;
 		item->mtime = info.st_mtime;
-		item->uid = info.st_uid;
-		item->gid = info.st_gid;
+		item->uid = got & DIRITEM_STAT_OWNER ? info.st_uid : (uid_t) -1;
+		item->gid = got & DIRITEM_STAT_OWNER ? info.st_gid : (gid_t) -1;
+		if (got != DIRITEM_STAT_ALL)
+			item->flags |= ITEM_FLAG_LAZY_STAT;
 		if (ABOUT_NOW(item->mtime) || ABOUT_NOW(item->ctime))
 			item->flags |= ITEM_FLAG_RECENT;
 
@@ -140,11 +277,16 @@ void diritem_restat(
 			retitem->label = NULL;
 			g_mutex_unlock(&m_diritems);
 		}
-		item->label = xlabel_get(path);
+		/* Labels are stored as xattrs; don't ask if there are none */
+		if (item->flags & ITEM_FLAG_HAS_XATTR)
+			item->label = xlabel_get(path);
+		else
+			item->label = NULL;
 
 		if (S_ISLNK(info.st_mode))
 		{
-			if (mc_stat(path, &info))
+			if (get_stat(path, TRUE, fields,
+					&info, &got, &mount_root))
 				item->base_type = TYPE_ERROR;
 			else
 				item->base_type =
@@ -163,7 +305,8 @@ void diritem_restat(
 		if (item->base_type == TYPE_DIRECTORY)
 		{
 			item->size = 0;
-			if (mount_is_mounted(target_path, &info,
+			if (mount_root != -1 ? mount_root :
+				mount_is_mounted(target_path, &info,
 					target_path == path ? parent : NULL))
 				item->flags |= ITEM_FLAG_MOUNT_POINT
 						| ITEM_FLAG_MOUNTED;
@@ -202,45 +345,28 @@ void diritem_restat(
 	}
 	else if (item->base_type == TYPE_FILE)
 	{
-		if (item->flags & ITEM_FLAG_SYMLINK)
-		{
-			guchar *link_path;
-			link_path = pathdup(path);
-			item->mime_type = type_from_path(link_path
-					? link_path
-					: path);
-			g_free(link_path);
-		}
-		else
-			item->mime_type = type_from_path(path);
-
 		/* Note: for symlinks we need the mode of the target */
 		if (info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))
-		{
-			/* Note that the flag is set for ALL executable
-			 * files, but the mime_type must also be executable
-			 * for clicking on the file to run it.
-			 */
 			item->flags |= ITEM_FLAG_EXEC_FILE;
 
-			if (item->mime_type == NULL ||
-			    item->mime_type == application_octet_stream)
-			{
-				item->mime_type = application_executable;
-			}
-			else if (item->mime_type == text_plain &&
-			         !strchr(item->leafname, '.'))
-			{
-				item->mime_type = application_x_shellscript;
-			}
+		if ((fields & DIRITEM_TYPE_LATER) &&
+		    !(item->flags & (ITEM_FLAG_SYMLINK | ITEM_FLAG_HAS_XATTR)))
+		{
+			/* Until then, keep whatever we thought before */
+			item->flags |= ITEM_FLAG_NEED_TYPE;
+			item->mime_type = old_type ? old_type : text_plain;
 		}
-		else if (item->mime_type == application_x_desktop)
+		else if (item->flags & ITEM_FLAG_SYMLINK)
 		{
-			item->flags |= ITEM_FLAG_EXEC_FILE;
+			guchar *link_path;
+			link_path = pathdup(path);
+			set_file_type(item, mime_from_path(link_path
+					? link_path
+					: path, item));
+			g_free(link_path);
 		}
-
-		if (!item->mime_type)
-			item->mime_type = text_plain;
+		else
+			set_file_type(item, mime_from_path(path, item));
 
 		check_globicon(path, item);
 
@@ -260,6 +386,9 @@ void diritem_restat(
 	g_mutex_lock(&m_diritems);
 	if (retitem->_image)
 		munref = g_slist_prepend(munref, retitem->_image);
+	/* May have been removed from the directory while we were busy */
+	newitem.flags |= retitem->flags & ITEM_FLAG_GONE;
+	newitem.collatekey = retitem->collatekey;	/* May have been made */
 	*retitem = newitem;
 	g_mutex_unlock(&m_diritems);
 
@@ -267,32 +396,292 @@ void diritem_restat(
 		diritem_examine_dir(path, retitem);
 }
 
-DirItem *diritem_new(const guchar *leafname)
+/* Finish typing the items that were restatted with DIRITEM_TYPE_LATER,
+ * all in 'dirpath'. Their names are checked first and the files that
+ * still need reading are read together (see type_from_leafnames_at()).
+ * The items mustn't be freed meanwhile.
+ */
+void diritem_type_batch(const guchar *dirpath, DirItem **items, int n_items)
 {
-	DirItem		*item;
+	DirItem **todo = g_new(DirItem *, n_items);
+	const char **leafnames = g_new(const char *, n_items);
+	MIME_type **types = g_new(MIME_type *, n_items);
+	int i, n = 0;
+	int dir_fd;
 
-	item = g_new0(DirItem, 1);
-	item->leafname = g_strdup(leafname);
-	item->base_type = TYPE_UNKNOWN;
+	for (i = 0; i < n_items; i++)
+	{
+		if (items[i]->flags & ITEM_FLAG_NEED_TYPE)
+		{
+			todo[n] = items[i];
+			leafnames[n++] = items[i]->leafname;
+		}
+	}
+
+	dir_fd = n ? open((const char *) dirpath, O_RDONLY | O_DIRECTORY) : -1;
+	if (dir_fd != -1)
+	{
+		type_from_leafnames_at(dir_fd, leafnames, types, n);
+		close(dir_fd);
+	}
+	else
+	{
+		for (i = 0; i < n; i++)
+		{
+			gchar *path = g_build_filename((const char *) dirpath,
+						       leafnames[i], NULL);
+			types[i] = type_from_path_no_xattr(path);
+			g_free(path);
+		}
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		DirItem *item = todo[i];
+
+		g_mutex_lock(&m_diritems);
+		/* Not if it was restatted again meanwhile */
+		if (item->flags & ITEM_FLAG_NEED_TYPE)
+		{
+			item->flags &= ~ITEM_FLAG_NEED_TYPE;
+			set_file_type(item, types[i]);
+
+			if (item->mime_type == application_x_desktop &&
+			    item->_image == NULL)
+			{
+				gchar *path = g_build_filename(
+						(const char *) dirpath,
+						item->leafname, NULL);
+				item->_image = pixmap_from_desktop_file(path);
+				g_free(path);
+			}
+		}
+		g_mutex_unlock(&m_diritems);
+	}
+
+	g_free(todo);
+	g_free(leafnames);
+	g_free(types);
+}
+
+/* Fill in the item from its d_type alone, without statting it. Only done
+ * for directories: they need no permission bits to be shown or opened, and
+ * diritem_examine_dir() does its own lstat() for the ownership checks.
+ * Returns FALSE if the item needs a full diritem_restat() instead.
+ */
+gboolean diritem_restat_dtype(const guchar *path, DirItem *item)
+{
+	if (item->d_type != DT_DIR)
+		return FALSE;
+
+	g_mutex_lock(&m_diritems);
+	if (item->_image)
+		munref = g_slist_prepend(munref, item->_image);
+	item->_image = NULL;
+	if (item->label)
+		mfree = g_slist_prepend(mfree, item->label);
+	item->label = NULL;
+
+	item->flags &= ITEM_FLAGS_KEEP | ITEM_FLAG_GONE;
+	item->flags |= ITEM_FLAG_LAZY_STAT;
+	item->lstat_errno = 0;
+	item->base_type = TYPE_DIRECTORY;
+	item->mode = S_IFDIR;
+	item->size = 0;
+	item->mtime = item->ctime = item->atime = 0;
+	item->uid = (uid_t) -1;
+	item->gid = (gid_t) -1;
+	item->mime_type = inode_directory;
+
+	/* Mounted filesystems need a stat to spot, but the fstab ones are
+	 * known. Don't examine them, as for diritem_restat().
+	 */
+	if (g_hash_table_lookup(fstab_mounts, path))
+	{
+		item->flags |= ITEM_FLAG_MOUNT_POINT;
+		item->mime_type = inode_mountpoint;
+	}
+	else
+		item->flags |= ITEM_FLAG_NEED_EXAMINE;
+
+	check_globicon(path, item);
+	g_mutex_unlock(&m_diritems);
+
+	return TRUE;
+}
+
+/* TRUE if name is all ASCII, checking a word at a time */
+static gboolean is_ascii(const char *name, gsize len)
+{
+	const char *p = name;
+	guint64 word, bits = 0;
+
+	for (; len >= sizeof(word); p += sizeof(word), len -= sizeof(word))
+	{
+		memcpy(&word, p, sizeof(word));
+		bits |= word;
+	}
+	if (bits & G_GUINT64_CONSTANT(0x8080808080808080))
+		return FALSE;
+
+	for (; len; p++, len--)
+		if (*p & 0x80)
+			return FALSE;
+
+	return TRUE;
+}
+
+/* g_free() the result. Every name goes through the locale's
+ * g_utf8_collate_key_for_filename(), so that ASCII and other names in the
+ * same directory sort consistently; most of the cost is there.
+ */
+static gchar *make_collate_key(const char *leafname)
+{
+	gsize len = strlen(leafname);
+	gchar *key;
+
+	if (is_ascii(leafname, len))
+	{
+		/* Valid UTF-8 already, and lowering the case is a byte fold,
+		 * so only the copies g_utf8_strdown() would make are saved.
+		 */
+		gchar buf[256];
+		gchar *lower = len < sizeof(buf) ? buf : g_malloc(len + 1);
+
+		for (gsize i = 0; i <= len; i++)
+			lower[i] = g_ascii_tolower(leafname[i]);
+
+		key = g_utf8_collate_key_for_filename(lower, len);
+		if (lower != buf)
+			g_free(lower);
+
+		return key;
+	}
 
-	//collate key
 	gchar *to_free = NULL;
 	if (!g_utf8_validate(leafname, -1, NULL))
 		leafname = to_free = to_utf8(leafname);
 
-	if (g_unichar_isupper(g_utf8_get_char(leafname)))
-		item->flags |= ITEM_FLAG_CAPS;
-
 	gchar *tmp = g_utf8_strdown(leafname, -1);
-	item->collatekey = g_utf8_collate_key_for_filename(tmp, -1);
+	key = g_utf8_collate_key_for_filename(tmp, -1);
 	g_free(tmp);
 
 	if (to_free)
 		g_free(to_free);	/* Only taken for invalid UTF-8 */
 
+	return key;
+}
+
+static gboolean starts_with_capital(const guchar *leafname)
+{
+	if (*leafname < 0x80)
+		return g_ascii_isupper(*leafname);
+
+	gunichar c = g_utf8_get_char_validated((const gchar *) leafname, -1);
+	if (c == (gunichar) -1 || c == (gunichar) -2)
+	{
+		gchar *utf8 = to_utf8((const gchar *) leafname);
+		gboolean caps = g_unichar_isupper(g_utf8_get_char(utf8));
+		g_free(utf8);
+		return caps;
+	}
+
+	return g_unichar_isupper(c);
+}
+
+static const gchar *arena_strdup(DirItemArena *arena, const gchar *str)
+{
+	arena->string_bytes += strlen(str) + 1;
+	return g_string_chunk_insert(arena->strings, str);
+}
+
+/* The key for sorting item by name. It isn't made until something asks
+ * for it, so that sorting by size or date doesn't pay for the collation.
+ */
+const gchar *diritem_collate_key(DirItem *item)
+{
+	if (G_LIKELY(item->collatekey != NULL))
+		return item->collatekey;
+
+	gchar *key = make_collate_key(item->leafname);
+
+	g_mutex_lock(&m_diritems);
+	if (!item->collatekey)
+	{
+		DirItemArena *arena = item->arena;
+
+		if (arena)
+		{
+			g_mutex_lock(&arena->m);
+			item->collatekey = (char *) arena_strdup(arena, key);
+			g_mutex_unlock(&arena->m);
+		}
+		else
+		{
+			item->collatekey = key;
+			key = NULL;
+		}
+	}
+	g_mutex_unlock(&m_diritems);
+
+	g_free(key);
+	return item->collatekey;
+}
+
+/* Create a DirItem in arena, or on its own if arena is NULL.
+ * Either way, diritem_free() it.
+ */
+DirItem *diritem_new_in(DirItemArena *arena, const guchar *leafname)
+{
+	DirItem		*item;
+
+	if (arena)
+	{
+		g_mutex_lock(&arena->m);
+
+		if (arena->free_items)
+		{
+			item = arena->free_items;
+			arena->free_items = (DirItem *) item->leafname;
+		}
+		else
+		{
+			if (!arena->slabs || arena->slab_used == ARENA_SLAB)
+			{
+				arena->slabs = g_slist_prepend(arena->slabs,
+					g_new(DirItem, ARENA_SLAB));
+				arena->slab_used = 0;
+			}
+			item = (DirItem *) arena->slabs->data +
+				arena->slab_used++;
+		}
+
+		memset(item, 0, sizeof(DirItem));
+		item->arena = arena;
+		item->leafname = (char *) arena_strdup(arena, leafname);
+		arena->n_items++;
+
+		g_mutex_unlock(&arena->m);
+	}
+	else
+	{
+		item = g_new0(DirItem, 1);
+		item->leafname = g_strdup(leafname);
+	}
+
+	item->base_type = TYPE_UNKNOWN;
+	item->d_type = DT_UNKNOWN;
+	if (starts_with_capital(leafname))
+		item->flags |= ITEM_FLAG_CAPS;
+
 	return item;
 }
 
+DirItem *diritem_new(const guchar *leafname)
+{
+	return diritem_new_in(NULL, leafname);
+}
+
 void diritem_free(DirItem *item)
 {
 	g_return_if_fail(item != NULL);
@@ -302,11 +691,284 @@ void diritem_free(DirItem *item)
 	if (item->label)
 		g_free(item->label);
 
+	DirItemArena *arena = item->arena;
+	if (arena)
+	{
+		/* The slot is reused, but the strings stay until the arena
+		 * goes or is compacted.
+		 */
+		g_mutex_lock(&arena->m);
+		arena->wasted_bytes += strlen(item->leafname) + 1;
+		if (item->collatekey)
+			arena->wasted_bytes += strlen(item->collatekey) + 1;
+		item->leafname = (char *) arena->free_items;
+		item->arena = NULL;	/* (marks the slot free) */
+		arena->free_items = item;
+		arena->n_items--;
+		g_mutex_unlock(&arena->m);
+		return;
+	}
+
 	g_free(item->collatekey);
 	g_free(item->leafname);
 	g_free(item);
 }
 
+DirItemArena *diritem_arena_new(void)
+{
+	DirItemArena *arena = g_new0(DirItemArena, 1);
+
+	g_mutex_init(&arena->m);
+	arena->strings = g_string_chunk_new(64 * 1024);
+
+	return arena;
+}
+
+/* TRUE if more of the arena's string space belongs to freed items than to
+ * those still in use, and there's enough of it to be worth copying the rest.
+ */
+gboolean diritem_arena_wasteful(DirItemArena *arena)
+{
+	gboolean wasteful;
+
+	g_mutex_lock(&arena->m);
+	wasteful = arena->wasted_bytes > 64 * 1024 &&
+		   arena->wasted_bytes > arena->string_bytes - arena->wasted_bytes;
+	g_mutex_unlock(&arena->m);
+
+	return wasteful;
+}
+
+/* Copy the strings of every item in use to a new chunk and free the old
+ * one. That includes items removed from the Directory but not yet freed
+ * (ITEM_FLAG_GONE). Their leafnames move, so nothing may be using them
+ * meanwhile, and tables keyed on them must be rebuilt afterwards.
+ */
+void diritem_arena_compact(DirItemArena *arena)
+{
+	GStringChunk *old;
+
+	g_mutex_lock(&arena->m);
+
+	old = arena->strings;
+	arena->strings = g_string_chunk_new(64 * 1024);
+	arena->string_bytes = 0;
+	arena->wasted_bytes = 0;
+
+	for (GSList *l = arena->slabs; l; l = l->next)
+	{
+		DirItem *slab = (DirItem *) l->data;
+		int used = l == arena->slabs ? arena->slab_used : ARENA_SLAB;
+
+		for (int i = 0; i < used; i++)
+		{
+			DirItem *item = &slab[i];
+
+			if (!item->arena)
+				continue;	/* Free slot */
+
+			item->leafname = (char *) arena_strdup(arena,
+							item->leafname);
+			if (item->collatekey)
+				item->collatekey = (char *) arena_strdup(arena,
+							item->collatekey);
+		}
+	}
+
+	g_mutex_unlock(&arena->m);
+
+	g_string_chunk_free(old);
+}
+
+/* Release everything allocated from arena at once. Items still in use
+ * must have been diritem_free()d first, for their images and labels.
+ */
+void diritem_arena_free(DirItemArena *arena)
+{
+	if (arena->n_items)
+		g_warning("diritem_arena_free: %" G_GSIZE_FORMAT
+			  " items still in use", arena->n_items);
+
+	g_slist_free_full(arena->slabs, g_free);
+	g_string_chunk_free(arena->strings);
+	g_mutex_clear(&arena->m);
+	g_free(arena);
+}
+
+#ifdef UNIT_TESTS
+# ifdef HAVE_MALLINFO2
+#  include <malloc.h>
+static gsize heap_in_use(void)
+{
+	return mallinfo2().uordblks;
+}
+# else
+static gsize heap_in_use(void)
+{
+	return 0;
+}
+# endif
+
+/* Frees most of an arena's items, so that its strings are mostly waste,
+ * and checks that compacting it keeps the names and keys of the rest.
+ */
+void diritem_tests(void)
+{
+	int n = 8000, kept = 0;
+	DirItem **items = g_new(DirItem *, n);
+	DirItemArena *arena = diritem_arena_new();
+	DirItem *pending = NULL;
+	char leaf[64];
+
+	for (int i = 0; i < n; i++)
+	{
+		g_snprintf(leaf, sizeof(leaf), "object-%07d.o", i);
+		items[i] = diritem_new_in(arena, leaf);
+		if (i % 20 == 0)
+			diritem_collate_key(items[i]);
+	}
+	g_assert(!diritem_arena_wasteful(arena));
+
+	for (int i = 0; i < n; i++)
+	{
+		if (i == 1)
+		{
+			/* Removed, but still queued somewhere */
+			pending = items[i];
+			diritem_mark_gone(pending);
+		}
+		else if (i % 10)
+			diritem_free(items[i]);
+		else
+			items[kept++] = items[i];
+	}
+	g_assert(diritem_arena_wasteful(arena));
+
+	diritem_arena_compact(arena);
+	g_assert(!diritem_arena_wasteful(arena));
+
+	g_assert_cmpstr(pending->leafname, ==, "object-0000001.o");
+	diritem_free(pending);
+
+	for (int i = 0; i < kept; i++)
+	{
+		g_snprintf(leaf, sizeof(leaf), "object-%07d.o", i * 10);
+		g_assert_cmpstr(items[i]->leafname, ==, leaf);
+		if (i % 2 == 0)
+		{
+			DirItem *fresh = diritem_new(leaf);
+
+			g_assert_cmpstr(items[i]->collatekey, ==,
+					diritem_collate_key(fresh));
+			diritem_free(fresh);
+		}
+		else
+			g_assert(items[i]->collatekey == NULL);
+		diritem_free(items[i]);
+	}
+
+	diritem_arena_free(arena);
+	g_free(items);
+}
+
+/* Compares the heap used per item with and without an arena, for
+ * $ROX_MEM_REPORT_SIZE (default 200000) names like those of a build tree.
+ * Without mallinfo2(), only the arena's own count is shown.
+ */
+void diritem_memory_report(void)
+{
+	const char *env = g_getenv("ROX_MEM_REPORT_SIZE");
+	int n = env ? atoi(env) : 200000;
+	DirItem **items = g_new(DirItem *, n);
+	gsize names = 0, before, used;
+	char leaf[64];
+
+	if (n <= 0)
+		return;
+
+	for (int i = 0; i < n; i++)
+		names += g_snprintf(leaf, sizeof(leaf),
+				"object-%07d.o", i) + 1;
+
+	before = heap_in_use();
+	for (int i = 0; i < n; i++)
+	{
+		g_snprintf(leaf, sizeof(leaf), "object-%07d.o", i);
+		items[i] = diritem_new(leaf);
+	}
+	used = heap_in_use() - before;
+	for (int i = 0; i < n; i++)
+		diritem_free(items[i]);
+
+	g_print("%d items, %.1f bytes of names each\n",
+			n, (double) names / n);
+	g_print("separate: %7.1f bytes/item\n", (double) used / n);
+
+	before = heap_in_use();
+	DirItemArena *arena = diritem_arena_new();
+	for (int i = 0; i < n; i++)
+	{
+		g_snprintf(leaf, sizeof(leaf), "object-%07d.o", i);
+		items[i] = diritem_new_in(arena, leaf);
+	}
+	used = heap_in_use() - before;
+
+	g_print("arena:    %7.1f bytes/item (%.1f counted by the arena)\n",
+			(double) used / n,
+			(double) (g_slist_length(arena->slabs) * ARENA_SLAB *
+				  sizeof(DirItem) + arena->string_bytes) / n);
+
+	for (int i = 0; i < n; i++)
+		diritem_free(items[i]);
+	diritem_arena_free(arena);
+	g_free(items);
+}
+#endif
+
+/* Set ITEM_FLAG_GONE. The item may be being restatted in another thread,
+ * which mustn't clear the flag again when it writes back its results.
+ */
+void diritem_mark_gone(DirItem *item)
+{
+	g_mutex_lock(&m_diritems);
+	item->flags |= ITEM_FLAG_GONE;
+	g_mutex_unlock(&m_diritems);
+}
+
+/* Copy item into 'copy' for restatting in another thread, so that the
+ * item itself isn't written meanwhile. The copy starts with no image or
+ * label of its own. diritem_restat_apply() it.
+ */
+void diritem_restat_copy(DirItem *copy, DirItem *item)
+{
+	g_mutex_lock(&m_diritems);
+	*copy = *item;
+	g_mutex_unlock(&m_diritems);
+
+	copy->_image = NULL;
+	copy->label = NULL;
+}
+
+/* Replace item's details with those restatted into 'copy' (see
+ * diritem_restat_copy()). The flags that belong to the Directory are
+ * taken from item as it is now, so the caller must hold the lock it
+ * changes them under.
+ */
+void diritem_restat_apply(DirItem *item, DirItem *copy)
+{
+	g_mutex_lock(&m_diritems);
+	if (item->_image)
+		munref = g_slist_prepend(munref, item->_image);
+	if (item->label)
+		mfree = g_slist_prepend(mfree, item->label);
+
+	copy->flags &= ~(ITEM_FLAGS_KEEP | ITEM_FLAG_GONE);
+	copy->flags |= item->flags & (ITEM_FLAGS_KEEP | ITEM_FLAG_GONE);
+	copy->collatekey = item->collatekey;	/* May have been made */
+	*item = *copy;
+	g_mutex_unlock(&m_diritems);
+}
+
 /* For use by di_image() only. Sets item->_image. */
 MaskedPixmap *_diritem_get_image(DirItem *item, gboolean mainthread)
 {
@@ -336,36 +998,67 @@ MaskedPixmap *_diritem_get_image(DirItem *item, gboolean mainthread)
  */
 gboolean diritem_examine_dir(const guchar *path, DirItem *item)
 {
-	guchar *rpath = pathdup(path); //realpath
+	return diritem_examine_dir_at(-1, path, item);
+}
+
+/* As diritem_examine_dir(), but if parent_fd isn't -1 it is the directory
+ * holding the item, open, and the item is opened from there by its
+ * leafname. The files looked for inside are then statted relative to the
+ * item, so the path is never resolved again.
+ */
+gboolean diritem_examine_dir_at(int parent_fd, const guchar *path,
+				DirItem *item)
+{
+	guchar *rpath = NULL;
+	const gchar *dirpath;
+	int dfd;
+
+	if (parent_fd != -1)
+		dfd = openat(parent_fd, (const char *) item->leafname,
+			     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	else
+	{
+		rpath = pathdup(path); //realpath
+		dfd = open((const char *) rpath,
+			   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
 
 	int oldsize = item->size;
-	DIR *d = mc_opendir(rpath);
+	DIR *d = dfd == -1 ? NULL : fdopendir(dfd);
 	if (d)
 	{
 		int cnt = 0;
-		while ((mc_readdir(d))) cnt++;
+		while ((readdir(d))) cnt++;
 		item->size = cnt - 2; //. and ..
-		mc_closedir(d);
 	}
+	else
+	{
+		/* Unreadable; look inside by the whole paths instead */
+		if (dfd != -1)
+			close(dfd);
+		dfd = AT_FDCWD;
+		if (!rpath)
+			rpath = pathdup(path);
+	}
+	dirpath = rpath ? (const gchar *) rpath : (const gchar *) path;
 
 	gchar *pathbuf = NULL;
 	MaskedPixmap *newimage = NULL;
 	if (item->flags & ITEM_FLAG_MOUNT_POINT)
-	{
-		g_free(rpath);
 		goto out;
-	}
 
-	int pathlen = strlen(rpath);
+	int pathlen = strlen(dirpath);
 	//pathbuf has length of path + '/AppIcon.xpm'
 	pathbuf = g_new(gchar, pathlen + 13);
 	gchar *inspt  = pathbuf + pathlen;
 
-	strcpy(pathbuf, rpath);
-	g_free(rpath);
+	strcpy(pathbuf, dirpath);
+
+	/* What to pass to fstatat(dfd, ...) once a leafname is at inspt */
+	const gchar *name = d ? inspt + 1 : pathbuf;
 
 	struct stat info;
-	if (mc_lstat(pathbuf, &info) != 0)
+	if ((d ? fstat(dfd, &info) : mc_lstat(pathbuf, &info)) != 0)
 		goto out;
 
 	uid_t uid = info.st_uid;
@@ -383,24 +1076,27 @@ gboolean diritem_examine_dir(const guchar *path, DirItem *item)
 	 */
 	strcpy(inspt, "/.DirIcon");
 
-	if (mc_lstat(pathbuf, &info) != 0 || info.st_uid != uid)
+	if (fstatat(dfd, name, &info, AT_SYMLINK_NOFOLLOW) != 0 ||
+			info.st_uid != uid)
 		goto no_diricon;	/* Missing, or wrong owner */
 
-	if (S_ISLNK(info.st_mode) && mc_stat(pathbuf, &info) != 0)
+	if (S_ISLNK(info.st_mode) && fstatat(dfd, name, &info, 0) != 0)
 		goto no_diricon;	/* Bad symlink */
 
 	if (info.st_size > MAX_ICON_SIZE || !S_ISREG(info.st_mode))
 		goto no_diricon;	/* Too big, or non-regular file */
 
 	/* Try to load image; may still get NULL... */
-	newimage = g_fscache_lookup(pixmap_cache, pathbuf);
+	newimage = g_fscache_lookup_at(pixmap_cache, dfd,
+				       d ? dirpath : NULL, name);
 
 no_diricon:
 
 	/* Try to find AppRun... */
 	strcpy(inspt + 1, /*"/"*/ "AppRun");
 
-	if (mc_lstat(pathbuf, &info) != 0 || info.st_uid != uid)
+	if (fstatat(dfd, name, &info, AT_SYMLINK_NOFOLLOW) != 0 ||
+			info.st_uid != uid)
 		goto out;	/* Missing, or wrong owner */
 
 	if (!(info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
@@ -421,17 +1117,21 @@ no_diricon:
 
 	strcpy(inspt + 4, /*"/App"*/ "Icon.xpm");
 
-	if (mc_stat(pathbuf, &info) != 0)
+	if (fstatat(dfd, name, &info, 0) != 0)
 		goto out;	/* Missing, or broken symlink */
 
 	if (info.st_size > MAX_ICON_SIZE || !S_ISREG(info.st_mode))
 		goto out;	/* Too big, or non-regular file */
 
 	/* Try to load image; may still get NULL... */
-	newimage = g_fscache_lookup(pixmap_cache, pathbuf);
+	newimage = g_fscache_lookup_at(pixmap_cache, dfd,
+				       d ? dirpath : NULL, name);
 
 out:
+	if (d)
+		closedir(d);
 	g_free(pathbuf);
+	g_free(rpath);
 
 	g_mutex_lock(&m_diritems);
 	item->flags &= ~ITEM_FLAG_NEED_EXAMINE;
@@ -30,15 +30,32 @@ typedef enum
 	ITEM_FLAG_NEED_EXAMINE = 0x200,
 	ITEM_FLAG_IN_EXAMINE   = 0x2000,
 	ITEM_FLAG_GONE = 0x4000,
+	ITEM_FLAG_RESTAT_EARLY = 0x10000, /* Restatted ahead of its queue slot */
+	ITEM_FLAG_NEED_TYPE = 0x20000, /* Contents unread (DIRITEM_TYPE_LATER) */
 
 	ITEM_FLAG_CAPS      = 0x400,
 	ITEM_FLAG_HAS_XATTR = 0x800, /* Has extended attributes set */
+	ITEM_FLAG_LAZY_STAT = 0x8000, /* Missing some details (see DirItemFields) */
 } ItemFlags;
 
+/* Details a restat may leave out if nobody is showing them.
+ * The type, permissions and size are always wanted, and so are the
+ * modification and change times, which ITEM_FLAG_RECENT needs.
+ */
+typedef enum
+{
+	DIRITEM_STAT_TIMES	= 1 << 0,
+	DIRITEM_STAT_OWNER	= 1 << 1,
+	DIRITEM_STAT_ALL	= 0x3,
+
+	/* Don't read regular files yet; diritem_type_batch() will */
+	DIRITEM_TYPE_LATER	= 1 << 2,
+} DirItemFields;
+
 struct _DirItem
 {
 	char		*leafname;
-	char		*collatekey; /* Preprocessed for sorting */
+	char		*collatekey; /* Use diritem_collate_key() */
 	int		base_type;
 	int		flags;
 	int		lstat_errno;	/* 0 if details are valid */
@@ -50,14 +67,36 @@ struct _DirItem
 	GdkColor	*label;
 	uid_t		uid;
 	gid_t		gid;
+	unsigned char	d_type;		/* From the dir entry, or DT_UNKNOWN */
+	DirItemArena	*arena;		/* NULL => separately allocated */
 };
 
 void diritem_init(void);
 DirItem *diritem_new(const guchar *leafname);
+DirItem *diritem_new_in(DirItemArena *arena, const guchar *leafname);
+DirItemArena *diritem_arena_new(void);
+void diritem_arena_free(DirItemArena *arena);
+gboolean diritem_arena_wasteful(DirItemArena *arena);
+void diritem_arena_compact(DirItemArena *arena);
 void diritem_restat(const guchar *path, DirItem *item, struct stat *parent, gboolean examine_now);
+void diritem_restat_fields(const guchar *path, DirItem *item,
+		struct stat *parent, gboolean examine_now, int fields);
+gboolean diritem_restat_dtype(const guchar *path, DirItem *item);
+void diritem_type_batch(const guchar *dirpath, DirItem **items, int n_items);
+void diritem_restat_copy(DirItem *copy, DirItem *item);
+void diritem_restat_apply(DirItem *item, DirItem *copy);
 MaskedPixmap *_diritem_get_image(DirItem *item, gboolean mainthread);
 void diritem_free(DirItem *item);
+const gchar *diritem_collate_key(DirItem *item);
+void diritem_mark_gone(DirItem *item);
 gboolean diritem_examine_dir(const guchar *path, DirItem *item);
+gboolean diritem_examine_dir_at(int parent_fd, const guchar *path,
+				DirItem *item);
+
+#ifdef UNIT_TESTS
+void diritem_tests(void);
+void diritem_memory_report(void);
+#endif
 
 static inline MaskedPixmap *di_image(DirItem *item)
 {
@@ -0,0 +1,296 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* dirsnap.c - on-disk snapshots of directory listings */
+
+/* When a big directory is opened again, its last listing is mapped in from
+ * ~/.cache/rox/listings so that windows can show every item with its type
+ * and details straight away. The scan then carries on as usual; each item
+ * is restatted, and anything that has changed is sent to the windows with
+ * DIR_UPDATE or DIR_REMOVE.
+ *
+ * A snapshot is only used while the directory's device, inode, mtime and
+ * ctime are the same as when it was written.
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <string.h>
+#include <errno.h>
+
+#include "global.h"
+
+#include "dirsnap.h"
+#include "dir.h"
+#include "diritem.h"
+#include "support.h"
+#include "type.h"
+#include "main.h"
+
+#define SNAP_MAGIC "ROXDSNP1"
+
+/* Smaller directories are quick enough to scan anyway */
+#define SNAP_MIN_ITEMS 256
+
+/* The item flags that describe the file, rather than its place in the
+ * Directory's queues.
+ */
+#define SNAP_FLAGS (ITEM_FLAG_SYMLINK | ITEM_FLAG_APPDIR |		\
+		ITEM_FLAG_MOUNT_POINT | ITEM_FLAG_MOUNTED |		\
+		ITEM_FLAG_EXEC_FILE | ITEM_FLAG_RECENT |		\
+		ITEM_FLAG_CAPS | ITEM_FLAG_HAS_XATTR | ITEM_FLAG_LAZY_STAT)
+
+typedef struct _SnapHeader SnapHeader;
+typedef struct _SnapRecord SnapRecord;
+
+/* The file is a header, n_items records and then a table of nul-terminated
+ * strings, which the records refer to by offset. Everything is 8-byte
+ * aligned, so the records can be read in place.
+ */
+struct _SnapHeader {
+	char	magic[8];
+	guint32	n_items;
+	guint32	strings;	/* File offset of the string table */
+	guint64	dev, ino;
+	gint64	mtime, ctime;
+};
+
+struct _SnapRecord {
+	guint32	name;		/* Offsets into the string table */
+	guint32	mime;
+	gint32	base_type;
+	guint32	flags;
+	guint32	mode;
+	guint32	uid, gid;
+	guint32	unused;
+	gint64	size, atime, ctime, mtime;
+};
+
+/* A finished snapshot, waiting to be written */
+typedef struct _SnapWrite SnapWrite;
+
+struct _SnapWrite {
+	gchar		*path;
+	GByteArray	*data;
+};
+
+/* One thread, so that the snapshots of a directory are written in order */
+static GThreadPool *writer = NULL;
+
+/* Static prototypes */
+static gchar *snap_path(const char *pathname);
+static void write_snap(gpointer data, gpointer unused);
+
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+/* Add the items from dir's snapshot to known_items and new_items.
+ * dir->stat_info must be filled in.
+ * Returns FALSE if there is no up-to-date snapshot.
+ */
+gboolean dirsnap_load(Directory *dir)
+{
+	gchar *path = snap_path(dir->pathname);
+	GMappedFile *map = g_mapped_file_new(path, FALSE, NULL);
+	g_free(path);
+
+	if (!map)
+		return FALSE;
+
+	const char *data = g_mapped_file_get_contents(map);
+	gsize len = g_mapped_file_get_length(map);
+	const SnapHeader *header = (const SnapHeader *) data;
+	struct stat *info = &dir->stat_info;
+
+	if (len < sizeof(SnapHeader) ||
+	    memcmp(header->magic, SNAP_MAGIC, sizeof(header->magic)) ||
+	    header->dev != (guint64) info->st_dev ||
+	    header->ino != (guint64) info->st_ino ||
+	    header->mtime != (gint64) info->st_mtime ||
+	    header->ctime != (gint64) info->st_ctime ||
+	    header->strings < sizeof(SnapHeader) || header->strings > len ||
+	    header->n_items > (header->strings - sizeof(SnapHeader))
+				/ sizeof(SnapRecord) ||
+	    data[len - 1] != '\0')
+	{
+		g_mapped_file_unref(map);
+		return FALSE;
+	}
+
+	const SnapRecord *rec = (const SnapRecord *) (header + 1);
+	const char *strings = data + header->strings;
+	gsize strings_len = len - header->strings;
+
+	for (guint32 i = 0; i < header->n_items; i++, rec++)
+	{
+		if (rec->name >= strings_len || rec->mime >= strings_len)
+			break;
+
+		const char *leafname = strings + rec->name;
+
+		if (!*leafname || strchr(leafname, '/') ||
+		    g_hash_table_lookup(dir->known_items, leafname))
+			continue;
+
+		DirItem *item = diritem_new_in(dir->arena,
+				(const guchar *) leafname);
+
+		item->base_type = rec->base_type;
+		item->flags |= rec->flags & SNAP_FLAGS;
+		item->mode = rec->mode;
+		item->uid = rec->uid;
+		item->gid = rec->gid;
+		item->size = rec->size;
+		item->atime = rec->atime;
+		item->ctime = rec->ctime;
+		item->mtime = rec->mtime;
+		item->mime_type = mime_type_lookup(strings + rec->mime);
+
+		g_ptr_array_add(dir->new_items, item);
+		g_hash_table_insert(dir->known_items, item->leafname, item);
+	}
+
+	g_mapped_file_unref(map);
+	return TRUE;
+}
+
+/* Write out the details of every statted item in dir, if there are enough
+ * of them to be worth it. They are copied here, under dir->mutex, and the
+ * file is written later by another thread.
+ */
+void dirsnap_save(Directory *dir)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (g_hash_table_size(dir->known_items) < SNAP_MIN_ITEMS)
+		return;
+
+	GByteArray *records = g_byte_array_new();
+	GString *strings = g_string_new(NULL);
+	GHashTable *mime_offsets = g_hash_table_new(NULL, NULL);
+	SnapHeader header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+	header.dev = dir->stat_info.st_dev;
+	header.ino = dir->stat_info.st_ino;
+	header.mtime = dir->stat_info.st_mtime;
+	header.ctime = dir->stat_info.st_ctime;
+
+	g_mutex_lock(&dir->mutex);
+	g_hash_table_iter_init(&iter, dir->known_items);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		DirItem *item = (DirItem *) value;
+		SnapRecord rec;
+		gpointer offset;
+
+		if (item->base_type == TYPE_UNKNOWN ||
+		    item->base_type == TYPE_ERROR || !item->mime_type)
+			continue;
+
+		memset(&rec, 0, sizeof(rec));
+
+		rec.name = strings->len;
+		g_string_append_len(strings, item->leafname,
+				strlen(item->leafname) + 1);
+
+		if (!g_hash_table_lookup_extended(mime_offsets,
+					item->mime_type, NULL, &offset))
+		{
+			offset = GUINT_TO_POINTER(strings->len);
+			g_string_append_printf(strings, "%s/%s",
+					item->mime_type->media_type,
+					item->mime_type->subtype);
+			g_string_append_c(strings, '\0');
+			g_hash_table_insert(mime_offsets,
+					item->mime_type, offset);
+		}
+		rec.mime = GPOINTER_TO_UINT(offset);
+
+		rec.base_type = item->base_type;
+		rec.flags = item->flags & SNAP_FLAGS;
+		rec.mode = item->mode;
+		rec.uid = item->uid;
+		rec.gid = item->gid;
+		rec.size = item->size;
+		rec.atime = item->atime;
+		rec.ctime = item->ctime;
+		rec.mtime = item->mtime;
+
+		g_byte_array_append(records, (guint8 *) &rec, sizeof(rec));
+		header.n_items++;
+	}
+	g_mutex_unlock(&dir->mutex);
+
+	header.strings = sizeof(header) + records->len;
+	g_byte_array_prepend(records, (guint8 *) &header, sizeof(header));
+	g_byte_array_append(records, (guint8 *) strings->str, strings->len);
+
+	g_hash_table_destroy(mime_offsets);
+	g_string_free(strings, TRUE);
+
+	SnapWrite *job = g_new(SnapWrite, 1);
+	job->path = snap_path(dir->pathname);
+	job->data = records;
+
+	if (!writer)
+		writer = g_thread_pool_new(write_snap, NULL, 1, FALSE, NULL);
+	g_thread_pool_push(writer, job, NULL);
+}
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+/* In the writer thread */
+static void write_snap(gpointer data, gpointer unused)
+{
+	SnapWrite *job = (SnapWrite *) data;
+	gchar *snap_dir = g_path_get_dirname(job->path);
+	GError *error = NULL;
+
+	if (g_mkdir_with_parents(snap_dir, 0700) ||
+	    !g_file_set_contents(job->path, (gchar *) job->data->data,
+				 job->data->len, &error))
+	{
+		/* Not worth bothering the user about */
+		if (error)
+			g_error_free(error);
+	}
+
+	g_free(snap_dir);
+	g_free(job->path);
+	g_byte_array_free(job->data, TRUE);
+	g_free(job);
+}
+
+/* g_free() the result */
+static gchar *snap_path(const char *pathname)
+{
+	gchar *md5 = md5_hash(pathname);
+	gchar *path = g_strconcat(home_dir, "/.cache/rox/listings/", md5, NULL);
+
+	g_free(md5);
+	return path;
+}
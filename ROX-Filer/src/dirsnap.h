@@ -0,0 +1,12 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * By Thomas Leonard, <tal197@users.sourceforge.net>.
+ */
+
+#ifndef _DIRSNAP_H
+#define _DIRSNAP_H
+
+gboolean dirsnap_load(Directory *dir);
+void dirsnap_save(Directory *dir);
+
+#endif /* _DIRSNAP_H */
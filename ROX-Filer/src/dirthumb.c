@@ -0,0 +1,301 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* dirthumb.c - finding thumbnails for directories */
+
+/* A directory's thumbnail is a symlink to the thumbnail of one of the first
+ * images inside it. Each directory wanting one gets a task, and the tasks
+ * run in a pool of threads, several at once: a task looks through the
+ * directory's first few files until it finds one which already has a
+ * thumbnail (and links to it) or which could have one made.
+ *
+ * If the directory is in dir_cache already, its listing is taken from there
+ * rather than read again.
+ *
+ * Tasks belong to an owner (a FilerWindow), which is told the outcome on
+ * the main thread. dirthumb_cancel() stops all of an owner's tasks, so it
+ * hears nothing more.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gtk/gtk.h>
+
+#include "global.h"
+
+#include "dirthumb.h"
+#include "dir.h"
+#include "diritem.h"
+#include "fscache.h"
+#include "pixmaps.h"
+#include "support.h"
+#include "type.h"
+
+/* Look no further into a directory than this many names */
+#define DIRTHUMB_MAX_CHILDREN 99
+
+typedef struct _DirThumbTask DirThumbTask;
+
+struct _DirThumbTask {
+	gchar		*path;
+	gpointer	owner;
+	DirThumbFunc	done;
+
+	GPtrArray	*names;		/* Sorted leafnames; NULL to list */
+	gboolean	*is_file;	/* Per name, if known without lstat */
+
+	gint		cancelled;	/* (atomic) */
+
+	/* Results */
+	gchar		*found;		/* Image to make a thumbnail for */
+	gboolean	linked;		/* Directory thumbnail was made */
+};
+
+static GThreadPool *dirthumb_pool = NULL;
+static GList *tasks = NULL;		/* Not yet done, on the main thread */
+
+/* Static prototypes */
+static gint compare_leafnames(gconstpointer a, gconstpointer b);
+static void take_listing(DirThumbTask *task);
+static void dirthumb_job(gpointer data, gpointer unused);
+static void scan_task(DirThumbTask *task);
+static gboolean task_done(DirThumbTask *task);
+static void task_free(DirThumbTask *task);
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+/* Find a thumbnail for the directory 'path' in the background. 'done' is
+ * called later, unless the task is cancelled.
+ */
+void dirthumb_start(const gchar *path, gpointer owner, DirThumbFunc done)
+{
+	DirThumbTask *task;
+	GList *next;
+
+	for (next = tasks; next; next = next->next)
+	{
+		task = next->data;
+		if (task->owner == owner && !task->cancelled &&
+				strcmp(task->path, path) == 0)
+			return;
+	}
+
+	task = g_new0(DirThumbTask, 1);
+	task->path = g_strdup(path);
+	task->owner = owner;
+	task->done = done;
+
+	take_listing(task);
+
+	if (!dirthumb_pool)
+		dirthumb_pool = g_thread_pool_new(dirthumb_job, NULL,
+				g_get_num_processors(), FALSE, NULL);
+
+	tasks = g_list_prepend(tasks, task);
+	g_thread_pool_push(dirthumb_pool, task, NULL);
+}
+
+/* Stop all the tasks for this owner. Those already running finish, but
+ * their results are dropped.
+ */
+void dirthumb_cancel(gpointer owner)
+{
+	GList *next;
+
+	for (next = tasks; next; next = next->next)
+	{
+		DirThumbTask *task = next->data;
+
+		if (task->owner == owner)
+			g_atomic_int_set(&task->cancelled, TRUE);
+	}
+}
+
+/* How many tasks are still to report to this owner */
+gint dirthumb_pending(gpointer owner)
+{
+	GList *next;
+	gint n = 0;
+
+	for (next = tasks; next; next = next->next)
+	{
+		DirThumbTask *task = next->data;
+
+		if (task->owner == owner && !task->cancelled)
+			n++;
+	}
+
+	return n;
+}
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+static gint compare_leafnames(gconstpointer a, gconstpointer b)
+{
+	const DirItem *aa = *(DirItem **) a;
+	const DirItem *bb = *(DirItem **) b;
+
+	return g_ascii_strcasecmp(aa->leafname, bb->leafname);
+}
+
+/* If the directory has been scanned already, copy the names of its files
+ * from there. Items that haven't been statted yet are left for the task
+ * to check.
+ */
+static void take_listing(DirThumbTask *task)
+{
+	Directory *dir;
+	GHashTableIter iter;
+	DirItem *item;
+	GPtrArray *unsorted;
+	guint i;
+
+	dir = g_fscache_lookup_full(dir_cache, task->path,
+			FSCACHE_LOOKUP_PEEK, NULL);
+	if (!dir)
+		return;
+
+	if (dir->have_scanned && !dir->scanning)
+	{
+		unsorted = g_ptr_array_new();
+
+		g_hash_table_iter_init(&iter, dir->known_items);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &item))
+		{
+			if (item->flags & ITEM_FLAG_SYMLINK)
+				continue;
+			if (item->base_type == TYPE_FILE ||
+					item->base_type == TYPE_UNKNOWN)
+				g_ptr_array_add(unsorted, item);
+		}
+
+		/* Same order as list_dir_all() */
+		task->names = g_ptr_array_new();
+		task->is_file = g_new(gboolean, unsorted->len);
+		g_ptr_array_sort(unsorted, compare_leafnames);
+		for (i = 0; i < unsorted->len; i++)
+		{
+			item = unsorted->pdata[i];
+			g_ptr_array_add(task->names, g_strdup(item->leafname));
+			task->is_file[i] = item->base_type == TYPE_FILE;
+		}
+
+		g_ptr_array_free(unsorted, TRUE);
+	}
+
+	g_object_unref(dir);
+}
+
+/* In dirthumb_pool */
+static void dirthumb_job(gpointer data, gpointer unused)
+{
+	DirThumbTask *task = data;
+
+	if (!g_atomic_int_get(&task->cancelled))
+		scan_task(task);
+
+	g_idle_add((GSourceFunc) task_done, task);
+}
+
+static void scan_task(DirThumbTask *task)
+{
+	guint i, n;
+
+	if (!task->names)
+		task->names = list_dir_all(task->path);
+
+	n = MIN(task->names->len, DIRTHUMB_MAX_CHILDREN);
+
+	for (i = 0; i < n && !g_atomic_int_get(&task->cancelled); i++)
+	{
+		gchar *subpath, *thumb_path, *sub_thumb_path, *rel_path;
+		struct stat info;
+
+		subpath = g_build_filename(task->path,
+				task->names->pdata[i], NULL);
+
+		if (!(task->is_file && task->is_file[i]) &&
+		    (mc_lstat(subpath, &info) == -1 ||
+		     mode_to_base_type(info.st_mode) != TYPE_FILE))
+		{
+			g_free(subpath);
+			continue;
+		}
+
+		switch (pixmap_check_thumb_t(subpath))
+		{
+		case 0:
+			task->found = subpath;
+			return;
+		case 1:
+			thumb_path = pixmap_make_thumb_path(task->path);
+			sub_thumb_path = pixmap_make_thumb_path(subpath);
+			rel_path = get_relative_path(thumb_path,
+						     sub_thumb_path);
+
+			task->linked = symlink(rel_path, thumb_path) == 0;
+
+			g_free(rel_path);
+			g_free(sub_thumb_path);
+			g_free(thumb_path);
+			g_free(subpath);
+			return;
+		}
+
+		g_free(subpath);
+	}
+}
+
+static gboolean task_done(DirThumbTask *task)
+{
+	tasks = g_list_remove(tasks, task);
+
+	if (task->linked)
+		dir_force_update_path(task->path, TRUE);
+
+	if (!task->cancelled)
+		task->done(task->owner, task->found);
+
+	task_free(task);
+
+	return FALSE;
+}
+
+static void task_free(DirThumbTask *task)
+{
+	if (task->names)
+	{
+		guint i = task->names->len;
+		while (i--)
+			g_free(task->names->pdata[i]);
+		g_ptr_array_free(task->names, TRUE);
+	}
+
+	g_free(task->is_file);
+	g_free(task->found);
+	g_free(task->path);
+	g_free(task);
+}
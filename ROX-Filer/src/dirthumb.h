@@ -0,0 +1,20 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * By Thomas Leonard, <tal197@users.sourceforge.net>.
+ */
+
+#ifndef _DIRTHUMB_H
+#define _DIRTHUMB_H
+
+/* Called when a directory's task is over. 'path' is an image in it still
+ * needing a thumbnail, which will do for the directory's too once made;
+ * NULL if there was none (the directory may have been given an existing
+ * one).
+ */
+typedef void (*DirThumbFunc)(gpointer owner, const gchar *path);
+
+void dirthumb_start(const gchar *path, gpointer owner, DirThumbFunc done);
+void dirthumb_cancel(gpointer owner);
+gint dirthumb_pending(gpointer owner);
+
+#endif /* _DIRTHUMB_H */
@@ -55,11 +55,12 @@
 #include "diritem.h"
 #include "view_iface.h"
 #include "xtypes.h"
+#include "atlas.h"
 
 /* Options bits */
 static Option o_display_caps_first;
 Option o_display_dirs_first;
-static Option o_display_newly_first;
+Option o_display_newly_first;
 Option o_display_size;
 Option o_display_details;
 Option o_display_sort_by;
@@ -73,6 +74,7 @@ Option o_display_show_headers;
 Option o_display_show_full_type;
 Option o_display_less_clickable_cols;
 Option o_display_name_width;
+Option o_display_estimate_over;
 Option o_display_show_name;
 Option o_display_show_type;
 Option o_display_show_size;
@@ -139,6 +141,7 @@ void display_init()
 	option_add_int(&o_display_less_clickable_cols, "display_less_clickable_cols", FALSE);
 
 	option_add_int(&o_display_name_width, "display_name_width", 0);
+	option_add_int(&o_display_estimate_over, "display_estimate_over", 5000);
 
 	option_add_int(&o_display_show_name, "display_show_name", TRUE);
 	option_add_int(&o_display_show_type, "display_show_type", TRUE);
@@ -360,12 +363,6 @@ void draw_huge_icon(
 		height = gdk_pixbuf_get_height(image) * scale;;
 	}
 
-	if (scale != 1.0 && width > 0 && height > 0)
-		scaled = gdk_pixbuf_scale_simple(image,
-					width, height, GDK_INTERP_BILINEAR);
-	else
-		scaled = image;
-
 	image_x = area->x + ((area->width - width) >> 1);
 	image_y = area->y + MAX(0, (area->height - height) / 2);
 
@@ -374,18 +371,28 @@ void draw_huge_icon(
 	draw_label_bg(cr, area,
 			selected && item->label ? colour : item->label);
 
-	 pixbuf = selected
+	if (!atlas_draw(cr, image, image_x, image_y, width, height,
+			selected ? colour : NULL))
+	{
+		if (scale != 1.0 && width > 0 && height > 0)
+			scaled = gdk_pixbuf_scale_simple(image,
+					width, height, GDK_INTERP_BILINEAR);
+		else
+			scaled = image;
+
+		pixbuf = selected
 			? create_spotlight_pixbuf(scaled, colour)
 			: scaled;
 
-	gdk_cairo_set_source_pixbuf(cr, pixbuf, image_x, image_y);
-	cairo_paint(cr);
+		gdk_cairo_set_source_pixbuf(cr, pixbuf, image_x, image_y);
+		cairo_paint(cr);
 
-	if (scale != 1.0 && width > 0 && height > 0)
-		g_object_unref(scaled);
+		if (scaled != image)
+			g_object_unref(scaled);
 
-	if (selected)
-		g_object_unref(pixbuf);
+		if (selected)
+			g_object_unref(pixbuf);
+	}
 
 	gtk_icon_size_lookup(mount_icon_size, &mw, &mh);
 
@@ -493,7 +500,8 @@ int sort_by_name(const void *item1, const void *item2)
 			return 1;
 	}
 
-	retval = strcmp(i1->collatekey, i2->collatekey);
+	retval = strcmp(diritem_collate_key((DirItem *) i1),
+			diritem_collate_key((DirItem *) i2));
 
 	return retval ? retval : strcmp(i1->leafname, i2->leafname);
 }
@@ -644,6 +652,368 @@ int sort_by_perm(const void *item1, const void *item2)
 }
 
 
+/* Fixed-width keys for display_sort_order(). Comparing major, then minor,
+ * then name puts items in the same order as the sort function does,
+ * except that items with equal keys must still be compared properly.
+ */
+typedef struct _SortKey SortKey;
+
+struct _SortKey {
+	guint64	major;	/* Type rank, size, time, etc */
+	guint64	name;	/* Collate key bytes after the common prefix */
+	guint32	minor;	/* Dirs-first and caps-first bits */
+	guint32	index;	/* In the items array */
+};
+
+#define SORT_KEY_DIGITS 20	/* Bytes in major, name and minor */
+
+typedef int (*SortFn)(const void *, const void *);
+
+typedef struct {
+	SortFn		fn;
+	DirItem		**items;
+} SortKeyTies;
+
+static SortFn sort_fn_for(SortType sort_type)
+{
+	switch (sort_type)
+	{
+		case SORT_NAME: return sort_by_name;
+		case SORT_TYPE: return sort_by_type;
+		case SORT_DATEA: return sort_by_datea;
+		case SORT_DATEC: return sort_by_datec;
+		case SORT_DATEM: return sort_by_datem;
+		case SORT_SIZE: return sort_by_size;
+		case SORT_PERM: return sort_by_perm;
+		case SORT_OWNER: return sort_by_owner;
+		case SORT_GROUP: return sort_by_group;
+		default:
+			g_assert_not_reached();
+	}
+
+	return NULL;
+}
+
+static gpointer key_mime(DirItem *item) { return item->mime_type; }
+static gpointer key_uid(DirItem *item) { return GUINT_TO_POINTER(item->uid); }
+static gpointer key_gid(DirItem *item) { return GUINT_TO_POINTER(item->gid); }
+
+static gint cmp_mime(gconstpointer a, gconstpointer b)
+{
+	const MIME_type *m1 = *(MIME_type **) a;
+	const MIME_type *m2 = *(MIME_type **) b;
+	int diff;
+
+	if (!m1 || !m2)
+		return m1 ? 1 : m2 ? -1 : 0;
+
+	diff = strcmp(m1->media_type, m2->media_type);
+
+	return diff ? diff : strcmp(m1->subtype, m2->subtype);
+}
+
+/* Ids with the same name are still ranked apart, so that only items with
+ * the same id have to be ordered by sort_by_owner().
+ */
+static gint cmp_uid(gconstpointer a, gconstpointer b)
+{
+	guint u1 = GPOINTER_TO_UINT(*(gpointer *) a);
+	guint u2 = GPOINTER_TO_UINT(*(gpointer *) b);
+	int diff = strcmp(user_name(u1), user_name(u2));
+
+	return diff ? diff : u1 < u2 ? -1 : u1 > u2;
+}
+
+static gint cmp_gid(gconstpointer a, gconstpointer b)
+{
+	guint g1 = GPOINTER_TO_UINT(*(gpointer *) a);
+	guint g2 = GPOINTER_TO_UINT(*(gpointer *) b);
+	int diff = strcmp(group_name(g1), group_name(g2));
+
+	return diff ? diff : g1 < g2 ? -1 : g1 > g2;
+}
+
+/* Sorts the different values of get(item) and numbers them from 1, so
+ * that the strcmp()s are done once per value rather than per comparison.
+ * Returns a table mapping each value to its rank.
+ */
+static GHashTable *rank_values(DirItem **items, int n,
+			       gpointer (*get)(DirItem *item),
+			       GCompareFunc cmp)
+{
+	GHashTable *ranks = g_hash_table_new(NULL, NULL);
+	GPtrArray *values = g_ptr_array_new();
+	guint rank = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		gpointer value = get(items[i]);
+
+		if (!g_hash_table_lookup_extended(ranks, value, NULL, NULL))
+		{
+			g_hash_table_insert(ranks, value, NULL);
+			g_ptr_array_add(values, value);
+		}
+	}
+
+	g_ptr_array_sort(values, cmp);
+	for (i = 0; i < values->len; i++)
+	{
+		if (i == 0 || cmp(&values->pdata[i - 1], &values->pdata[i]))
+			rank++;
+		g_hash_table_insert(ranks, values->pdata[i],
+				    GUINT_TO_POINTER(rank));
+	}
+	g_ptr_array_free(values, TRUE);
+
+	return ranks;
+}
+
+static guint64 rank_of(GHashTable *ranks, gpointer value)
+{
+	return GPOINTER_TO_UINT(g_hash_table_lookup(ranks, value));
+}
+
+/* Orders as a signed number would */
+static guint64 signed_key(gint64 value)
+{
+	return (guint64) value ^ G_GUINT64_CONSTANT(0x8000000000000000);
+}
+
+static void make_sort_keys(SortType sort_type, DirItem **items, int n,
+			   SortKey *keys)
+{
+	const gchar **collate = g_new(const gchar *, n);
+	GHashTable *ranks = NULL;
+	gsize prefix;
+	int i;
+
+	/* Names often start the same way, and those bytes can't help */
+	for (i = 0; i < n; i++)
+		collate[i] = diritem_collate_key(items[i]);
+	prefix = strlen(collate[0]);
+	for (i = 1; i < n && prefix; i++)
+	{
+		gsize j = 0;
+
+		while (j < prefix && collate[i][j] == collate[0][j])
+			j++;
+		prefix = j;
+	}
+
+	if (sort_type == SORT_TYPE)
+		ranks = rank_values(items, n, key_mime, cmp_mime);
+	else if (sort_type == SORT_OWNER)
+		ranks = rank_values(items, n, key_uid, cmp_uid);
+	else if (sort_type == SORT_GROUP)
+		ranks = rank_values(items, n, key_gid, cmp_gid);
+
+	for (i = 0; i < n; i++)
+	{
+		DirItem *item = items[i];
+		SortKey *key = &keys[i];
+		const guchar *name = (const guchar *) collate[i] + prefix;
+		guint64 major = 0;
+		int b;
+
+		key->name = 0;
+		for (b = 0; b < 8; b++)
+		{
+			key->name = (key->name << 8) | *name;
+			if (*name)
+				name++;
+		}
+
+		key->minor = 0;
+		if (o_display_dirs_first.int_value && !IS_A_DIR(item))
+			key->minor |= 2;
+		if (o_display_caps_first.int_value &&
+		    !(item->flags & ITEM_FLAG_CAPS))
+			key->minor |= 1;
+
+		switch (sort_type)
+		{
+			case SORT_NAME:
+				break;
+			case SORT_TYPE:
+				major = (guint64) item->base_type << 56;
+				if (item->flags & ITEM_FLAG_APPDIR)
+					major |= G_GUINT64_CONSTANT(1) << 55;
+				major |= rank_of(ranks, item->mime_type);
+				break;
+			case SORT_DATEA:
+			case SORT_DATEC:
+			case SORT_DATEM:
+				major = signed_key(
+					sort_type == SORT_DATEA ? item->atime :
+					sort_type == SORT_DATEC ? item->ctime :
+								  item->mtime);
+				if (o_display_newly_first.int_value)
+					major = ~major;
+				break;
+			case SORT_SIZE:
+				major = MAX(item->size, 0);
+				if ((item->base_type == TYPE_DIRECTORY) !=
+				    o_display_dirs_first.int_value)
+					major |= G_GUINT64_CONSTANT(1) << 63;
+				break;
+			case SORT_PERM:
+				major = item->mode & (S_ISUID | S_ISGID |
+						S_ISVTX | S_IRWXU | S_IRWXG |
+						S_IRWXO);
+				break;
+			case SORT_OWNER:
+				major = rank_of(ranks,
+						GUINT_TO_POINTER(item->uid));
+				break;
+			case SORT_GROUP:
+				major = rank_of(ranks,
+						GUINT_TO_POINTER(item->gid));
+				break;
+			default:
+				g_assert_not_reached();
+		}
+
+		key->major = major;
+		key->index = i;
+	}
+
+	if (ranks)
+		g_hash_table_destroy(ranks);
+	g_free(collate);
+}
+
+static inline guint key_digit(const SortKey *key, int digit)
+{
+	if (digit < 8)
+		return (key->name >> (digit * 8)) & 0xff;
+	if (digit < 12)
+		return (key->minor >> ((digit - 8) * 8)) & 0xff;
+	return (key->major >> ((digit - 12) * 8)) & 0xff;
+}
+
+static gboolean keys_equal(const SortKey *a, const SortKey *b)
+{
+	return a->major == b->major && a->minor == b->minor &&
+		a->name == b->name;
+}
+
+static gint cmp_tied(gconstpointer a, gconstpointer b, gpointer data)
+{
+	SortKeyTies *ties = data;
+
+	return ties->fn(ties->items[((SortKey *) a)->index],
+			ties->items[((SortKey *) b)->index]);
+}
+
+/* Least significant byte first. Counts for every byte are gathered in one
+ * pass, and bytes which are the same in every key are skipped.
+ * Returns whichever of 'keys' and 'tmp' ends up holding the result.
+ */
+static SortKey *radix_sort_keys(SortKey *keys, SortKey *tmp, int n)
+{
+	guint (*counts)[256] = g_malloc0(SORT_KEY_DIGITS * sizeof(*counts));
+	int i, digit;
+
+	for (i = 0; i < n; i++)
+		for (digit = 0; digit < SORT_KEY_DIGITS; digit++)
+			counts[digit][key_digit(&keys[i], digit)]++;
+
+	for (digit = 0; digit < SORT_KEY_DIGITS; digit++)
+	{
+		guint *count = counts[digit];
+		guint pos = 0;
+		SortKey *swap;
+
+		if (count[key_digit(&keys[0], digit)] == n)
+			continue;
+
+		for (i = 0; i < 256; i++)
+		{
+			guint c = count[i];
+
+			count[i] = pos;
+			pos += c;
+		}
+
+		for (i = 0; i < n; i++)
+			tmp[count[key_digit(&keys[i], digit)]++] = keys[i];
+
+		swap = keys;
+		keys = tmp;
+		tmp = swap;
+	}
+
+	g_free(counts);
+
+	return keys;
+}
+
+/* Works out where items go for this sort type and order, setting perm[i]
+ * to the index in 'items' of the item to show i-th. Returns FALSE, leaving
+ * 'perm' alone, if they are in order already.
+ *
+ * Rather than calling the sort function for every comparison, this radix
+ * sorts fixed-width keys and only uses it to order items whose keys tie.
+ */
+gboolean display_sort_order(SortType sort_type, GtkSortType order,
+			    DirItem **items, int n, guint *perm)
+{
+	SortFn	fn = sort_fn_for(sort_type);
+	int	mul = order == GTK_SORT_ASCENDING ? 1 : -1;
+	SortKey	*keys, *tmp, *sorted;
+	SortKeyTies ties = {fn, items};
+	int	i, start;
+
+	for (i = 1; i < n; i++)
+	{
+		if (mul * fn(items[i - 1], items[i]) > 0)
+			break;
+	}
+	if (i >= n)
+		return FALSE;		/* Already sorted */
+
+	keys = g_new(SortKey, n);
+	tmp = g_new(SortKey, n);
+
+	make_sort_keys(sort_type, items, n, keys);
+	sorted = radix_sort_keys(keys, tmp, n);
+
+	for (start = 0; start < n; start = i)
+	{
+		for (i = start + 1; i < n; i++)
+			if (!keys_equal(&sorted[start], &sorted[i]))
+				break;
+		if (i - start > 1)
+			g_qsort_with_data(sorted + start, i - start,
+					sizeof(SortKey), cmp_tied, &ties);
+	}
+
+	for (i = 0; i < n; i++)
+		perm[mul > 0 ? i : n - 1 - i] = sorted[i].index;
+
+	g_free(keys);
+	g_free(tmp);
+
+	return TRUE;
+}
+
+/* Items may have been statted without the details this window now wants
+ * (see queue_interesting in filer.c). Rescan if so.
+ */
+static void restat_if_lazy(FilerWindow *fw)
+{
+	Directory *dir = fw->directory;
+
+	if (!dir || fw->under_init)
+		return;
+
+	if ((dir->lazy_stat && !filer_names_only(fw)) ||
+	    (filer_stat_fields(fw) & ~dir->stat_fields))
+		filer_update_dir(fw, FALSE);
+}
+
 void display_set_sort_type(FilerWindow *filer_window, SortType sort_type,
 			   GtkSortType order)
 {
@@ -654,6 +1024,8 @@ void display_set_sort_type(FilerWindow *filer_window, SortType sort_type,
 	filer_window->sort_type = sort_type;
 	filer_window->sort_order = order;
 
+	restat_if_lazy(filer_window);
+
 	view_sort(filer_window->view);
 }
 
@@ -684,6 +1056,8 @@ void display_set_layout(FilerWindow *fw,
 		fw->icon_scale = 1.0;
 	}
 
+	restat_if_lazy(fw);
+
 	if (details_changed || prev_style != fw->display_style)
 		view_style_changed(fw->view, VIEW_UPDATE_NAME);
 	else
@@ -917,6 +1291,8 @@ static void options_changed(void)
 		if (o_display_show_thumbs.has_changed)
 			filer_set_title(filer_window);
 
+		restat_if_lazy(filer_window);
+
 		if (o_display_dirs_first.has_changed ||
 		    o_display_caps_first.has_changed ||
 		    o_display_newly_first.has_changed)
@@ -1238,6 +1614,8 @@ void display_update_view(FilerWindow *fw,
 	view->recent = item->flags & ITEM_FLAG_RECENT;
 	g_clear_object(&view->name);
 
+	view->estimated = FALSE;
+
 	if (clear)
 	{
 		view->name_width = 0;
@@ -1282,3 +1660,171 @@ void display_update_view(FilerWindow *fw,
 
 }
 
+/* As display_update_view() with update_name_layout set, except that the
+ * name's size is only estimated, from the font's character widths, and
+ * view->estimated is set. Used for directories too big to lay every name
+ * out; the ones near the screen are measured properly later.
+ */
+void display_estimate_view(FilerWindow *fw, DirItem *item, ViewData *view)
+{
+	const gchar *name = item->leafname;
+	int (*widths)[] = (item->flags & ITEM_FLAG_RECENT) ?
+		&fw_font_widthsb : &fw_font_widths;
+	int w = 0, wrap = 0;
+
+	if (view->iconstatus == 0 && item->base_type != TYPE_UNKNOWN)
+		view->iconstatus = 1;
+
+	if (fw->details_type != DETAILS_NONE)
+		make_details_layout(fw, item, view, TRUE);
+
+	view->recent = item->flags & ITEM_FLAG_RECENT;
+	g_clear_object(&view->name);
+
+	while (*name)
+	{
+		gunichar c;
+
+		if (*name >= 0x20 && *name <= 0x7e)
+		{
+			w += (*widths)[(int) *name++];
+			continue;
+		}
+
+		c = g_utf8_get_char_validated(name, -1);
+		if (c == (gunichar) -1 || c == (gunichar) -2)
+		{
+			/* Shown escaped by to_utf8() */
+			w += fw_font_char_width;
+			name++;
+			continue;
+		}
+
+		w += g_unichar_iswide(c) ? fw_font_char_width * 2
+					 : fw_font_char_width;
+		name = g_utf8_next_char(name);
+	}
+
+	/* Wrapped as by make_layout() */
+	if (fw->display_style == HUGE_ICONS)
+		wrap = MAX(huge_size, o_large_width.int_value);
+	if (fw->details_type == DETAILS_NONE && fw->display_style == LARGE_ICONS)
+		wrap = o_large_width.int_value;
+	if (wrap && fw->name_scale != 1.0)
+		wrap = fw->name_scale_itemw * fw->name_scale;
+
+	view->name_height = fw_font_height;
+	if (wrap > 0 && w > wrap)
+	{
+		view->name_height *= (w + wrap - 1) / wrap;
+		w = wrap;
+	}
+
+	view->name_width = w;
+	view->estimated = TRUE;
+}
+
+#ifdef UNIT_TESTS
+static const SortType test_types[] = {SORT_NAME, SORT_SIZE, SORT_DATEM};
+static const char *test_names[] = {"name", "size", "date"};
+static SortFn test_fn;
+
+static int test_cmp(const void *a, const void *b)
+{
+	return test_fn(*(DirItem **) a, *(DirItem **) b);
+}
+
+/* n shuffled DirItems with random names, sizes and times */
+static DirItem **sort_test_items(int n)
+{
+	DirItem **items = g_new(DirItem *, n);
+	GRand *rand = g_rand_new_with_seed(42);
+
+	for (int i = 0; i < n; i++)
+	{
+		gchar *name = g_strdup_printf("file-%08x-%d.txt",
+				g_rand_int(rand), i);
+		items[i] = diritem_new(name);
+		items[i]->size = g_rand_int(rand);
+		items[i]->mtime = g_rand_int(rand);
+		diritem_collate_key(items[i]);
+		g_free(name);
+	}
+
+	g_rand_free(rand);
+	return items;
+}
+
+static void free_sort_test_items(DirItem **items, int n)
+{
+	for (int i = 0; i < n; i++)
+		diritem_free(items[i]);
+	g_free(items);
+}
+
+/* display_sort_order() puts shuffled items in the same order as qsort()
+ * with the sort function, and spots when they are sorted already.
+ */
+void display_sort_tests(void)
+{
+	int n = 2000;
+	DirItem **items = sort_test_items(n);
+	DirItem **copy = g_new(DirItem *, n);
+	guint *perm = g_new(guint, n);
+	int i, t;
+
+	for (t = 0; t < G_N_ELEMENTS(test_types); t++)
+	{
+		test_fn = sort_fn_for(test_types[t]);
+		memcpy(copy, items, n * sizeof(DirItem *));
+		qsort(copy, n, sizeof(DirItem *), test_cmp);
+
+		g_assert(display_sort_order(test_types[t], GTK_SORT_ASCENDING,
+					items, n, perm));
+		for (i = 0; i < n; i++)
+			g_assert_cmpint(test_fn(items[perm[i]], copy[i]), ==, 0);
+
+		g_assert(!display_sort_order(test_types[t], GTK_SORT_ASCENDING,
+					copy, n, perm));
+	}
+
+	free_sort_test_items(items, n);
+	g_free(copy);
+	g_free(perm);
+}
+
+/* Times resorting $ROX_RESORT_BENCH_SIZE (default 500000) shuffled items
+ * with qsort() and the sort function, and with display_sort_order().
+ */
+void display_sort_benchmark(void)
+{
+	const char *env_size = g_getenv("ROX_RESORT_BENCH_SIZE");
+	int n = env_size ? atoi(env_size) : 500000;
+	DirItem **items = sort_test_items(n);
+	DirItem **copy = g_new(DirItem *, n);
+	guint *perm = g_new(guint, n);
+	int t;
+
+	for (t = 0; t < G_N_ELEMENTS(test_types); t++)
+	{
+		gint64 start, qsort_time;
+
+		test_fn = sort_fn_for(test_types[t]);
+		memcpy(copy, items, n * sizeof(DirItem *));
+		start = g_get_monotonic_time();
+		qsort(copy, n, sizeof(DirItem *), test_cmp);
+		qsort_time = g_get_monotonic_time() - start;
+
+		start = g_get_monotonic_time();
+		display_sort_order(test_types[t], GTK_SORT_ASCENDING,
+				items, n, perm);
+		g_print("Sort %d by %s: qsort %.1f ms, keys %.1f ms\n",
+				n, test_names[t], qsort_time / 1000.0,
+				(g_get_monotonic_time() - start) / 1000.0);
+	}
+
+	free_sort_test_items(items, n);
+	g_free(copy);
+	g_free(perm);
+}
+#endif
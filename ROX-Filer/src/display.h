@@ -26,6 +26,7 @@ struct _ViewData
 	GdkPixbuf *thumb;
 	int iconstatus; //0:unknown, 1:init, 2:done, 3:may thumb, 4:delay, -1:re
 	gboolean recent;
+	gboolean estimated;		/* name_width/height are guesses */
 };
 
 extern Option o_display_dirs_first;
@@ -37,6 +38,7 @@ extern Option o_display_show_dir_thumbs;
 extern Option o_large_width;
 extern Option o_small_width;
 extern Option o_max_length;
+extern Option o_display_estimate_over;
 extern Option o_vertical_order_small, o_vertical_order_large;
 extern Option o_xattr_show;
 extern Option o_view_alpha;
@@ -55,6 +57,7 @@ extern Option o_display_show_atime;
 extern Option o_display_show_ctime;
 extern Option o_display_show_mtime;
 extern Option o_display_save_col_order;
+extern Option o_display_newly_first;
 
 /* Prototypes */
 void display_init(void);
@@ -77,6 +80,8 @@ int sort_by_size(const void *item1, const void *item2);
 int sort_by_perm(const void *item1, const void *item2);
 int sort_by_owner(const void *item1, const void *item2);
 int sort_by_group(const void *item1, const void *item2);
+gboolean display_sort_order(SortType sort_type, GtkSortType order,
+			    DirItem **items, int n, guint *perm);
 void display_set_sort_type(FilerWindow *filer_window, SortType sort_type,
 			   GtkSortType order);
 void display_set_autoselect(FilerWindow *filer_window, const gchar *leaf);
@@ -97,6 +102,7 @@ void display_update_view(
 			ViewData *view,
 			gboolean update_name_layout,
 			gboolean clear);
+void display_estimate_view(FilerWindow *fw, DirItem *item, ViewData *view);
 PangoLayout *make_layout(FilerWindow *fw, DirItem *item);
 PangoLayout *make_details_layout(FilerWindow *fw, DirItem *item, ViewData *view, gboolean sizeonly);
 
@@ -121,4 +127,9 @@ void draw_emblem_on_icon(GdkWindow *window, GtkStyle   *style,
 				const char *stock_id,
 			 int *x, int y, GdkColor *color);
 
+#ifdef UNIT_TESTS
+void display_sort_tests(void);
+void display_sort_benchmark(void);
+#endif
+
 #endif /* _DISPLAY_H */
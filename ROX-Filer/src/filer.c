@@ -45,6 +45,7 @@
 #include "gui_support.h"
 #include "choices.h"
 #include "pixmaps.h"
+#include "dirthumb.h"
 #include "menu.h"
 #include "dnd.h"
 #include "dir.h"
@@ -88,6 +89,7 @@ GList		*all_filer_windows = NULL;
 gint fw_font_height;
 gint fw_font_widths[0x7f];
 gint fw_font_widthsb[0x7f];
+gint fw_font_char_width;	/* Approximate, for non-ASCII */
 gint fw_mono_width;
 gint fw_mono_height;
 static PangoFontDescription *current_font = NULL;
@@ -132,18 +134,6 @@ enum settings_flags{
 
 static GHashTable *unmount_prompt_actions = NULL;
 
-typedef struct {
-	FilerWindow *fw;
-	gchar *path;
-	gchar *thumb_path;
-	GPtrArray *items;
-	int tried;
-	gboolean cancel;
-} SubDirInfo;
-
-static SubDirInfo sdinfo = {NULL, NULL, NULL, NULL, 0, TRUE};
-static GMutex m_dirthumb;
-
 /* Static prototypes */
 static void attach(FilerWindow *filer_window);
 static void detach(FilerWindow *filer_window);
@@ -181,7 +171,7 @@ static void save_settings(void);
 static gboolean check_settings(FilerWindow *filer_window, gboolean onlycheck);
 static char *tip_from_desktop_file(const char *full_path);
 
-static void free_subdir_info(void);
+static void dir_thumb_done(FilerWindow *filer_window, const gchar *path);
 
 GdkCursor *busy_cursor = NULL;
 static GdkCursor *crosshair = NULL;
@@ -473,19 +463,83 @@ void filer_link(FilerWindow *left, FilerWindow *right)
 		g_timeout_add(200, (GSourceFunc)acceptfocuscb, right);
 }
 
+/* TRUE if the window shows nothing but names, so directories can be typed
+ * from their directory entries without statting them.
+ */
+gboolean filer_names_only(FilerWindow *filer_window)
+{
+	return filer_window->view_type == VIEW_TYPE_COLLECTION &&
+	       filer_window->details_type == DETAILS_NONE &&
+	       filer_window->sort_type == SORT_NAME;
+}
+
+/* Which of the optional DirItemFields this window shows or sorts by */
+int filer_stat_fields(FilerWindow *filer_window)
+{
+	int fields = 0;
+
+	if (filer_window->view_type == VIEW_TYPE_DETAILS)
+	{
+		if (o_display_show_owner.int_value ||
+		    o_display_show_group.int_value)
+			fields |= DIRITEM_STAT_OWNER;
+		if (o_display_show_atime.int_value ||
+		    o_display_show_ctime.int_value ||
+		    o_display_show_mtime.int_value)
+			fields |= DIRITEM_STAT_TIMES;
+	}
+	else if (filer_window->details_type == DETAILS_PERMISSIONS)
+		fields |= DIRITEM_STAT_OWNER;
+	else if (filer_window->details_type == DETAILS_TIMES)
+		fields |= DIRITEM_STAT_TIMES;
+
+	switch (filer_window->sort_type)
+	{
+		case SORT_OWNER:
+		case SORT_GROUP:
+			fields |= DIRITEM_STAT_OWNER;
+			break;
+		case SORT_DATEA:
+		case SORT_DATEC:
+		case SORT_DATEM:
+			fields |= DIRITEM_STAT_TIMES;
+			break;
+		default:
+			break;
+	}
+
+	return fields;
+}
+
 /* Look through all items we want to display, and queue a recheck on any
  * that require it.
  */
 static void queue_interesting(FilerWindow *filer_window)
 {
+	Directory *dir = filer_window->directory;
 	DirItem	*item;
 	ViewIter iter;
+	int	need = ITEM_FLAG_NEED_RESCAN_QUEUE;
+	int	fields = filer_stat_fields(filer_window);
+
+	if (!filer_names_only(filer_window) && dir->lazy_stat)
+	{
+		dir->lazy_stat = FALSE;
+		need |= ITEM_FLAG_LAZY_STAT;
+	}
+
+	/* Items statted for other windows may lack some details */
+	if (fields & ~dir->stat_fields)
+	{
+		dir->stat_fields |= fields;
+		need |= ITEM_FLAG_LAZY_STAT;
+	}
 
 	view_get_iter(filer_window->view, &iter, 0);
 	while ((item = iter.next(&iter)))
 	{
-		if (item->flags & ITEM_FLAG_NEED_RESCAN_QUEUE)
-			dir_queue_recheck(filer_window->directory, item);
+		if (item->flags & need)
+			dir_queue_recheck(dir, item);
 	}
 }
 
@@ -993,12 +1047,10 @@ static void filer_window_destroyed(GtkWidget *widget, FilerWindow *filer_window)
 		filer_window->auto_scroll = -1;
 	}
 
-	g_mutex_lock(&m_dirthumb);
-	g_mutex_unlock(&m_dirthumb);
-	if (sdinfo.fw == filer_window)
-		free_subdir_info();
+	dirthumb_cancel(filer_window);
 
 	g_queue_free_full(filer_window->thumb_queue, g_free);
+	g_hash_table_destroy(filer_window->thumb_queued);
 
 	tooltip_show(NULL);
 
@@ -1957,6 +2009,7 @@ FilerWindow *filer_opendir(const char *path, FilerWindow *src_win,
 	filer_window->temp_item_selected = FALSE;
 	filer_window->flags = (FilerFlags) 0;
 	filer_window->thumb_queue = g_queue_new();
+	filer_window->thumb_queued = g_hash_table_new(g_str_hash, g_str_equal);
 	filer_window->thumb_bar_time = 0;
 	filer_window->max_thumbs = 0;
 	filer_window->trying_thumbs = 0;
@@ -2159,7 +2212,9 @@ static gint set_font(GtkWidget *widget)
 		cairo_scaled_font_t *scaledb =
 			pango_cairo_font_get_scaled_font(PANGO_CAIRO_FONT(fontb));
 
-		if (o_fast_font_calc.int_value)
+		/* Also used to estimate widths in big directories, so made
+		 * even without fast_font_calc.
+		 */
 		{
 			gint i = 0x20;
 			gchar n[] = {' ', '\0'};
@@ -2178,6 +2233,11 @@ static gint set_font(GtkWidget *widget)
 			}
 		}
 
+		PangoFontMetrics *metrics = pango_font_get_metrics(font, NULL);
+		fw_font_char_width = PANGO_PIXELS(
+			pango_font_metrics_get_approximate_char_width(metrics));
+		pango_font_metrics_unref(metrics);
+
 		g_object_unref(font);
 		g_object_unref(fontb);
 
@@ -2816,99 +2876,66 @@ static void set_selection_state(FilerWindow *filer_window, gboolean normal)
 		gtk_widget_queue_draw(GTK_WIDGET(filer_window->view));
 }
 
-static void free_subdir_info(void)
+void filer_cancel_thumbnails(FilerWindow *filer_window)
 {
-	if (!sdinfo.path) return;
-	g_free(sdinfo.path);
-	g_free(sdinfo.thumb_path);
+	filer_window->thumb_bar_time = 0;
+	if (gtk_widget_get_visible(filer_window->thumb_bar))
+	{
+		gtk_widget_hide(filer_window->thumb_bar);
+		filer_autosize(filer_window);
+	}
+
+	g_hash_table_remove_all(filer_window->thumb_queued);
+	g_queue_free_full(filer_window->thumb_queue, g_free);
+	filer_window->thumb_queue = g_queue_new();
 
-	guint i = sdinfo.items->len;
-	while (i--) g_free(sdinfo.items->pdata[i]);
-	g_ptr_array_free(sdinfo.items, TRUE);
+	filer_window->max_thumbs = 0;
 
-	static const SubDirInfo clear = {NULL, NULL, NULL, NULL, 0, TRUE};
-	sdinfo = clear;
-}
+	dirthumb_cancel(filer_window);
 
-static gpointer scandir_thread(gpointer data)
-{
-	//alphasort is not equal to rox's sort. Even doesn't check current settings.
-	sdinfo.cancel = FALSE;
-	sdinfo.tried = 0;
-	sdinfo.items = list_dir_all(sdinfo.path);
-	g_mutex_unlock(&m_dirthumb);
-	return NULL;
+	pixmap_cancel_thumbs(filer_window->window);
 }
 
-static gboolean make_dir_thumb_link()
+/* Take the next path to thumbnail off the queue. Items on screen go first,
+ * then those in the next screenful, so that scrolling moves the work
+ * along with it; otherwise the oldest request (images found for
+ * subdirectories are queued as the oldest). g_free() the result.
+ */
+static gchar *take_next_thumb(FilerWindow *filer_window)
 {
-	gchar *path = sdinfo.path;
-	gchar *thumb_path = sdinfo.thumb_path;
-
-	int i = sdinfo.tried;
-	sdinfo.tried += 3;
-	int end = MIN(sdinfo.items->len, 99);
-	int currentend = MIN(sdinfo.tried, end);
+	GQueue *queue = filer_window->thumb_queue;
+	GList *link = NULL;
+	gchar *path;
 
-	for (; i < currentend; i++)
+	if (g_hash_table_size(filer_window->thumb_queued))
 	{
-		const gchar *subpath = make_path(path,
-				sdinfo.items->pdata[i]);
+		GPtrArray *visible = g_ptr_array_new();
+		guint i;
 
-		struct stat	info;
-		if (mc_lstat(subpath, &info) == -1 ||
-			mode_to_base_type(info.st_mode) != TYPE_FILE)
-			continue;
+		view_get_visible_items(filer_window->view, visible, 1);
 
-		gchar *sp = g_strdup(subpath);
-		switch (pixmap_check_thumb(sp))
+		for (i = 0; i < visible->len && !link; i++)
 		{
-		case 0:
-			sdinfo.fw->max_thumbs++;
-			g_queue_push_tail(sdinfo.fw->thumb_queue, sp/*eaten*/);
-			goto done;
-		case 1:
-			{
-			char *sub_thumb_path = pixmap_make_thumb_path(sp);
-			char *rel_path = get_relative_path(thumb_path, sub_thumb_path);
-			g_free(sub_thumb_path);
-
-			if (symlink(rel_path, thumb_path) == 0)
-				dir_force_update_path(path, TRUE);
-			//even the symlink fails this loop wills break.
+			DirItem *item = visible->pdata[i];
 
-			g_free(rel_path);
-			g_free(sp);
-			goto done;
-			}
+			link = g_hash_table_lookup(filer_window->thumb_queued,
+				make_path(filer_window->real_path,
+					  item->leafname));
 		}
-		g_free(sp);
-	}
-
-	if (currentend < end)
-		return TRUE;
 
-done:
-	free_subdir_info();
-	return FALSE;
-}
-
-void filer_cancel_thumbnails(FilerWindow *filer_window)
-{
-	filer_window->thumb_bar_time = 0;
-	if (gtk_widget_get_visible(filer_window->thumb_bar))
-	{
-		gtk_widget_hide(filer_window->thumb_bar);
-		filer_autosize(filer_window);
+		g_ptr_array_free(visible, TRUE);
 	}
 
-	g_queue_free_full(filer_window->thumb_queue, g_free);
-	filer_window->thumb_queue = g_queue_new();
+	if (!link)
+		link = queue->tail;
 
-	filer_window->max_thumbs = 0;
+	path = link->data;
+	/* (The same path may be queued again, further on) */
+	if (g_hash_table_lookup(filer_window->thumb_queued, path) == link)
+		g_hash_table_remove(filer_window->thumb_queued, path);
+	g_queue_delete_link(queue, link);
 
-	if (sdinfo.fw == filer_window)
-		sdinfo.cancel = TRUE;
+	return path;
 }
 
 /* Generate the next thumb for this window. The window object is
@@ -2919,7 +2946,6 @@ static gboolean filer_next_thumb_real(GObject *window)
 {
 	FilerWindow *filer_window, *fw;
 	gchar	*path;
-	gboolean noorder = FALSE;
 
 	fw = filer_window = g_object_get_data(window, "filer_window");
 
@@ -2929,39 +2955,18 @@ static gboolean filer_next_thumb_real(GObject *window)
 		return FALSE;
 	}
 
-	if (g_mutex_trylock(&m_dirthumb))
-		g_mutex_unlock(&m_dirthumb);
-	else
-	{
-		filer_next_thumb(window, NULL);
-		return FALSE;
-	}
-
-	if (!sdinfo.cancel && sdinfo.items->len)
-	{
-		guint len = filer_window->thumb_queue->length;
-
-		if (make_dir_thumb_link())
-		{
-			filer_next_thumb(window, NULL);
-			return FALSE;
-		}
-		//this is first item and only one of subdir
-		noorder = len != filer_window->thumb_queue->length;
-	}
-	else
-		free_subdir_info();
-
 	if (g_queue_is_empty(filer_window->thumb_queue))
 	{
 		filer_window->trying_thumbs--;
-		if (filer_window->trying_thumbs == 0)
+		/* (Subdirectories still being looked into may queue more) */
+		if (filer_window->trying_thumbs == 0 &&
+				!dirthumb_pending(filer_window))
 			filer_cancel_thumbnails(filer_window);
 		g_object_unref(window);
 		return FALSE;
 	}
 
-	path = (gchar *) g_queue_pop_tail(filer_window->thumb_queue);
+	path = take_next_thumb(filer_window);
 
 	if (!g_file_test(path, G_FILE_TEST_EXISTS))
 	{
@@ -2977,16 +2982,8 @@ static gboolean filer_next_thumb_real(GObject *window)
 			struct stat info;
 			if (mc_lstat(path, &info) != -1 &&
 				mode_to_base_type(info.st_mode) == TYPE_DIRECTORY)
-			{
-				free_subdir_info();
-				sdinfo.fw = filer_window;
-				sdinfo.thumb_path = pixmap_make_thumb_path(path);
-				sdinfo.path = g_strdup(path);
-				g_mutex_lock(&m_dirthumb);
-				GThread *scd = g_thread_new("scandir_t", scandir_thread, NULL);
-
-				g_thread_unref(scd);
-			}
+				dirthumb_start(path, filer_window,
+					(DirThumbFunc) dir_thumb_done);
 		}
 	case -2:
 		filer_next_thumb(window, NULL);
@@ -2998,7 +2995,7 @@ static gboolean filer_next_thumb_real(GObject *window)
 		break;
 	}
 
-	pixmap_background_thumb(path, noorder, (GFunc) filer_next_thumb, window);
+	pixmap_background_thumb(path, FALSE, (GFunc) filer_next_thumb, window);
 
 	if (!fw->thumb_bar_time) {
 		fw->thumb_bar_time = g_get_monotonic_time();
@@ -3046,6 +3043,25 @@ static void start_thumb_scanning(FilerWindow *filer_window)
 	filer_next_thumb(G_OBJECT(filer_window->window), NULL);
 }
 
+/* A subdirectory's task is over. If it found an image with no thumbnail
+ * yet, make one; the directory will link to it when it's done.
+ */
+static void dir_thumb_done(FilerWindow *filer_window, const gchar *path)
+{
+	if (path)
+	{
+		filer_window->max_thumbs++;
+		g_queue_push_tail(filer_window->thumb_queue, g_strdup(path));
+		g_hash_table_replace(filer_window->thumb_queued,
+				filer_window->thumb_queue->tail->data,
+				filer_window->thumb_queue->tail);
+		start_thumb_scanning(filer_window);
+	}
+	else if (filer_window->trying_thumbs == 0 &&
+			!dirthumb_pending(filer_window))
+		filer_cancel_thumbnails(filer_window);
+}
+
 /* Set this image to be loaded some time in the future */
 void filer_create_thumb(FilerWindow *filer_window, const gchar *path)
 {
@@ -3056,6 +3072,10 @@ void filer_create_thumb(FilerWindow *filer_window, const gchar *path)
 	filer_window->max_thumbs++;
 
 	g_queue_push_head(filer_window->thumb_queue, g_strdup(path));
+	/* Replace the key too: it belongs to the link it points at */
+	g_hash_table_replace(filer_window->thumb_queued,
+			filer_window->thumb_queue->head->data,
+			filer_window->thumb_queue->head);
 
 	start_thumb_scanning(filer_window);
 }
@@ -3080,6 +3100,8 @@ void filer_create_thumbs(FilerWindow *filer_window, GPtrArray *items)
 	DirItem *item;
 	ViewIter iter;
 	int index = 0;
+	GPtrArray *leafnames;
+	guint i;
 
 	if (!filer_window->show_thumbs)
 		return;
@@ -3087,10 +3109,9 @@ void filer_create_thumbs(FilerWindow *filer_window, GPtrArray *items)
 	if (items == NULL)
 		view_get_iter(filer_window->view, &iter, 0);
 
+	leafnames = g_ptr_array_new();
 	while ((item = diritem_next(&iter, items, &index)))
 	{
-		const guchar *path;
-
 		 if (item->base_type != TYPE_FILE &&
 				(o_display_show_dir_thumbs.int_value != 1 ||
 				 item->base_type != TYPE_DIRECTORY))
@@ -3099,9 +3120,17 @@ void filer_create_thumbs(FilerWindow *filer_window, GPtrArray *items)
 		 /*if (strcmp(item->mime_type->media_type, "image") != 0)
 		   continue;*/
 
-		path = make_path(filer_window->real_path, item->leafname);
-		filer_create_thumb(filer_window, path);
+		g_ptr_array_add(leafnames, item->leafname);
 	}
+
+	/* Each of these is about to be checked for a thumbnail */
+	pixmap_hash_thumbs(filer_window->real_path, leafnames);
+
+	for (i = 0; i < leafnames->len; i++)
+		filer_create_thumb(filer_window, make_path(
+				filer_window->real_path, leafnames->pdata[i]));
+
+	g_ptr_array_free(leafnames, TRUE);
 }
 
 static void filer_options_changed(void)
@@ -3117,15 +3146,6 @@ static void filer_options_changed(void)
 		}
 	}
 
-	if (o_fast_font_calc.has_changed &&
-		o_fast_font_calc.int_value &&
-		all_filer_windows)
-	{
-		pango_font_description_free(current_font);
-		current_font = NULL;
-		set_font(((FilerWindow *) all_filer_windows->data)->window);
-	}
-
 
 	if (all_filer_windows && o_hide_root_msg.has_changed)
 		for (GList *next = all_filer_windows; next; next = next->next)
@@ -3875,16 +3895,8 @@ void filer_refresh_thumbs(FilerWindow *filer_window)
 	ViewIter iter;
 	DirItem *item;
 
-	g_mutex_lock(&m_dirthumb);
-	g_mutex_unlock(&m_dirthumb);
-
 	filer_cancel_thumbnails(filer_window);
 
-	if (!sdinfo.cancel && sdinfo.items->len)
-		while (make_dir_thumb_link()) {}
-	else
-		free_subdir_info();
-
 	set_scanning_display(filer_window, TRUE);
 
 	char *thumb_path = pixmap_make_thumb_path(filer_window->real_path);
@@ -3913,17 +3925,8 @@ void filer_refresh_thumbs(FilerWindow *filer_window)
 		if (!filer_window->show_thumbs)
 			; //do nothing
 		else if (item->base_type == TYPE_DIRECTORY)
-		{
-			free_subdir_info();
-			sdinfo.fw = filer_window;
-			sdinfo.thumb_path = g_strdup(thumb_path);
-			sdinfo.path = g_strdup(path);
-
-			g_mutex_lock(&m_dirthumb);
-			GThread *scd = g_thread_new("scandir_t", scandir_thread, NULL);
-			g_thread_join(scd);
-			while (make_dir_thumb_link()) {}
-		}
+			dirthumb_start(path, filer_window,
+					(DirThumbFunc) dir_thumb_done);
 		else
 			filer_create_thumb(filer_window, path);
 
@@ -109,6 +109,7 @@ struct _FilerWindow
 
 	gboolean	show_thumbs;
 	GQueue		*thumb_queue;		/* paths to thumbnail */
+	GHashTable	*thumb_queued;		/* path -> its thumb_queue link */
 	GtkWidget	*thumb_bar;
 	gint64		thumb_bar_time;
 	int		max_thumbs;		/* total for this batch */
@@ -161,6 +162,7 @@ extern Option		o_scroll_speed;
 extern gint 		fw_font_height;
 extern gint 		fw_font_widths[0x7f];
 extern gint 		fw_font_widthsb[0x7f];
+extern gint 		fw_font_char_width;
 extern gint 		fw_mono_height;
 extern gint 		fw_mono_width;
 extern GdkCursor *busy_cursor;
@@ -198,6 +200,8 @@ void filer_create_thumbs(FilerWindow *filer_window, GPtrArray *items);
 void filer_add_tip_details(FilerWindow *filer_window,
 			   GString *tip, DirItem *item);
 void filer_selection_changed(FilerWindow *filer_window, gint time);
+gboolean filer_names_only(FilerWindow *filer_window);
+int filer_stat_fields(FilerWindow *filer_window);
 void filer_lost_selection(FilerWindow *filer_window, guint time);
 void filer_window_set_size(FilerWindow *filer_window, int w, int h, gboolean ntauto);
 gboolean filer_window_delete(GtkWidget *window,
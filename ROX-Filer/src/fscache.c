@@ -11,6 +11,15 @@
  * The actual data need not be the raw file contents - a user specified
  * function loads the file and associates data with the file in the cache.
  *
+ * A cache may be given a budget in bytes. Entries are kept in order of use,
+ * and whenever something is added the least recently used ones are dropped
+ * until the total fits again.
+ *
+ * Entries are spread over FSCACHE_SHARDS shards by a hash of their device
+ * and inode. Each shard has its own lock, table and LRU list (and an equal
+ * part of the budget), so threads looking up different files seldom wait
+ * for each other.
+ *
  * This program is free software; you can redistribute it and/or modify it
  * under the terms of the GNU General Public License as published by the Free
  * Software Foundation; either version 2 of the License, or (at your option)
@@ -28,31 +37,64 @@
 
 #include "config.h"
 
+#include <string.h>
+#include <fcntl.h>
+
 #include "global.h"
 
 #include "fscache.h"
 
+/* Times in nanoseconds, so that a file rewritten within the same second
+ * as it was loaded is still seen to have changed.
+ */
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+# define NSEC(ts) ((gint64) (ts).tv_sec * 1000000000 + (ts).tv_nsec)
+# define MTIME_NS(info) NSEC((info).st_mtim)
+# define CTIME_NS(info) NSEC((info).st_ctim)
+#else
+# define MTIME_NS(info) ((gint64) (info).st_mtime * 1000000000)
+# define CTIME_NS(info) ((gint64) (info).st_ctime * 1000000000)
+#endif
+
 #define UPTODATE(data, info)				\
-		(data->m_time == info.st_mtime		\
-		 && data->c_time == info.st_ctime	\
+		(data->m_time == MTIME_NS(info)		\
+		 && data->c_time == CTIME_NS(info)	\
 		 && data->length == info.st_size	\
 		 && data->mode == info.st_mode)		\
 
+#define SET_DETAILS(data, info) do {			\
+		data->m_time = MTIME_NS(info);		\
+		data->c_time = CTIME_NS(info);		\
+		data->length = info.st_size;		\
+		data->mode = info.st_mode;		\
+	} while (0)
+
+/* Counted for every entry, as well as what the size function says */
+#define ENTRY_OVERHEAD (sizeof(GFSCacheData) + sizeof(GFSCacheKey))
 
 /* Static prototypes */
 
+static guint64 mix_key(const GFSCacheKey *key);
+static GFSCacheShard *shard_for(GFSCache *cache, const GFSCacheKey *key);
 static guint hash_key(gconstpointer key);
 static gint cmp_stats(gconstpointer a, gconstpointer b);
 static void destroy_hash_entry(gpointer key, gpointer data, gpointer user_data);
 static gboolean purge_hash_entry(gpointer key, gpointer data,
 				 gpointer user_data);
-static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
-					FSCacheLookup lookup_type);
+static gboolean lookup_internal(GFSCache *cache, int dir_fd,
+				const char *dirpath, const char *name,
+				FSCacheLookup lookup_type,
+				GObject *put, GObject **get);
+static void touch(GFSCache *cache, GFSCacheShard *shard, GFSCacheData *data);
+static void forget(GFSCacheShard *shard, GFSCacheData *data);
+static GList *evict(GFSCache *cache, GFSCacheShard *shard,
+		    GFSCacheData *keep);
+static void free_entries(GList *entries);
 
 
 struct PurgeInfo
 {
-	GFSCache *cache;
+	GFSCacheShard *shard;
 	gint	 age;
 	time_t	 now;
 };
@@ -73,19 +115,35 @@ struct PurgeInfo
  * out of date. If NULL, the object will be unref'd and load() used
  * to make a new one.
  *
+ * size() gives the memory an object uses, in bytes. The least recently
+ * used entries are evicted to keep the total within 'budget'. Objects
+ * that are in use elsewhere are never evicted. If 'budget' is 0, or size
+ * is NULL, entries stay until purged or removed.
+ *
  * 'user_data' will be passed to all of the above functions.
  */
 GFSCache *g_fscache_new(GFSLoadFunc load,
 			GFSUpdateFunc update,
+			GFSSizeFunc size,
+			gsize budget,
 			gpointer user_data)
 {
 	GFSCache *cache;
+	int i;
+
+	cache = g_new0(GFSCache, 1);
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
 
-	cache = g_new(GFSCache, 1);
-	cache->inode_to_stats = g_hash_table_new(hash_key, cmp_stats);
-	g_mutex_init(&cache->mutex);
+		shard->inode_to_stats = g_hash_table_new(hash_key, cmp_stats);
+		g_mutex_init(&shard->mutex);
+		g_queue_init(&shard->lru);
+	}
 	cache->load = load;
 	cache->update = update;
+	cache->size = size;
+	cache->budget = size ? budget : 0;
 	cache->user_data = user_data;
 
 	return cache;
@@ -93,15 +151,107 @@ GFSCache *g_fscache_new(GFSLoadFunc load,
 
 void g_fscache_destroy(GFSCache *cache)
 {
+	int i;
+
 	g_return_if_fail(cache != NULL);
 
-	g_hash_table_foreach(cache->inode_to_stats, destroy_hash_entry, NULL);
-	g_hash_table_destroy(cache->inode_to_stats);
-	g_mutex_clear(&cache->mutex);
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
+
+		g_hash_table_foreach(shard->inode_to_stats,
+				destroy_hash_entry, NULL);
+		g_hash_table_destroy(shard->inode_to_stats);
+		g_mutex_clear(&shard->mutex);
+	}
 
 	g_free(cache);
 }
 
+/* Change the budget, evicting entries now if it has shrunk */
+void g_fscache_set_budget(GFSCache *cache, gsize budget)
+{
+	int i;
+
+	g_return_if_fail(cache != NULL);
+	g_return_if_fail(cache->size != NULL || budget == 0);
+
+	cache->budget = budget;
+
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
+		GList *victims;
+
+		g_mutex_lock(&shard->mutex);
+		victims = evict(cache, shard, NULL);
+		g_mutex_unlock(&shard->mutex);
+
+		free_entries(victims);
+	}
+}
+
+/* How well the cache is doing. Sizes were measured when each entry was
+ * last used.
+ */
+void g_fscache_get_stats(GFSCache *cache, GFSCacheStats *stats)
+{
+	int i;
+
+	g_return_if_fail(cache != NULL);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->budget = cache->budget;
+
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
+
+		g_mutex_lock(&shard->mutex);
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+		stats->entries += shard->lru.length;
+		stats->bytes += shard->bytes;
+		g_mutex_unlock(&shard->mutex);
+	}
+}
+
+/* Call func(object, user_data) for every object in the cache. The shards
+ * aren't locked during the calls, so func may use the cache itself.
+ */
+void g_fscache_foreach(GFSCache *cache, GFunc func, gpointer user_data)
+{
+	GList *objects = NULL, *next;
+	int i;
+
+	g_return_if_fail(cache != NULL);
+
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
+
+		g_mutex_lock(&shard->mutex);
+		for (next = shard->lru.head; next; next = next->next)
+		{
+			GFSCacheData *data = next->data;
+
+			if (data->data)
+				objects = g_list_prepend(objects,
+						g_object_ref(data->data));
+		}
+		g_mutex_unlock(&shard->mutex);
+	}
+
+	for (next = objects; next; next = next->next)
+	{
+		func(next->data, user_data);
+		g_object_unref(next->data);
+	}
+
+	g_list_free(objects);
+}
+
 /* Find the data for this file in the cache, loading it into
  * the cache if it isn't there already.
  *
@@ -126,20 +276,10 @@ gpointer g_fscache_lookup(GFSCache *cache, const char *pathname)
 void g_fscache_insert(GFSCache *cache, const char *pathname, gpointer obj,
 		      gboolean update_details)
 {
-	GFSCacheData	*data;
-
-	data = lookup_internal(cache, pathname,
+	lookup_internal(cache, AT_FDCWD, NULL, pathname,
 			update_details ? FSCACHE_LOOKUP_INIT
-				       : FSCACHE_LOOKUP_INSERT);
-
-	if (!data)
-		return;
-
-	if (obj)
-		g_object_ref(obj);
-	if (data->data)
-		g_object_unref(data->data);
-	data->data = obj;
+				       : FSCACHE_LOOKUP_INSERT,
+			obj, NULL);
 }
 
 /* As g_fscache_lookup, but 'lookup_type' controls what happens if the data
@@ -153,26 +293,43 @@ gpointer g_fscache_lookup_full(GFSCache *cache, const char *pathname,
 				FSCacheLookup lookup_type,
 				gboolean *found)
 {
-	GFSCacheData *data;
+	return g_fscache_lookup_full_at(cache, AT_FDCWD, NULL, pathname,
+					lookup_type, found);
+}
 
-	g_return_val_if_fail(lookup_type != FSCACHE_LOOKUP_INIT, NULL);
+/* As g_fscache_lookup(), but for 'leafname' in the directory open as
+ * 'dir_fd', whose path is 'dirpath'. The file is statted with fstatat(),
+ * rather than by walking down the whole path again; the full path is
+ * only made if the file needs loading.
+ */
+gpointer g_fscache_lookup_at(GFSCache *cache, int dir_fd,
+			     const char *dirpath, const char *leafname)
+{
+	return g_fscache_lookup_full_at(cache, dir_fd, dirpath, leafname,
+					FSCACHE_LOOKUP_CREATE, NULL);
+}
 
-	data = lookup_internal(cache, pathname, lookup_type);
+/* As g_fscache_lookup_full(), but relative to 'dir_fd' as for
+ * g_fscache_lookup_at(). If 'dir_fd' is AT_FDCWD, 'dirpath' may be NULL
+ * and 'name' a whole path.
+ */
+gpointer g_fscache_lookup_full_at(GFSCache *cache, int dir_fd,
+				  const char *dirpath, const char *name,
+				  FSCacheLookup lookup_type,
+				  gboolean *found)
+{
+	GObject *obj = NULL;
+	gboolean got;
 
-	if (!data)
-	{
-		if (found)
-			*found = FALSE;
-		return NULL;
-	}
+	g_return_val_if_fail(lookup_type != FSCACHE_LOOKUP_INIT, NULL);
 
-	if (found)
-		*found = TRUE;
+	got = lookup_internal(cache, dir_fd, dirpath, name, lookup_type,
+			      NULL, &obj);
 
-	if (data->data)
-		g_object_ref(data->data);
+	if (found)
+		*found = got;
 
-	return data->data;
+	return obj;
 }
 
 /* Call the update() function on this item if it's in the cache
@@ -181,6 +338,7 @@ gpointer g_fscache_lookup_full(GFSCache *cache, const char *pathname,
 void g_fscache_may_update(GFSCache *cache, const char *pathname)
 {
 	GFSCacheKey	key;
+	GFSCacheShard	*shard;
 	GFSCacheData	*data;
 	struct stat 	info;
 
@@ -193,25 +351,24 @@ void g_fscache_may_update(GFSCache *cache, const char *pathname)
 
 	key.device = info.st_dev;
 	key.inode = info.st_ino;
+	shard = shard_for(cache, &key);
 
-	g_mutex_lock(&cache->mutex);
-	data = g_hash_table_lookup(cache->inode_to_stats, &key);
+	g_mutex_lock(&shard->mutex);
+	data = g_hash_table_lookup(shard->inode_to_stats, &key);
 
 	if (data && !UPTODATE(data, info))
 	{
 		cache->update(data->data, pathname, cache->user_data);
-		data->m_time = info.st_mtime;
-		data->c_time = info.st_ctime;
-		data->length = info.st_size;
-		data->mode = info.st_mode;
+		SET_DETAILS(data, info);
 	}
-	g_mutex_unlock(&cache->mutex);
+	g_mutex_unlock(&shard->mutex);
 }
 
 /* Call the update() function on this item iff it's in the cache. */
 void g_fscache_update(GFSCache *cache, const char *pathname)
 {
 	GFSCacheKey	key;
+	GFSCacheShard	*shard;
 	GFSCacheData	*data;
 	struct stat 	info;
 
@@ -224,24 +381,23 @@ void g_fscache_update(GFSCache *cache, const char *pathname)
 
 	key.device = info.st_dev;
 	key.inode = info.st_ino;
+	shard = shard_for(cache, &key);
 
-	g_mutex_lock(&cache->mutex);
-	data = g_hash_table_lookup(cache->inode_to_stats, &key);
+	g_mutex_lock(&shard->mutex);
+	data = g_hash_table_lookup(shard->inode_to_stats, &key);
 
 	if (data)
 	{
 		cache->update(data->data, pathname, cache->user_data);
-		data->m_time = info.st_mtime;
-		data->c_time = info.st_ctime;
-		data->length = info.st_size;
-		data->mode = info.st_mode;
+		SET_DETAILS(data, info);
 	}
-	g_mutex_unlock(&cache->mutex);
+	g_mutex_unlock(&shard->mutex);
 }
 
 void g_fscache_remove(GFSCache *cache, const char *pathname)
 {
 	GFSCacheKey key;
+	GFSCacheShard *shard;
 	GFSCacheData *data;
 	struct stat info;
 
@@ -253,16 +409,24 @@ void g_fscache_remove(GFSCache *cache, const char *pathname)
 
 	key.device = info.st_dev;
 	key.inode = info.st_ino;
+	shard = shard_for(cache, &key);
 
-	g_mutex_lock(&cache->mutex);
-	data = (GFSCacheData *) g_hash_table_lookup(cache->inode_to_stats, &key);
-	g_hash_table_remove(cache->inode_to_stats, &key);
-	g_mutex_unlock(&cache->mutex);
-
-	if (data && data->data)
-		g_object_unref(data->data);
-	g_free(data);
+	g_mutex_lock(&shard->mutex);
+	data = (GFSCacheData *) g_hash_table_lookup(shard->inode_to_stats, &key);
+	if (data)
+	{
+		forget(shard, data);
+		if (data->pins)
+		{
+			/* A lookup is still using it; that frees it */
+			data->gone = TRUE;
+			data = NULL;
+		}
+	}
+	g_mutex_unlock(&shard->mutex);
 
+	if (data)
+		free_entries(g_list_prepend(NULL, data));
 }
 
 /* Remove all cache entries last accessed more than 'age' seconds
@@ -271,17 +435,22 @@ void g_fscache_remove(GFSCache *cache, const char *pathname)
 void g_fscache_purge(GFSCache *cache, gint age)
 {
 	struct PurgeInfo info;
+	int i;
 
 	g_return_if_fail(cache != NULL);
 
 	info.age = age;
-	info.cache = cache;
 	info.now = time(NULL);
 
-	g_mutex_lock(&cache->mutex);
-	g_hash_table_foreach_remove(cache->inode_to_stats, purge_hash_entry,
-			(gpointer) &info);
-	g_mutex_unlock(&cache->mutex);
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		info.shard = &cache->shards[i];
+
+		g_mutex_lock(&info.shard->mutex);
+		g_hash_table_foreach_remove(info.shard->inode_to_stats,
+				purge_hash_entry, (gpointer) &info);
+		g_mutex_unlock(&info.shard->mutex);
+	}
 }
 
 
@@ -290,12 +459,35 @@ void g_fscache_purge(GFSCache *cache, gint age)
  ****************************************************************/
 
 
+/* Mix the device and inode numbers together (with the finaliser from
+ * MurmurHash3), so that both the shard and the bucket depend on every bit
+ * of each. Inode numbers alone collide across devices, and are often
+ * allocated in runs.
+ */
+static guint64 mix_key(const GFSCacheKey *key)
+{
+	guint64 dev = (guint64) key->device;
+	guint64 h = (guint64) key->inode ^ (dev << 32 | dev >> 32);
+
+	h ^= h >> 33;
+	h *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= G_GUINT64_CONSTANT(0xc4ceb3fe1a85ec53);
+	h ^= h >> 33;
+
+	return h;
+}
+
+/* The top bits pick the shard; the hash tables use the bottom ones */
+static GFSCacheShard *shard_for(GFSCache *cache, const GFSCacheKey *key)
+{
+	return &cache->shards[mix_key(key) >> (64 - FSCACHE_SHARD_BITS)];
+}
+
 /* Generate a hash number for some stats */
 static guint hash_key(gconstpointer key)
 {
-	GFSCacheKey *stats = (GFSCacheKey *) key;
-
-	return stats->inode;
+	return (guint) mix_key((const GFSCacheKey *) key);
 }
 
 /* See if two stats blocks represent the same file */
@@ -325,13 +517,17 @@ static gboolean purge_hash_entry(gpointer key, gpointer data,
 	GFSCacheData *cache_data = (GFSCacheData *) data;
 
 	/* It's wasteful to remove an entry if someone else is using it */
-	if (cache_data->data && cache_data->data->ref_count > 1)
+	if (cache_data->pins ||
+	    (cache_data->data && cache_data->data->ref_count > 1))
 		return FALSE;
 
 	if (cache_data->last_lookup <= info->now
 		&& cache_data->last_lookup >= info->now - info->age)
 		return FALSE;
 
+	g_queue_unlink(&info->shard->lru, &cache_data->lru_link);
+	info->shard->bytes -= cache_data->size;
+
 	if (cache_data->data)
 		g_object_unref(cache_data->data);
 
@@ -341,93 +537,240 @@ static gboolean purge_hash_entry(gpointer key, gpointer data,
 	return TRUE;
 }
 
-/* As for g_fscache_lookup_full, but return the GFSCacheData rather than
- * the data it contains. Doesn't increment the refcount.
+/* Does the work of g_fscache_lookup_full_at() and g_fscache_insert().
+ * The entry is pinned while the shard's mutex is released (to stat, load
+ * or update), so that no other thread can free it meanwhile. When
+ * inserting, 'put' becomes the entry's object; otherwise, if 'get' isn't
+ * NULL, it is set to a new ref on it. Returns FALSE if there's no entry.
  */
-static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
-					FSCacheLookup lookup_type)
+static gboolean lookup_internal(GFSCache *cache, int dir_fd,
+				const char *dirpath, const char *name,
+				FSCacheLookup lookup_type,
+				GObject *put, GObject **get)
 {
 	struct stat 	info;
 	GFSCacheKey	key;
+	GFSCacheShard	*shard;
 	GFSCacheData	*data;
-
-	g_return_val_if_fail(cache != NULL, NULL);
-	g_return_val_if_fail(pathname != NULL, NULL);
-
-	if (mc_stat(pathname, &info))
-		return NULL;
+	GObject		*current, *loaded = NULL, *old = NULL;
+	GList		*victims = NULL;
+	gboolean	created = FALSE, uptodate;
+	gboolean	found = TRUE, set_details = FALSE, replace = FALSE;
+	gboolean	free_data;
+	gchar		*pathname;
+	int		err;
+
+	g_return_val_if_fail(cache != NULL, FALSE);
+	g_return_val_if_fail(name != NULL, FALSE);
+
+	if (dir_fd == AT_FDCWD)
+		err = mc_stat((char *) name, &info);
+	else
+		err = fstatat(dir_fd, name, &info, 0);
+	if (err)
+		return FALSE;
 
 	key.device = info.st_dev;
 	key.inode = info.st_ino;
+	shard = shard_for(cache, &key);
 
-	g_mutex_lock(&cache->mutex);
-	data = g_hash_table_lookup(cache->inode_to_stats, &key);
-	g_mutex_unlock(&cache->mutex);
+	g_mutex_lock(&shard->mutex);
+	data = g_hash_table_lookup(shard->inode_to_stats, &key);
+	uptodate = data && UPTODATE(data, info);
 
-	if (data)
+	if (lookup_type == FSCACHE_LOOKUP_PEEK)
 	{
-		/* We've cached this file already */
+		if (data)
+			shard->hits++;
+		else
+			shard->misses++;
+	}
+	else if (lookup_type != FSCACHE_LOOKUP_INIT &&
+		 lookup_type != FSCACHE_LOOKUP_INSERT)
+	{
+		if (uptodate)
+			shard->hits++;
+		else
+			shard->misses++;
+	}
 
-		if (lookup_type == FSCACHE_LOOKUP_PEEK ||
-		    lookup_type == FSCACHE_LOOKUP_INSERT)
-			goto out;	/* Never update on peeks */
+	if (!data)
+	{
+		if (lookup_type != FSCACHE_LOOKUP_CREATE &&
+		    lookup_type != FSCACHE_LOOKUP_INIT)
+		{
+			g_mutex_unlock(&shard->mutex);
+			return FALSE;
+		}
+
+		data = g_new0(GFSCacheData, 1);
+		data->key = g_memdup(&key, sizeof(key));
+		data->lru_link.data = data;
+
+		g_hash_table_insert(shard->inode_to_stats, data->key, data);
+		g_queue_push_head_link(&shard->lru, &data->lru_link);
+		created = TRUE;
+	}
 
-		if (lookup_type == FSCACHE_LOOKUP_INIT)
-			goto init;
+	data->pins++;
+	current = data->data ? g_object_ref(data->data) : NULL;
+	g_mutex_unlock(&shard->mutex);
 
-		/* Is it up-to-date? */
+	switch (lookup_type)
+	{
+		case FSCACHE_LOOKUP_INIT:
+			set_details = TRUE;
+			break;
+		case FSCACHE_LOOKUP_PEEK:
+		case FSCACHE_LOOKUP_INSERT:
+			break;		/* Never update on peeks */
+		default:
+			if (!created && uptodate)
+				break;
+			if (!created && lookup_type == FSCACHE_LOOKUP_ONLY_NEW)
+			{
+				found = FALSE;
+				break;
+			}
+
+			/* New or out-of-date */
+			set_details = TRUE;
+			pathname = dirpath ? g_build_filename(dirpath, name,
+							      NULL)
+					   : (gchar *) name;
+			if (current && cache->update)
+				cache->update(current, pathname,
+					      cache->user_data);
+			else
+			{
+				/* Create the object for the file */
+				replace = TRUE;
+				if (cache->load)
+					loaded = cache->load(pathname,
+							     cache->user_data);
+			}
+			if (pathname != name)
+				g_free(pathname);
+	}
 
-		if (UPTODATE(data, info))
-			goto out;
+	g_mutex_lock(&shard->mutex);
+	if (found)
+	{
+		if (set_details)
+			SET_DETAILS(data, info);
 
-		if (lookup_type == FSCACHE_LOOKUP_ONLY_NEW)
-			return NULL;
+		if (lookup_type == FSCACHE_LOOKUP_INIT ||
+		    lookup_type == FSCACHE_LOOKUP_INSERT)
+		{
+			old = data->data;
+			data->data = put ? g_object_ref(put) : NULL;
+		}
+		else if (replace)
+		{
+			old = data->data;
+			data->data = loaded;
+			loaded = NULL;
+		}
 
-		/* Out-of-date */
-		if (cache->update)
-			cache->update(data->data, pathname, cache->user_data);
-		else
+		data->last_lookup = time(NULL);
+		if (!data->gone)
 		{
-			if (data->data)
-				g_object_unref(data->data);
-			data->data = NULL;
+			touch(cache, shard, data);
+			victims = evict(cache, shard, data);
 		}
+
+		if (get)
+			*get = data->data ? g_object_ref(data->data) : NULL;
 	}
-	else
-	{
-		GFSCacheKey *new_key;
+	data->pins--;
+	free_data = data->gone && data->pins == 0;
+	g_mutex_unlock(&shard->mutex);
+
+	if (current)
+		g_object_unref(current);
+	if (old)
+		g_object_unref(old);
+	if (loaded)
+		g_object_unref(loaded);
+	free_entries(victims);
+	if (free_data)
+		free_entries(g_list_prepend(NULL, data));
+
+	return found;
+}
 
-		if (lookup_type != FSCACHE_LOOKUP_CREATE &&
-		    lookup_type != FSCACHE_LOOKUP_INIT)
-			return NULL;
+/* Move data to the front of the LRU list and count its size again (it may
+ * have changed since it was last used). Call with the mutex held.
+ */
+static void touch(GFSCache *cache, GFSCacheShard *shard, GFSCacheData *data)
+{
+	gsize size = ENTRY_OVERHEAD;
 
-		new_key = g_memdup(&key, sizeof(key));
+	if (cache->size && data->data)
+		size += cache->size(data->data, cache->user_data);
 
-		data = g_new(GFSCacheData, 1);
-		data->data = NULL;
+	shard->bytes = shard->bytes - data->size + size;
+	data->size = size;
 
-		g_mutex_lock(&cache->mutex);
-		g_hash_table_insert(cache->inode_to_stats, new_key, data);
-		g_mutex_unlock(&cache->mutex);
-	}
+	g_queue_unlink(&shard->lru, &data->lru_link);
+	g_queue_push_head_link(&shard->lru, &data->lru_link);
+}
+
+/* Take data out of the cache, without freeing it. Call with the shard's
+ * mutex held.
+ */
+static void forget(GFSCacheShard *shard, GFSCacheData *data)
+{
+	g_hash_table_remove(shard->inode_to_stats, data->key);
+	g_queue_unlink(&shard->lru, &data->lru_link);
+	shard->bytes -= data->size;
+}
 
-init:
-	data->m_time = info.st_mtime;
-	data->c_time = info.st_ctime;
-	data->length = info.st_size;
-	data->mode = info.st_mode;
+/* Take the shard's least recently used entries out until it is within its
+ * part of the budget, passing over 'keep', pinned entries and any object
+ * someone else holds a ref to. Call with the shard's mutex held; free_entries() the
+ * result after releasing it (unref'ing objects may lead back to the cache).
+ */
+static GList *evict(GFSCache *cache, GFSCacheShard *shard, GFSCacheData *keep)
+{
+	GList *victims = NULL;
+	gsize budget = (cache->budget + FSCACHE_SHARDS - 1) / FSCACHE_SHARDS;
+	guint tries = shard->lru.length;
 
-	if (data->data == NULL &&
-		lookup_type != FSCACHE_LOOKUP_INIT &&
-		lookup_type != FSCACHE_LOOKUP_INSERT)
+	while (budget && shard->bytes > budget && tries--)
 	{
-		/* Create the object for the file (ie, not an update) */
-		if (cache->load)
-			data->data = cache->load(pathname, cache->user_data);
+		GFSCacheData *data = shard->lru.tail->data;
+
+		if (data == keep || data->pins ||
+		    (data->data && data->data->ref_count > 1))
+		{
+			/* Busy; look again when it reaches the end */
+			g_queue_unlink(&shard->lru, &data->lru_link);
+			g_queue_push_head_link(&shard->lru, &data->lru_link);
+			continue;
+		}
+
+		forget(shard, data);
+		shard->evictions++;
+		victims = g_list_prepend(victims, data);
 	}
-out:
-	data->last_lookup = time(NULL);
 
-	return data;
+	return victims;
 }
 
+static void free_entries(GList *entries)
+{
+	GList *next;
+
+	for (next = entries; next; next = next->next)
+	{
+		GFSCacheData *data = next->data;
+
+		if (data->data)
+			g_object_unref(data->data);
+		g_free(data->key);
+		g_free(data);
+	}
+
+	g_list_free(entries);
+}
@@ -18,6 +18,7 @@ typedef GObject *(*GFSLoadFunc)(const char *pathname, gpointer user_data);
 typedef void (*GFSUpdateFunc)(gpointer object,
 			      const char *pathname,
 			      gpointer user_data);
+typedef gsize (*GFSSizeFunc)(gpointer object, gpointer user_data);
 typedef enum {
 	FSCACHE_LOOKUP_CREATE,	/* Load if missing. Update as needed. */
 	FSCACHE_LOOKUP_ONLY_NEW,/* Return NULL if not present AND uptodate */
@@ -26,16 +27,32 @@ typedef enum {
 	FSCACHE_LOOKUP_INSERT,	/* Internal use */
 } FSCacheLookup;
 
-struct _GFSCache
+#define FSCACHE_SHARD_BITS 4
+#define FSCACHE_SHARDS (1 << FSCACHE_SHARD_BITS)
+
+typedef struct _GFSCacheShard GFSCacheShard;
+
+struct _GFSCacheShard
 {
 	GHashTable    *inode_to_stats;
 	GMutex        mutex;
+	GQueue        lru;	/* Entries, most recently used first */
+	gsize         bytes;	/* Total size of the entries */
+	guint         hits, misses, evictions;
+};
+
+struct _GFSCache
+{
+	GFSCacheShard shards[FSCACHE_SHARDS];
 	GFSLoadFunc   load;
 	GFSUpdateFunc update;
+	GFSSizeFunc   size;
 	gpointer      user_data;
+	gsize         budget;	/* Evict down to this. 0 for no limit */
 };
 typedef struct _GFSCacheKey GFSCacheKey;
 typedef struct _GFSCacheData GFSCacheData;
+typedef struct _GFSCacheStats GFSCacheStats;
 
 struct _GFSCacheKey
 {
@@ -49,19 +66,43 @@ struct _GFSCacheData
 	time_t  last_lookup;
 
 	/* Details of the file last time we checked it */
-	time_t  m_time, c_time;
+	gint64  m_time, c_time;	/* In nanoseconds */
 	off_t   length;
 	mode_t  mode;
+
+	GFSCacheKey *key;	/* Our key in inode_to_stats */
+	GList   lru_link;	/* In the cache's lru */
+	gsize   size;		/* As counted in the cache's bytes */
+	guint   pins;		/* Lookups using this entry right now */
+	gboolean gone;		/* Removed while pinned; last unpin frees */
+};
+
+struct _GFSCacheStats
+{
+	guint	hits, misses, evictions;
+	guint	entries;
+	gsize	bytes, budget;
 };
 
 GFSCache *g_fscache_new(GFSLoadFunc load,
 			GFSUpdateFunc update,
+			GFSSizeFunc size,
+			gsize budget,
 			gpointer user_data);
 void g_fscache_destroy(GFSCache *cache);
+void g_fscache_set_budget(GFSCache *cache, gsize budget);
+void g_fscache_get_stats(GFSCache *cache, GFSCacheStats *stats);
+void g_fscache_foreach(GFSCache *cache, GFunc func, gpointer user_data);
 gpointer g_fscache_lookup(GFSCache *cache, const char *pathname);
 gpointer g_fscache_lookup_full(GFSCache *cache, const char *pathname,
 				FSCacheLookup lookup_type,
 				gboolean *found);
+gpointer g_fscache_lookup_at(GFSCache *cache, int dir_fd,
+			     const char *dirpath, const char *leafname);
+gpointer g_fscache_lookup_full_at(GFSCache *cache, int dir_fd,
+				  const char *dirpath, const char *name,
+				  FSCacheLookup lookup_type,
+				  gboolean *found);
 void g_fscache_may_update(GFSCache *cache, const char *pathname);
 void g_fscache_update(GFSCache *cache, const char *pathname);
 void g_fscache_remove(GFSCache *cache, const char *pathname);
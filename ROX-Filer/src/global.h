@@ -33,6 +33,9 @@ typedef struct _Directory Directory;
  */
 typedef struct _DirItem DirItem;
 
+/* A Directory allocates its DirItems, and their names, from one of these */
+typedef struct _DirItemArena DirItemArena;
+
 /* Widgets which can display directories implement the View interface.
  * This should be used in preference to the old collection interface because
  * it isn't specific to a particular type of display.
@@ -1447,6 +1447,21 @@ rox_pixbuf_new_from_file_at_scale (const char *filename,
 				   gboolean    preserve_aspect_ratio,
 				   GError    **error)
 {
+	return rox_pixbuf_new_from_file_at_scale_cancellable (filename,
+			width, height, preserve_aspect_ratio, NULL, error);
+}
+
+/* As above, but gives up (with G_IO_ERROR_CANCELLED) between blocks of the
+ * file once @cancellable is cancelled. This may be done from another thread.
+ */
+GdkPixbuf *
+rox_pixbuf_new_from_file_at_scale_cancellable (const char *filename,
+				   int         width,
+				   int         height,
+				   gboolean    preserve_aspect_ratio,
+				   GCancellable *cancellable,
+				   GError    **error)
+{
 
 	GdkPixbufLoader *loader;
 	GdkPixbuf       *pixbuf;
@@ -1486,6 +1501,12 @@ rox_pixbuf_new_from_file_at_scale (const char *filename,
 	g_signal_connect (loader, "size-prepared", G_CALLBACK (size_prepared_cb), &info);
 
 	while (!feof (f) && !ferror (f)) {
+		if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+			gdk_pixbuf_loader_close (loader, NULL);
+			fclose (f);
+			g_object_unref (loader);
+			return NULL;
+		}
 		length = fread (buffer, 1, sizeof (buffer), f);
 		if (length > 0)
 			if (!gdk_pixbuf_loader_write (loader, buffer, length, error)) {
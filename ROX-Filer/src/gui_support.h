@@ -94,6 +94,12 @@ GdkPixbuf * rox_pixbuf_new_from_file_at_scale (const char *filename,
 					       int       height,
 					       gboolean  preserve_aspect_ratio,
 					       GError    **error);
+GdkPixbuf *rox_pixbuf_new_from_file_at_scale_cancellable (const char *filename,
+					       int       width,
+					       int       height,
+					       gboolean  preserve_aspect_ratio,
+					       GCancellable *cancellable,
+					       GError    **error);
 void make_heading(GtkWidget *label, double scale_factor);
 void launch_uri(GObject *button, const char *uri);
 void allow_right_click(GtkWidget *button);
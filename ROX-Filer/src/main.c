@@ -60,6 +60,7 @@
 #include "choices.h"
 #include "type.h"
 #include "pixmaps.h"
+#include "atlas.h"
 #include "dir.h"
 #include "diritem.h"
 #include "action.h"
@@ -75,6 +76,9 @@
 #include "xtypes.h"
 #include "bulk_rename.h"
 #include "gtksavebox.h"
+#include "view_iface.h"
+#include "collection.h"
+#include "view_collection.h"
 
 int number_of_windows = 0;	/* Quit when this reaches 0 again... */
 int to_wakeup_pipe = -1;	/* Write here to get noticed */
@@ -343,6 +347,18 @@ int main(int argc, char **argv)
 
 #ifdef UNIT_TESTS
 	bulk_rename_tests();
+	type_tests();
+	dir_tests();
+	diritem_tests();
+	display_sort_tests();
+
+	/* Timings are slow and only printed, so they're opt-in */
+	if (g_strcmp0(g_getenv("ROX_BENCH"), "1") == 0)
+	{
+		dir_scan_benchmark();
+		diritem_memory_report();
+		display_sort_benchmark();
+	}
 #endif
 
 	/* The idea here is to convert the command-line arguments
@@ -372,6 +388,12 @@ int main(int argc, char **argv)
 		"class \"Collection\" style : gtk "
 		"\"rox-default-collection-style\"\n");
 
+#ifdef UNIT_TESTS
+	view_collection_sort_tests();	/* Needs a Collection widget */
+	if (g_strcmp0(g_getenv("ROX_BENCH"), "1") == 0)
+		view_collection_sort_benchmark();
+#endif
+
 	g_signal_connect(gdk_screen_get_default(), "size-changed",
 			 G_CALLBACK(xrandr_size_change), NULL);
 
@@ -589,6 +611,7 @@ int main(int argc, char **argv)
 	/* Initialize the rest of the filer... */
 
 	pixmaps_init();
+	atlas_init();
 
 	log_init();
 	dnd_init();
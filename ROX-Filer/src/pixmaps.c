@@ -30,6 +30,9 @@
 #define PIXMAP_THUMB_SIZE  256
 #define PIXMAP_THUMB_TOO_OLD_TIME  5
 
+/* Give up on making a thumbnail after this many seconds */
+#define THUMB_TIMEOUT 14
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -37,6 +40,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#if defined(HAVE_LIBJPEG) && defined(HAVE_JPEGLIB_H)
+# define USE_LIBJPEG
+# include <setjmp.h>
+# include <jpeglib.h>
+#endif
 
 #include <gtk/gtk.h>
 
@@ -54,6 +64,7 @@
 #include "options.h"
 #include "action.h"
 #include "type.h"
+#include "thumbindex.h"
 
 GFSCache *pixmap_cache = NULL;
 GFSCache *thumb_cache = NULL;
@@ -94,23 +105,43 @@ gchar *thumb_dir = "normal";
 Option o_pixmap_thumb_file_size;
 Option o_jpeg_thumbs;
 static Option o_purge_time;
+static Option o_image_cache_size;
 Option o_purge_days;
 
 
 typedef struct _ChildThumbnail ChildThumbnail;
 
-/* There is one of these for each active child process */
+/* There is one of these for each thumbnail being made. Images are done by
+ * thumb_pool's threads; other types by a helper program, in a child process.
+ */
 struct _ChildThumbnail {
 	gchar	 *path;
 	GFunc	 callback;
 	gpointer data;
-	pid_t	 child;
-	guint	 timeout;
+	pid_t	 child;		/* Helper's process, or 0 */
+	guint	 timeout;	/* Kills the helper */
 	guint	 order;
+	gint	 priority;	/* Higher goes first */
+	MIME_type *type;
+	gchar	 *thumb_prog;	/* Helper to run, or NULL */
+	GCancellable *cancel;
+	gboolean timed_out;
 };
 static guint ordered_num = 0;
 static guint next_order = 0;
 
+static GThreadPool *thumb_pool = NULL;
+
+/* Helpers waiting for a slot, and how many are running */
+static GQueue helper_queue = G_QUEUE_INIT;
+static guint helpers_running = 0;
+
+/* Everything not yet finished, for pixmap_cancel_thumbs() */
+static GList *active_thumbs = NULL;
+
+/* Makes the temporary names of thumbnails being saved unique */
+static gint save_serial = 0;
+
 static const char *stocks[] = {
 	ROX_STOCK_SHOW_DETAILS,
 	ROX_STOCK_SHOW_HIDDEN,
@@ -126,15 +157,36 @@ static void load_default_pixmaps(void);
 static gint purge_pixmaps(gpointer data);
 static gint purge_thumbs(gpointer data);
 static MaskedPixmap *image_from_file(const char *path);
+static gsize image_cache_budget(void);
+static gsize image_size(GObject *image, gpointer unused);
+static GType masked_pixmap_get_type(void);
 static MaskedPixmap *get_bad_image(void);
 static GdkPixbuf *get_thumbnail_for(const char *path, gboolean forcheck);
 static void ordered_update(ChildThumbnail *info);
 static void thumbnail_done(ChildThumbnail *info);
-static void create_thumbnail(const gchar *path, MIME_type *type);
+static void create_thumbnail(const gchar *path, MIME_type *type,
+			     GCancellable *cancel);
+static void thumb_worker(gpointer data, gpointer unused);
+static gint compare_thumbs(gconstpointer a, gconstpointer b, gpointer unused);
+static void start_helpers(void);
 static GList *thumbs_purge_cache(Option *option, xmlNode *node, guchar *label);
 static gchar *thumbnail_path(const gchar *path);
+static gchar *thumbnail_uri(const char *path);
+static gchar *thumbnail_md5(const char *path);
+static gchar *thumbnail_file(const char *md5);
+static void index_thumbnail(const char *md5, const struct stat *src,
+			    const char *thumb_path, int width, int height);
+static gboolean thumbnail_indexed(const char *pathname);
+static gboolean thumb_known(const gchar *path);
+static gint thumb_target(const gchar *path);
 static gchar *thumbnail_program(MIME_type *type);
-static GdkPixbuf *extract_tiff_thumbnail(const gchar *path);
+static GdkPixbuf *extract_exif_thumbnail(const gchar *path, int size,
+					 int *width, int *height);
+#ifdef USE_LIBJPEG
+static GdkPixbuf *load_jpeg_scaled(const gchar *path, int size,
+				   GCancellable *cancel,
+				   int *width, int *height);
+#endif
 static void make_dir_thumb(const gchar *path);
 
 /****************************************************************
@@ -172,6 +224,12 @@ static void options_changed()
 
 	if (o_purge_time.has_changed)
 		g_fscache_purge(thumb_cache, o_purge_time.int_value);
+
+	if (o_image_cache_size.has_changed)
+	{
+		g_fscache_set_budget(pixmap_cache, image_cache_budget());
+		g_fscache_set_budget(thumb_cache, image_cache_budget());
+	}
 }
 
 void pixmaps_init(void)
@@ -184,12 +242,19 @@ void pixmaps_init(void)
 	option_add_int(&o_purge_time, "purge_time", 0);
 	option_add_int(&o_jpeg_thumbs, "jpeg_thumbs", TRUE);
 	option_add_int(&o_purge_days, "purge_days", 90);
+	option_add_int(&o_image_cache_size, "image_cache_size", 64);
 	option_add_notify(options_changed);
 
 	gtk_widget_push_colormap(gdk_rgb_get_colormap());
 
-	pixmap_cache = g_fscache_new((GFSLoadFunc) image_from_file, NULL, NULL);
-	thumb_cache = g_fscache_new((GFSLoadFunc) image_from_file, NULL, NULL);
+	pixmap_cache = g_fscache_new((GFSLoadFunc) image_from_file, NULL,
+			(GFSSizeFunc) image_size, image_cache_budget(), NULL);
+	thumb_cache = g_fscache_new((GFSLoadFunc) image_from_file, NULL,
+			(GFSSizeFunc) image_size, image_cache_budget(), NULL);
+
+	thumb_pool = g_thread_pool_new(thumb_worker, NULL,
+			g_get_num_processors(), FALSE, NULL);
+	g_thread_pool_set_sort_function(thumb_pool, compare_thumbs, NULL);
 
 	g_timeout_add(6000, purge_thumbs, NULL);
 	g_timeout_add(PIXMAP_PURGE_TIME / 2 * 1000, purge_pixmaps, NULL);
@@ -293,7 +358,7 @@ void pixmap_make_small(MaskedPixmap *mp)
 	mp->sm_height = gdk_pixbuf_get_height(mp->sm_pixbuf);
 }
 
-/* -1:not thumb target 0:not created 1:created and loaded */
+/* -1:not thumb target 0:not created 1:created */
 gint pixmap_check_thumb(const gchar *path)
 {
 	gboolean found;
@@ -304,27 +369,30 @@ gint pixmap_check_thumb(const gchar *path)
 	else
 		if (found) return -2;
 
-	GdkPixbuf *image = pixmap_try_thumb(path, TRUE);
+	if (thumb_known(path))
+		return 1;
+
+	return thumb_target(path);
+}
+
+/* As pixmap_check_thumb(), for other threads. The caches are left alone,
+ * so -2 isn't returned.
+ */
+gint pixmap_check_thumb_t(const gchar *path)
+{
+	GdkPixbuf *image;
 
+	if (thumbnail_indexed(path))
+		return 1;
+
+	image = get_thumbnail_for(path, TRUE);
 	if (image)
 	{
 		g_object_unref(image);
 		return 1;
 	}
 
-	MIME_type *type = type_from_path(path);
-	if (type)
-	{
-		gchar *thumb_prog = NULL;
-		if (strcmp(type->media_type, "image") == 0 ||
-				(thumb_prog = thumbnail_program(type)))
-		{
-			g_free(thumb_prog);
-			return 0;
-		}
-	}
-
-	return -1;
+	return thumb_target(path);
 }
 
 
@@ -358,9 +426,10 @@ GdkPixbuf *pixmap_load_thumb(const gchar *path)
 }
 
 
-static int thumb_prog_timeout(ChildThumbnail *info)
+static gboolean thumb_prog_timeout(ChildThumbnail *info)
 {
 	info->timeout = 0;
+	info->timed_out = TRUE;
 	kill(info->child, 9);
 	return FALSE;
 }
@@ -375,17 +444,13 @@ void pixmap_background_thumb(const gchar *path, gboolean noorder,
 {
 	gboolean	found;
 	GdkPixbuf	*image;
-	pid_t		child;
 	ChildThumbnail	*info;
 	MIME_type       *type;
-	gchar		*thumb_prog, *base;
+	gchar		*thumb_prog;
 
-	image = pixmap_try_thumb(path, TRUE);
-
-	if (image)
+	if (thumb_known(path))
 	{
-		g_object_unref(image);
-		/* Thumbnail loaded */
+		/* Thumbnail exists */
 		callback(data, (gpointer)path);
 		return;
 	}
@@ -430,56 +495,63 @@ void pixmap_background_thumb(const gchar *path, gboolean noorder,
 		return;		/* Don't know how to handle this type */
 	}
 
-	info = g_new(ChildThumbnail, 1);
+	info = g_new0(ChildThumbnail, 1);
 	info->path = g_strdup(path);
 	info->callback = callback;
 	info->data = data;
-	info->timeout = 0;
 	info->order = ordered_num++;
 	if (noorder) info->order = 0;
+	/* A directory's own thumbnail is wanted before its contents' */
+	info->priority = noorder ? 1 : 0;
+	info->type = type;
+	info->thumb_prog = thumb_prog;
+	info->cancel = g_cancellable_new();
 
-	child = fork();
-	if (child == -1)
+	active_thumbs = g_list_prepend(active_thumbs, info);
+
+	if (thumb_prog)
 	{
-		g_free(thumb_prog);
-		delayed_error("fork(): %s", g_strerror(errno));
-		callback(data, NULL);
-		return;
+		g_queue_insert_sorted(&helper_queue, info,
+				compare_thumbs, NULL);
+		start_helpers();
 	}
+	else
+		g_thread_pool_push(thumb_pool, info, NULL);
+}
 
-	if (child == 0)
+/* Stop making the thumbnails requested with this callback data.
+ * Their callbacks are still called, with a NULL path.
+ */
+void pixmap_cancel_thumbs(gpointer data)
+{
+	GList *next;
+
+	for (next = active_thumbs; next; next = next->next)
 	{
-		/* We are the child process.  (We are sloppy with freeing
-		   memory, but since we go away very quickly, that's ok.) */
-		if (thumb_prog)
-		{
-			DirItem *item;
-
-			base = g_path_get_basename(thumb_prog);
-			item = diritem_new(base);
-			g_free(base);
-			diritem_restat(thumb_prog, item, NULL, TRUE);
-			if (item->flags & ITEM_FLAG_APPDIR)
-				thumb_prog = g_strconcat(thumb_prog, "/AppRun",
-						NULL);
-
-			execl(thumb_prog, thumb_prog, path,
-					thumbnail_path(path),
-					g_strdup_printf("%d", thumb_size),
-					NULL);
-
-			_exit(1);
-		}
+		ChildThumbnail *info = next->data;
 
-		create_thumbnail(path, type);
-		_exit(0);
+		if (info->data != data)
+			continue;
+
+		g_cancellable_cancel(info->cancel);
+		if (info->child > 0)
+			kill(info->child, 9);
 	}
 
-	g_free(thumb_prog);
-	info->child = child;
-	info->timeout = g_timeout_add_seconds(14,
-			(GSourceFunc) thumb_prog_timeout, info);
-	on_child_death(child, (CallbackFn) thumbnail_done, info);
+	/* Helpers not started yet can finish now */
+	next = helper_queue.head;
+	while (next)
+	{
+		ChildThumbnail *info = next->data;
+		GList *this = next;
+
+		next = next->next;
+		if (g_cancellable_is_cancelled(info->cancel))
+		{
+			g_queue_delete_link(&helper_queue, this);
+			thumbnail_done(info);
+		}
+	}
 }
 
 /*
@@ -558,25 +630,68 @@ GdkPixbuf *pixmap_try_thumb(const gchar *path, gboolean forcheck)
  *			INTERNAL FUNCTIONS			*
  ****************************************************************/
 
-/* Create a thumbnail file for this image */
-static void save_thumbnail(const char *pathname, GdkPixbuf *full)
+/* Write a new file readable only by us. FALSE (and no file) on error. */
+static gboolean write_private_file(const gchar *path,
+				   const gchar *data, gsize len)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		return FALSE;
+
+	while (len > 0)
+	{
+		ssize_t n = write(fd, data, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			close(fd);
+			unlink(path);
+			return FALSE;
+		}
+		data += n;
+		len -= n;
+	}
+
+	if (close(fd))
+	{
+		unlink(path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Create a thumbnail file for this image. 'full' may have been loaded at a
+ * reduced size; if so, pass the real size in original_width/height
+ * (otherwise, 0).
+ */
+static void save_thumbnail(const char *pathname, GdkPixbuf *full,
+			   int original_width, int original_height)
 {
 	struct stat info;
 	gchar *path;
-	int original_width, original_height;
 	GString *to;
-	char *md5, *swidth, *sheight, *ssize, *smtime, *uri;
-	mode_t old_mask;
+	char *md5, *swidth, *sheight, *ssize, *smtime, *uri = NULL;
 	int name_len;
 	GdkPixbuf *thumb;
+	gchar *buffer = NULL;
+	gsize buffer_size;
+	gboolean saved;
 
 	if (mc_stat(pathname, &info) != 0)
 		return;
 
 	thumb = scale_pixbuf(full, thumb_size, thumb_size);
 
-	original_width = gdk_pixbuf_get_width(full);
-	original_height = gdk_pixbuf_get_height(full);
+	if (original_width <= 0 || original_height <= 0)
+	{
+		original_width = gdk_pixbuf_get_width(full);
+		original_height = gdk_pixbuf_get_height(full);
+	}
 
 	swidth = g_strdup_printf("%d", original_width);
 	sheight = g_strdup_printf("%d", original_height);
@@ -584,11 +699,7 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 	smtime = g_strdup_printf("%ld", (long) info.st_mtime);
 
 	path = pathdup(pathname);
-	uri = g_filename_to_uri(path, NULL, NULL);
-	if (!uri)
-	        uri = g_strconcat("file://", path, NULL);
-	md5 = md5_hash(uri);
-	g_free(path);
+	md5 = thumbnail_md5(path);
 
 	to = g_string_new(home_dir);
 	g_string_append(to, "/.cache");
@@ -602,22 +713,24 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 	mkdir(to->str, 0700);
 	g_string_append(to, md5);
 	name_len = to->len + 4; /* Truncate to this length when renaming */
-	g_string_append_printf(to, ".%s.ROX-Filer-%ld",
-			o_jpeg_thumbs.int_value ? "jpg" : "png", (long) getpid());
+	/* (Cancelled threads may still be saving, so the PID isn't enough) */
+	g_string_append_printf(to, ".%s.ROX-Filer-%ld-%d",
+			o_jpeg_thumbs.int_value ? "jpg" : "png", (long) getpid(),
+			g_atomic_int_add(&save_serial, 1));
 
-	g_free(md5);
-
-	old_mask = umask(0077);
 	if (o_jpeg_thumbs.int_value == 1)
 	{
 		//At least we don't need extensions being '.jpg'
-		gdk_pixbuf_save(thumb, to->str, "jpeg", NULL,
+		saved = gdk_pixbuf_save_to_buffer(thumb,
+				&buffer, &buffer_size, "jpeg", NULL,
 				"quality", "77",
 				NULL);
 	}
 	else
 	{
-		gdk_pixbuf_save(thumb, to->str, "png", NULL,
+		uri = thumbnail_uri(path);
+		saved = gdk_pixbuf_save_to_buffer(thumb,
+				&buffer, &buffer_size, "png", NULL,
 				"tEXt::Thumb::Image::Width", swidth,
 				"tEXt::Thumb::Image::Height", sheight,
 				"tEXt::Thumb::Size", ssize,
@@ -626,12 +739,13 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 				"tEXt::Software", PROJECT,
 				NULL);
 	}
-	umask(old_mask);
 
 	/* We create the file ###.png.ROX-Filer-PID and rename it to avoid
 	 * a race condition if two programs create the same thumb at
-	 * once.
+	 * once. The mode is given here rather than with umask(), which
+	 * would affect the other threads too.
 	 */
+	if (saved && write_private_file(to->str, buffer, buffer_size))
 	{
 		gchar *final;
 
@@ -639,9 +753,14 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 		if (rename(to->str, final))
 			g_warning("Failed to rename '%s' to '%s': %s",
 				  to->str, final, g_strerror(errno));
+		else
+			index_thumbnail(md5, &info, final,
+					original_width, original_height);
 		g_free(final);
 	}
 
+	g_free(md5);
+	g_free(buffer);
 	g_object_unref(thumb);
 	g_string_free(to, TRUE);
 	g_free(swidth);
@@ -649,18 +768,16 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 	g_free(ssize);
 	g_free(smtime);
 	g_free(uri);
+	g_free(path);
 }
 
 static gchar *thumbnail_path(const char *path)
 {
-	gchar *uri, *md5;
+	gchar *md5;
 	GString *to;
 	gchar *ans;
 
-	uri = g_filename_to_uri(path, NULL, NULL);
-	if(!uri)
-	       uri = g_strconcat("file://", path, NULL);
-	md5 = md5_hash(uri);
+	md5 = thumbnail_md5(path);
 
 	to = g_string_new(home_dir);
 	g_string_append(to, "/.cache");
@@ -676,7 +793,6 @@ static gchar *thumbnail_path(const char *path)
 	g_string_append(to, o_jpeg_thumbs.int_value ? ".jpg" : ".png");
 
 	g_free(md5);
-	g_free(uri);
 
 	ans=to->str;
 	g_string_free(to, FALSE);
@@ -710,55 +826,347 @@ static gchar *thumbnail_program(MIME_type *type)
 	return path;
 }
 
-/* Load path and create the thumbnail
- * file. Parent will notice when we die.
+/* Load path and create the thumbnail file. Called in thumb_pool; gives up
+ * part way if 'cancel' is cancelled.
  */
-static void create_thumbnail(const gchar *path, MIME_type *type)
+static void create_thumbnail(const gchar *path, MIME_type *type,
+			     GCancellable *cancel)
 {
-	GdkPixbuf *image=NULL;
+	GdkPixbuf *image = NULL;
+	int width = 0, height = 0;
 
-        if(strcmp(type->subtype, "jpeg")==0)
-            image=extract_tiff_thumbnail(path);
+	if (strcmp(type->subtype, "jpeg") == 0)
+	{
+		/* A camera's own preview is often big enough, and is tiny to
+		 * decode. Failing that, have the IDCT do most of the scaling.
+		 */
+		image = extract_exif_thumbnail(path, thumb_size,
+					       &width, &height);
+#ifdef USE_LIBJPEG
+		if (!image)
+			image = load_jpeg_scaled(path, thumb_size, cancel,
+						 &width, &height);
+#endif
+	}
 
-	if(!image)
-            image = rox_pixbuf_new_from_file_at_scale(path,
-			thumb_size, thumb_size, TRUE, NULL);
+	if (!image && !g_cancellable_is_cancelled(cancel))
+		image = rox_pixbuf_new_from_file_at_scale_cancellable(path,
+				thumb_size, thumb_size, TRUE, cancel, NULL);
 
 	if (image)
 	{
-		save_thumbnail(path, image);
+		if (!g_cancellable_is_cancelled(cancel))
+			save_thumbnail(path, image, width, height);
 		g_object_unref(image);
 	}
 }
 
+static gboolean thumb_timeout(gpointer data)
+{
+	ChildThumbnail *info = (ChildThumbnail *) data;
+
+	info->timed_out = TRUE;
+	g_cancellable_cancel(info->cancel);
+	return FALSE;
+}
+
+static gboolean thumb_worker_done(gpointer data)
+{
+	thumbnail_done((ChildThumbnail *) data);
+	return FALSE;
+}
+
+/* In thumb_pool. The decoder can't be killed like a helper, so a timer in
+ * the main loop cancels it instead.
+ */
+static void thumb_worker(gpointer data, gpointer unused)
+{
+	ChildThumbnail *info = (ChildThumbnail *) data;
+
+	if (!g_cancellable_is_cancelled(info->cancel))
+	{
+		GSource *timer = g_timeout_source_new_seconds(THUMB_TIMEOUT);
+
+		g_source_set_callback(timer, thumb_timeout, info, NULL);
+		g_source_attach(timer, NULL);
+
+		create_thumbnail(info->path, info->type, info->cancel);
+
+		g_source_destroy(timer);
+		g_source_unref(timer);
+	}
+
+	g_idle_add(thumb_worker_done, info);
+}
+
+/* Waiting thumbnails go by priority, then in the order they were asked for */
+static gint compare_thumbs(gconstpointer a, gconstpointer b, gpointer unused)
+{
+	const ChildThumbnail *ta = a, *tb = b;
+
+	if (ta->priority != tb->priority)
+		return tb->priority - ta->priority;
+
+	return ta->order < tb->order ? -1 : ta->order > tb->order;
+}
+
+/* Run the helper program for this file. FALSE if it couldn't be started. */
+static gboolean run_helper(ChildThumbnail *info)
+{
+	gchar *prog = info->thumb_prog;
+	gchar *thumb_path, *size;
+	DirItem *item;
+	gchar *base;
+	pid_t child;
+
+	/* Work out the command before forking, so the child only has to
+	 * exec it.
+	 */
+	base = g_path_get_basename(prog);
+	item = diritem_new(base);
+	g_free(base);
+	diritem_restat(prog, item, NULL, TRUE);
+	if (item->flags & ITEM_FLAG_APPDIR)
+		prog = g_strconcat(prog, "/AppRun", NULL);
+	else
+		prog = g_strdup(prog);
+	diritem_free(item);
+
+	thumb_path = thumbnail_path(info->path);
+	size = g_strdup_printf("%d", thumb_size);
+
+	child = fork();
+	if (child == 0)
+	{
+		execl(prog, prog, info->path, thumb_path, size, NULL);
+		_exit(1);
+	}
+
+	g_free(prog);
+	g_free(thumb_path);
+	g_free(size);
+
+	if (child == -1)
+	{
+		delayed_error("fork(): %s", g_strerror(errno));
+		return FALSE;
+	}
+
+	info->child = child;
+	info->timeout = g_timeout_add_seconds(THUMB_TIMEOUT,
+			(GSourceFunc) thumb_prog_timeout, info);
+	on_child_death(child, (CallbackFn) thumbnail_done, info);
+
+	return TRUE;
+}
+
+/* Start queued helpers, keeping to one per processor */
+static void start_helpers(void)
+{
+	while (helpers_running < g_get_num_processors() &&
+			!g_queue_is_empty(&helper_queue))
+	{
+		ChildThumbnail *info = g_queue_pop_head(&helper_queue);
+
+		if (run_helper(info))
+			helpers_running++;
+		else
+			thumbnail_done(info);
+	}
+}
+
 char *pixmap_make_thumb_path(const char *path)
 {
-	char *thumb_path, *md5, *uri;
+	char *thumb_path, *md5;
+
+	md5 = thumbnail_md5(path);
+	thumb_path = thumbnail_file(md5);
+	g_free(md5);
+
+	return thumb_path; /* This return is used unlink! Be carefull */
+}
+
+/* Work out the thumbnail names of these items in 'dirpath' together, for
+ * its Directory to remember. Quicker than letting each check hash its own.
+ */
+void pixmap_hash_thumbs(const char *dirpath, GPtrArray *leafnames)
+{
+	GPtrArray *todo;
+	gchar **uris, **md5s;
+	guint i;
+
+	todo = dir_unhashed_thumbs(dirpath, leafnames);
+	if (!todo)
+		return;
+
+	uris = g_new(gchar *, todo->len);
+	md5s = g_new(gchar *, todo->len);
+	for (i = 0; i < todo->len; i++)
+		uris[i] = thumbnail_uri(make_path(dirpath, todo->pdata[i]));
+
+	md5_hash_many((const char *const *) uris, md5s, todo->len);
+	dir_add_thumb_hashes(dirpath, todo, md5s);
+
+	for (i = 0; i < todo->len; i++)
+		g_free(uris[i]);
+	g_free(uris);
+	g_free(md5s);
+	g_ptr_array_free(todo, TRUE);
+}
+
+static gchar *thumbnail_uri(const char *path)
+{
+	gchar *uri;
 
 	uri = g_filename_to_uri(path, NULL, NULL);
 	if (!uri)
 	        uri = g_strconcat("file://", path, NULL);
+	return uri;
+}
+
+/* The MD5 of path's URI, which names its thumbnail. g_free() the result.
+ * The Directory of path remembers it, as the same files get checked again
+ * and again.
+ */
+static gchar *thumbnail_md5(const char *path)
+{
+	gchar *uri, *md5;
+
+	md5 = dir_thumb_hash(path);
+	if (md5)
+		return md5;
+
+	uri = thumbnail_uri(path);
 	md5 = md5_hash(uri);
 	g_free(uri);
 
-	thumb_path = g_strdup_printf(
-			"%s/.cache/thumbnails/%s/%s.%s",
-			home_dir, thumb_dir, md5, o_jpeg_thumbs.int_value ? "jpg" : "png");
+	dir_add_thumb_hash(path, md5);
+
+	return md5;
+}
+
+static gchar *thumbnail_file(const char *md5)
+{
+	return g_strdup_printf("%s/.cache/thumbnails/%s/%s.%s",
+			home_dir, thumb_dir, md5,
+			o_jpeg_thumbs.int_value ? "jpg" : "png");
+}
+
+/* Note in the index that thumb_path, the thumbnail called md5, is
+ * up-to-date for an image with stat details 'src'. Dimensions are of the
+ * image, if known. May be called from any thread.
+ */
+static void index_thumbnail(const char *md5, const struct stat *src,
+			    const char *thumb_path, int width, int height)
+{
+	ThumbIndexEntry entry;
+	struct stat thumbinfo;
+
+	/* (Directory thumbnails are symlinks to their first child's) */
+	if (mc_lstat(thumb_path, &thumbinfo) != 0 ||
+	    !S_ISREG(thumbinfo.st_mode))
+		return;
+
+	/* JPEG thumbnails have no MTime; get_thumbnail_for() goes by ctimes,
+	 * and isn't sure of one made in the same second as the change.
+	 */
+	if (o_jpeg_thumbs.int_value && thumbinfo.st_ctime <= src->st_ctime)
+		return;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.src_mtime = src->st_mtime;
+	entry.src_ctime = src->st_ctime;
+	entry.src_size = src->st_size;
+	entry.thumb_mtime = thumbinfo.st_mtime;
+	entry.thumb_size = thumbinfo.st_size;
+	entry.thumb_ino = thumbinfo.st_ino;
+	entry.width = MAX(width, 0);
+	entry.height = MAX(height, 0);
+	entry.flags = o_jpeg_thumbs.int_value ? THUMB_INDEX_JPEG : 0;
+
+	thumbindex_store(thumb_dir, md5, &entry);
+}
+
+/* TRUE if the index says that the thumbnail for pathname is up-to-date.
+ * This costs two stats, rather than loading the thumbnail. FALSE just
+ * means we don't know; see get_thumbnail_for().
+ */
+static gboolean thumbnail_indexed(const char *pathname)
+{
+	ThumbIndexEntry entry;
+	struct stat info, thumbinfo;
+	gchar *path, *md5, *thumb_path;
+	gboolean ok = FALSE;
+
+	path = pathdup(pathname);
+	md5 = thumbnail_md5(path);
+
+	if (thumbindex_lookup(thumb_dir, md5, &entry) &&
+	    (entry.flags & THUMB_INDEX_JPEG) ==
+			(o_jpeg_thumbs.int_value ? THUMB_INDEX_JPEG : 0) &&
+	    mc_stat(path, &info) == 0 &&
+	    entry.src_mtime == (gint64) info.st_mtime &&
+	    entry.src_ctime == (gint64) info.st_ctime &&
+	    entry.src_size == (gint64) info.st_size)
+	{
+		thumb_path = thumbnail_file(md5);
+		ok = mc_lstat(thumb_path, &thumbinfo) == 0 &&
+		     S_ISREG(thumbinfo.st_mode) &&
+		     entry.thumb_mtime == (gint64) thumbinfo.st_mtime &&
+		     entry.thumb_size == (gint64) thumbinfo.st_size &&
+		     entry.thumb_ino == (gint64) thumbinfo.st_ino;
+		g_free(thumb_path);
+	}
+
 	g_free(md5);
+	g_free(path);
+	return ok;
+}
 
-	return thumb_path; /* This return is used unlink! Be carefull */
+/* 0 if we can make a thumbnail for path, -1 if not */
+static gint thumb_target(const gchar *path)
+{
+	MIME_type *type = type_from_path(path);
+	if (type)
+	{
+		gchar *thumb_prog = NULL;
+		if (strcmp(type->media_type, "image") == 0 ||
+				(thumb_prog = thumbnail_program(type)))
+		{
+			g_free(thumb_prog);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Is there an up-to-date thumbnail for path? Unlike pixmap_try_thumb(),
+ * this doesn't decode it if the index already knows.
+ */
+static gboolean thumb_known(const gchar *path)
+{
+	GdkPixbuf *image;
+
+	if (thumbnail_indexed(path))
+		return TRUE;
+
+	image = pixmap_try_thumb(path, TRUE);
+	if (!image)
+		return FALSE;
+
+	g_object_unref(image);
+	return TRUE;
 }
 
 static void make_dir_thumb(const gchar *path)
 {
 	gchar *dir = g_path_get_dirname(path);
 	gchar *dir_thumb_path = pixmap_make_thumb_path(dir);
-	GdkPixbuf *image = gdk_pixbuf_new_from_file(dir_thumb_path, NULL);
-	if (image)
-	{
-		g_object_unref(image);
-	}
-	else
+	struct stat info;
+
+	/* (Following the link, if it is one) */
+	if (mc_stat(dir_thumb_path, &info) != 0)
 	{
 		unlink(dir_thumb_path); //////////////////////////
 
@@ -796,6 +1204,9 @@ static void ordered_update(ChildThumbnail *info)
 			dir_force_update_path(li->path, TRUE);
 		make_dir_thumb(li->path);
 
+		if (li->cancel)
+			g_object_unref(li->cancel);
+		g_free(li->thumb_prog);
 		g_free(li->path);
 		g_free(li);
 
@@ -806,19 +1217,49 @@ static void ordered_update(ChildThumbnail *info)
 }
 static void thumbnail_done(ChildThumbnail *info)
 {
+	gboolean made = FALSE;
+
 	if (info->timeout)
 		g_source_remove(info->timeout);
+	info->timeout = 0;
+
+	active_thumbs = g_list_remove(active_thumbs, info);
 
-	GdkPixbuf *thumb = get_thumbnail_for(info->path, FALSE);
-	if (thumb)
+	if (g_cancellable_is_cancelled(info->cancel) && !info->timed_out)
 	{
-		g_object_unref(thumb);
+		/* Not wanted any more; someone may ask again later */
 		g_fscache_remove(thumb_cache, info->path);
 	}
 	else
-		g_fscache_insert(pixmap_cache, info->path, NULL, TRUE);
+	{
+		/* Our own thumbnails were indexed as they were saved. A
+		 * helper's must be loaded once to check, and get indexed.
+		 */
+		made = thumbnail_indexed(info->path);
+		if (!made)
+		{
+			GdkPixbuf *thumb = get_thumbnail_for(info->path, FALSE);
 
-	info->callback(info->data, thumb ? info->path : NULL);
+			if (thumb)
+			{
+				g_object_unref(thumb);
+				made = TRUE;
+			}
+		}
+
+		if (made)
+			g_fscache_remove(thumb_cache, info->path);
+		else
+			g_fscache_insert(pixmap_cache, info->path, NULL, TRUE);
+	}
+
+	info->callback(info->data, made ? info->path : NULL);
+
+	if (info->child > 0)
+	{
+		helpers_running--;
+		start_helpers();
+	}
 
 	ordered_update(info);
 }
@@ -830,14 +1271,15 @@ static void thumbnail_done(ChildThumbnail *info)
 static GdkPixbuf *get_thumbnail_for(const char *pathname, gboolean forcheck)
 {
 	GdkPixbuf *thumb = NULL;
-	char *thumb_path, *path, *pic_path = NULL;
+	char *thumb_path, *path, *md5, *pic_path = NULL;
 	const char *pic_uri, *ssize, *smtime;
 	struct stat info, thumbinfo;
 	time_t ttime, now;
 
 	path = pathdup(pathname);
 
-	thumb_path = pixmap_make_thumb_path(path);
+	md5 = thumbnail_md5(path);
+	thumb_path = thumbnail_file(md5);
 
 	thumb = gdk_pixbuf_new_from_file(thumb_path, NULL);
 	if (!thumb)
@@ -873,6 +1315,20 @@ static GdkPixbuf *get_thumbnail_for(const char *pathname, gboolean forcheck)
 		ssize = gdk_pixbuf_get_option(thumb, "tEXt::Thumb::Size");
 		if (ssize && info.st_size < atol(ssize))
 			goto err;
+
+		/* Only an exact match is good for next time, too */
+		if (info.st_mtime == ttime && strcmp(pic_path, path) == 0)
+		{
+			const char *swidth, *sheight;
+
+			swidth = gdk_pixbuf_get_option(thumb,
+					"tEXt::Thumb::Image::Width");
+			sheight = gdk_pixbuf_get_option(thumb,
+					"tEXt::Thumb::Image::Height");
+			index_thumbnail(md5, &info, thumb_path,
+					swidth ? atoi(swidth) : 0,
+					sheight ? atoi(sheight) : 0);
+		}
 	}
 	else
 	{ //for jpeg
@@ -892,6 +1348,10 @@ static GdkPixbuf *get_thumbnail_for(const char *pathname, gboolean forcheck)
 		}
 		else if (info.st_ctime > thumbinfo.st_ctime)
 			goto err;
+
+		if (!S_ISLNK(info.st_mode) &&
+		    info.st_ctime < thumbinfo.st_ctime)
+			index_thumbnail(md5, &info, thumb_path, 0, 0);
 	}
 
 	goto out;
@@ -903,6 +1363,7 @@ err:
 out:
 	g_free(pic_path);
 	g_free(path);
+	g_free(md5);
 	g_free(thumb_path);
 	return thumb;
 }
@@ -1049,6 +1510,42 @@ static gint purge_pixmaps(gpointer data)
 	g_fscache_purge(pixmap_cache, PIXMAP_PURGE_TIME);
 	return TRUE;
 }
+/* Bytes each of pixmap_cache and thumb_cache may hold. 0 for no limit. */
+static gsize image_cache_budget(void)
+{
+	return (gsize) MAX(o_image_cache_size.int_value, 0) << 20;
+}
+
+static gsize pixbuf_bytes(GdkPixbuf *pixbuf)
+{
+	if (!pixbuf)
+		return 0;
+	return (gsize) gdk_pixbuf_get_rowstride(pixbuf) *
+		gdk_pixbuf_get_height(pixbuf);
+}
+
+/* The caches hold MaskedPixmaps and thumbnail GdkPixbufs */
+static gsize image_size(GObject *image, gpointer unused)
+{
+	MaskedPixmap *mp;
+	gsize size;
+
+	if (GDK_IS_PIXBUF(image))
+		return pixbuf_bytes(GDK_PIXBUF(image));
+
+	if (!G_TYPE_CHECK_INSTANCE_TYPE(image, masked_pixmap_get_type()))
+		return 0;
+
+	mp = (MaskedPixmap *) image;
+	size = pixbuf_bytes(mp->src_pixbuf);
+	if (mp->pixbuf != mp->src_pixbuf)
+		size += pixbuf_bytes(mp->pixbuf);
+	if (mp->sm_pixbuf != mp->pixbuf)
+		size += pixbuf_bytes(mp->sm_pixbuf);
+
+	return size;
+}
+
 static gint purge_thumbs(gpointer data)
 {
 	g_fscache_purge(thumb_cache, o_purge_time.int_value);
@@ -1271,6 +1768,9 @@ static GList *thumbs_purge_cache(Option *option, xmlNode *node, guchar *label)
 
 #define JPEG_FORMAT        0x201
 #define JPEG_FORMAT_LENGTH 0x202
+#define EXIF_IFD           0x8769
+#define PIXEL_X_DIMENSION  0xa002
+#define PIXEL_Y_DIMENSION  0xa003
 
 /*
  * Extract n-byte integer in Motorola (big-endian) format
@@ -1318,20 +1818,57 @@ static int s2n(const unsigned char *dat, int off, int len, char format)
     return 0;
 }
 
+/*
+ * Find the entry for 'tag' in the IFD at 'ifd', and return its (SHORT or
+ * LONG) value, or -1. Everything is checked against the 'len' bytes of
+ * 'tiff', as the data comes straight from the file.
+ */
+static int ifd_lookup(const unsigned char *tiff, int len, char format,
+                      int ifd, int tag)
+{
+    int i, entries;
+
+    if(ifd<0 || ifd>len-2)
+        return -1;
+    entries=s2n(tiff, ifd, 2, format);
+
+    for(i=0; i<entries; i++) {
+        int entry=ifd+2+12*i;
+        int type;
+
+        if(entry>len-12)
+            break;
+        if(s2n(tiff, entry, 2, format)!=tag)
+            continue;
+
+        type=s2n(tiff, entry+2, 2, format);
+        if(type==3)
+            return s2n(tiff, entry+8, 2, format);
+        if(type==4)
+            return s2n(tiff, entry+8, 4, format);
+        break;
+    }
+
+    return -1;
+}
+
 /*
  * Load header of JPEG/Exif file and attempt to extract the embedded
- * thumbnail.  Return NULL on failure.
+ * thumbnail, if it's at least 'size' pixels on its longer side. The size
+ * of the main image goes in 'width' and 'height' when the Exif data gives
+ * it. Return NULL on failure.
  */
-static GdkPixbuf *extract_tiff_thumbnail(const gchar *path)
+static GdkPixbuf *extract_exif_thumbnail(const gchar *path, int size,
+                                         int *width, int *height)
 {
     FILE *in;
-    unsigned char header[256];
-    int i, n;
-    int length;
-    unsigned char *data;
+    unsigned char header[4];
+    int n;
+    int length=0;
+    unsigned char *data=NULL, *tiff;
     char format;
-    int ifd, entries;
-    int thumb=0, tlength=0;
+    int ifd, exif;
+    int thumb, tlength;
     GdkPixbuf *buf=NULL;
 
     in=fopen(path, "rb");
@@ -1339,85 +1876,225 @@ static GdkPixbuf *extract_tiff_thumbnail(const gchar *path)
         return NULL;
     }
 
-    /* Check for Exif format */
-    n=fread(header, 1, 12, in);
-    if(n!=12 || strncmp((char *) header, "\377\330\377\341", 4)!=0 ||
-       strncmp((char *)header+6, "Exif", 4)!=0) {
-        fclose(in);
-        return NULL;
+    /* Exif is usually the first segment, but some writers put JFIF (or
+     * other APPn segments) ahead of it.
+     */
+    if(fread(header, 1, 2, in)==2 && header[0]==0xff && header[1]==0xd8) {
+        for(n=0; n<8; n++) {
+            if(fread(header, 1, 4, in)!=4 || header[0]!=0xff)
+                break;
+            length=header[2]*256+header[3]-2;
+            if(length<0)
+                break;
+
+            if(header[1]==0xe1) {
+                data=g_new(unsigned char, length);
+                if(fread(data, 1, length, in)==length && length>14 &&
+                   memcmp(data, "Exif\0\0", 6)==0)
+                    break;
+                g_free(data);
+                data=NULL;
+            }
+            else if((header[1]&0xf0)!=0xe0 ||
+                    fseek(in, length, SEEK_CUR)!=0)
+                break;
+        }
     }
-
-    /* Read header */
-    length=header[4]*256+header[5];
-    data=g_new(unsigned char, length);
-    n=fread(data, 1, length, in);
     fclose(in);   /* File no longer needed */
-    if(n!=length) {
-        g_free(data);
+    if(!data)
         return NULL;
-    }
 
-    /* Big or little endian (as 'M' or 'I') */
-    format=data[0];
+    /* Offsets are from the TIFF header, after "Exif\0\0" */
+    tiff=data+6;
+    length-=6;
 
-    /* Skip over main section */
-    ifd=s2n(data, 4, 4, format);
-    entries=s2n(data, ifd, 2, format);
+    /* Big or little endian (as 'M' or 'I') */
+    format=tiff[0];
+
+    /* The main section says how big the real image is */
+    ifd=s2n(tiff, 4, 4, format);
+    exif=ifd_lookup(tiff, length, format, ifd, EXIF_IFD);
+    if(exif>0) {
+        int w=ifd_lookup(tiff, length, format, exif, PIXEL_X_DIMENSION);
+        int h=ifd_lookup(tiff, length, format, exif, PIXEL_Y_DIMENSION);
+
+        if(w>0 && h>0) {
+            *width=w;
+            *height=h;
+        }
+    }
 
     /* Second section contains data on thumbnail */
-    ifd=s2n(data, ifd+2+12*entries, 4, format);
-    entries=s2n(data, ifd, 2, format);
+    if(ifd>=0 && ifd<=length-2) {
+        int entries=s2n(tiff, ifd, 2, format);
 
-    /* Loop over the entries */
-    for(i=0; i<entries; i++) {
-        int entry=ifd+2+12*i;
-        int tag=s2n(data, entry, 2, format);
-        int type=s2n(data, entry+2, 2, format);
-        int offset=entry+8;
-
-        if(type==4) {
-            int val=(int) s2n(data, offset, 4, format);
-
-            /* Only interested in two entries, the location of the thumbnail
-               and its size */
-            switch(tag) {
-            case JPEG_FORMAT: thumb=val; break;
-            case JPEG_FORMAT_LENGTH: tlength=val; break;
-            }
-        }
+        if(ifd+2+12*entries<=length-4)
+            ifd=s2n(tiff, ifd+2+12*entries, 4, format);
+        else
+            ifd=-1;
     }
+    else
+        ifd=-1;
+    thumb=ifd_lookup(tiff, length, format, ifd, JPEG_FORMAT);
+    tlength=ifd_lookup(tiff, length, format, ifd, JPEG_FORMAT_LENGTH);
 
-    if(thumb && tlength) {
+    if(thumb>0 && tlength>0 && thumb<length) {
         GError *err=NULL;
         GdkPixbufLoader *loader;
 
         /* Don't read outside the header (some files have incorrect data) */
-        if(thumb+tlength>length)
+        if(tlength>length-thumb)
             tlength=length-thumb;
 
         loader=gdk_pixbuf_loader_new();
-        gdk_pixbuf_loader_write(loader, data+thumb, tlength, &err);
-        if(err) {
-            g_error_free(err);
-            return NULL;
+        if(gdk_pixbuf_loader_write(loader, tiff+thumb, tlength, &err) &&
+           gdk_pixbuf_loader_close(loader, &err)) {
+            buf=gdk_pixbuf_loader_get_pixbuf(loader);
+            /* Ref the image before we unref the loader */
+            if(buf)
+                g_object_ref(buf);
         }
-
-        gdk_pixbuf_loader_close(loader, &err);
-        if(err) {
+        else
+            gdk_pixbuf_loader_close(loader, NULL);
+        if(err)
             g_error_free(err);
-            return NULL;
-        }
-
-        buf=gdk_pixbuf_loader_get_pixbuf(loader);
-        g_object_ref(buf);      /* Ref the image before we unref the loader */
         g_object_unref(loader);
     }
 
     g_free(data);
 
+    /* Too small to scale up from; decode the real image instead */
+    if(buf && gdk_pixbuf_get_width(buf)<size &&
+       gdk_pixbuf_get_height(buf)<size) {
+        g_object_unref(buf);
+        buf=NULL;
+    }
+    if(!buf)
+        *width=*height=0;
+
     return buf;
 }
 
+#ifdef USE_LIBJPEG
+typedef struct _JpegError JpegError;
+
+struct _JpegError {
+	struct jpeg_error_mgr	pub;
+	jmp_buf			jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((JpegError *) cinfo->err)->jump, 1);
+}
+
+static void jpeg_output_message(j_common_ptr cinfo)
+{
+	/* Corrupt files are common enough; just fall back quietly */
+}
+
+/* Decode a JPEG with libjpeg, having the IDCT scale it down by 1/2, 1/4 or
+ * 1/8 as long as its longer side stays at least 'size' pixels. The full
+ * image size goes in 'width' and 'height'.
+ * Returns NULL on error, if cancelled, or for colour spaces libjpeg can't
+ * convert to RGB (CMYK).
+ */
+static GdkPixbuf *load_jpeg_scaled(const gchar *path, int size,
+				   GCancellable *cancel,
+				   int *width, int *height)
+{
+	struct jpeg_decompress_struct cinfo;
+	JpegError jerr;
+	GdkPixbuf * volatile pixbuf = NULL;
+	guchar * volatile gray = NULL;
+	guchar *pixels;
+	int rowstride, longest, denom;
+	FILE *in;
+
+	in = fopen(path, "rb");
+	if (!in)
+		return NULL;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpeg_error_exit;
+	jerr.pub.output_message = jpeg_output_message;
+	if (setjmp(jerr.jump))
+		goto err;
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, in);
+	jpeg_read_header(&cinfo, TRUE);
+
+	if (cinfo.jpeg_color_space == JCS_CMYK ||
+	    cinfo.jpeg_color_space == JCS_YCCK)
+		goto err;
+
+	longest = MAX(cinfo.image_width, cinfo.image_height);
+	for (denom = 8; denom > 1 && longest / denom < size; denom /= 2)
+		;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = denom;
+	/* It's all going to be scaled down again anyway */
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+	/* Not all libjpegs can turn grey into RGB, so do it here */
+	cinfo.out_color_space = cinfo.num_components == 1 ? JCS_GRAYSCALE
+							  : JCS_RGB;
+
+	jpeg_start_decompress(&cinfo);
+
+	pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8,
+				cinfo.output_width, cinfo.output_height);
+	if (!pixbuf)
+		goto err;
+	if (cinfo.output_components == 1)
+		gray = g_malloc(cinfo.output_width);
+	else if (cinfo.output_components != 3)
+		goto err;
+	pixels = gdk_pixbuf_get_pixels(pixbuf);
+	rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+
+	while (cinfo.output_scanline < cinfo.output_height)
+	{
+		guchar *row = pixels + cinfo.output_scanline * rowstride;
+		JSAMPROW out = gray ? gray : row;
+
+		if ((cinfo.output_scanline & 63) == 0 &&
+		    g_cancellable_is_cancelled(cancel))
+			goto err;
+
+		jpeg_read_scanlines(&cinfo, &out, 1);
+
+		if (gray)
+		{
+			JDIMENSION x;
+
+			for (x = 0; x < cinfo.output_width; x++)
+				row[3 * x] = row[3 * x + 1] = row[3 * x + 2]
+					= gray[x];
+		}
+	}
+
+	*width = cinfo.image_width;
+	*height = cinfo.image_height;
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(in);
+	g_free(gray);
+
+	return pixbuf;
+err:
+	jpeg_destroy_decompress(&cinfo);
+	fclose(in);
+	if (pixbuf)
+		g_object_unref(pixbuf);
+	g_free(gray);
+	*width = *height = 0;
+	return NULL;
+}
+#endif
+
 
 static cairo_status_t suf_to_bufcb(void *p,
 		const unsigned char *data, unsigned int len)
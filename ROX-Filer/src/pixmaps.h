@@ -73,12 +73,15 @@ void pixmap_make_huge(MaskedPixmap *mp);
 void pixmap_make_small(MaskedPixmap *mp);
 MaskedPixmap *load_pixmap(const char *name);
 void pixmap_background_thumb(const gchar *path, gboolean noorder, GFunc callback, gpointer data);
+void pixmap_cancel_thumbs(gpointer data);
 GdkPixbuf *pixmap_try_thumb(const gchar *path, gboolean forcheck);
 MaskedPixmap *masked_pixmap_new(GdkPixbuf *full_size);
 GdkPixbuf *scale_pixbuf(GdkPixbuf *src, int max_w, int max_h);
 gint pixmap_check_thumb(const gchar *path);
+gint pixmap_check_thumb_t(const gchar *path);
 GdkPixbuf *pixmap_load_thumb(const gchar *path);
 char *pixmap_make_thumb_path(const char *path);
+void pixmap_hash_thumbs(const char *dirpath, GPtrArray *leafnames);
 GdkPixbuf *pixmap_make_lined(GdkPixbuf *src, GdkColor *colour);
 MaskedPixmap *pixmap_from_desktop_file(const char *path);
 
@@ -43,6 +43,7 @@ gchar *to_utf8(const gchar *src);
 gchar *from_utf8(const gchar *src);
 void ensure_utf8(gchar **string);
 char *md5_hash(const char *message);
+void md5_hash_many(const char *const *messages, char **hashes, int n);
 gchar *expand_path(const gchar *path);
 gchar *collapse_path(const gchar *path);
 void destroy_glist(GList **list);
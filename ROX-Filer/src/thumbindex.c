@@ -0,0 +1,446 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* thumbindex.c - an index of the thumbnails known to be up-to-date */
+
+/* Checking a thumbnail the usual way means decoding it, just to read the
+ * URI and MTime from its text chunks. Instead, each time a thumbnail is
+ * found (or made) to be up-to-date, we record the stat details of the image
+ * and of the thumbnail file in ~/.cache/rox/thumbindex/<size>, keyed by
+ * the MD5 of the image's URI. If both still match later, the thumbnail
+ * is good without being opened.
+ *
+ * The file is a header followed by an open-addressed hash table, mapped
+ * shared so that other ROX-Filer processes see updates. Writers take a
+ * lock on the file; readers don't, but each slot carries a checksum so
+ * that a half-written slot is just a miss. A file is never shrunk once in
+ * place (so a reader can't fault on it): to grow or empty the index, a new
+ * file is renamed over the old one, and the others notice within a second.
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "global.h"
+
+#include "thumbindex.h"
+#include "main.h"
+
+#define INDEX_MAGIC "ROXTIDX1"
+
+#define INDEX_MIN_SLOTS 4096
+#define INDEX_MAX_SLOTS (1 << 18)	/* Empty it and start again after */
+#define INDEX_PROBES 32
+
+typedef struct _IndexHeader IndexHeader;
+typedef struct _IndexSlot IndexSlot;
+
+struct _IndexHeader {
+	char	magic[8];
+	guint32	n_slots;	/* A power of two */
+	guint32	n_used;
+};
+
+struct _IndexSlot {
+	guint8		md5[16];
+	ThumbIndexEntry	entry;
+	guint32		check;		/* slot_check(); 0 if the slot is free */
+	guint32		unused;
+};
+
+static GMutex index_mutex;
+static gchar *index_path = NULL;	/* The file index_fd should be */
+static int index_fd = -1;
+static IndexHeader *index_map = NULL;
+static gsize index_len = 0;
+static gint64 index_checked = 0;	/* When we last looked for a new file */
+
+/* Static prototypes */
+static gboolean open_index(const char *thumb_dir, gboolean force);
+static void close_index(void);
+static gboolean replace_index(guint32 n_slots, gboolean keep,
+			      gboolean create);
+static guint32 slot_check(const IndexSlot *slot);
+static gboolean parse_md5(const char *md5, guint8 *bin);
+static IndexSlot *find_slot(IndexHeader *map, const guint8 *md5,
+			    gboolean for_store);
+static gboolean lock_index(short type);
+
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+/* Look up the thumbnail with this (hex) MD5 name in thumb_dir.
+ * Fills in 'entry' and returns TRUE if it is in the index.
+ */
+gboolean thumbindex_lookup(const char *thumb_dir, const char *md5,
+			   ThumbIndexEntry *entry)
+{
+	guint8 key[16];
+	gboolean found = FALSE;
+
+	if (!parse_md5(md5, key))
+		return FALSE;
+
+	g_mutex_lock(&index_mutex);
+	if (open_index(thumb_dir, FALSE))
+	{
+		IndexSlot *slot = find_slot(index_map, key, FALSE);
+
+		if (slot)
+		{
+			/* Pairs with the stores in thumbindex_store() */
+			guint32 check = g_atomic_int_get(&slot->check);
+
+			*entry = slot->entry;
+			/* Make sure we didn't copy it mid-write */
+			found = check && check == slot_check(slot) &&
+				memcmp(entry, &slot->entry,
+				       sizeof(*entry)) == 0;
+		}
+	}
+	g_mutex_unlock(&index_mutex);
+
+	return found;
+}
+
+/* Record that the thumbnail with this MD5 name is up-to-date, as described
+ * by 'entry'. May be called from any thread.
+ */
+void thumbindex_store(const char *thumb_dir, const char *md5,
+		      const ThumbIndexEntry *entry)
+{
+	guint8 key[16];
+	IndexSlot *slot;
+	struct stat info, current;
+	int tries;
+
+	if (!parse_md5(md5, key))
+		return;
+
+	g_mutex_lock(&index_mutex);
+
+	/* Someone may replace the file while we wait for the lock on it */
+	for (tries = 0; tries < 3; tries++)
+	{
+		if (!open_index(thumb_dir, tries > 0) || !lock_index(F_WRLCK))
+			goto out;
+		if (fstat(index_fd, &info) == 0 &&
+		    stat(index_path, &current) == 0 &&
+		    info.st_dev == current.st_dev &&
+		    info.st_ino == current.st_ino)
+			break;
+		lock_index(F_UNLCK);
+	}
+	if (tries == 3)
+		goto out;
+
+	slot = find_slot(index_map, key, TRUE);
+	if (!slot || (!slot->check &&
+		      index_map->n_used + 1 > index_map->n_slots / 4 * 3))
+	{
+		guint32 n_slots = index_map->n_slots * 2;
+
+		if (n_slots <= INDEX_MAX_SLOTS)
+			replace_index(n_slots, TRUE, FALSE);
+		else
+			replace_index(INDEX_MIN_SLOTS, FALSE, FALSE);
+
+		/* (closing the old file dropped our lock on it) */
+		slot = index_map && lock_index(F_WRLCK) ?
+			find_slot(index_map, key, TRUE) : NULL;
+	}
+
+	if (slot)
+	{
+		if (!slot->check)
+			index_map->n_used++;
+		/* Other processes read without the lock. Invalidate the slot
+		 * before touching it and only publish the new check once the
+		 * rest is written, so they never take a torn slot as good.
+		 */
+		g_atomic_int_set(&slot->check, 0);
+		memcpy(slot->md5, key, sizeof(key));
+		slot->entry = *entry;
+		g_atomic_int_set(&slot->check, slot_check(slot));
+	}
+
+	if (index_fd != -1)
+		lock_index(F_UNLCK);
+out:
+	g_mutex_unlock(&index_mutex);
+}
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+/* Make index_fd and index_map the current index for thumb_dir, creating it
+ * if needed. With 'force', or if it's been a while, check that another
+ * process hasn't replaced it. Call with index_mutex held.
+ */
+static gboolean open_index(const char *thumb_dir, gboolean force)
+{
+	gint64 now = g_get_monotonic_time();
+	struct stat info, current;
+	gchar *path;
+
+	path = g_strconcat(home_dir, "/.cache/rox/thumbindex/",
+			   thumb_dir, NULL);
+
+	if (index_fd != -1 && strcmp(index_path, path) == 0)
+	{
+		g_free(path);
+		if (!force && now - index_checked < G_USEC_PER_SEC)
+			return TRUE;
+		index_checked = now;
+		if (fstat(index_fd, &info) == 0 &&
+		    stat(index_path, &current) == 0 &&
+		    info.st_dev == current.st_dev &&
+		    info.st_ino == current.st_ino)
+			return TRUE;
+	}
+	else
+	{
+		g_free(index_path);
+		index_path = path;
+	}
+
+	close_index();
+	index_checked = now;
+
+	index_fd = open(index_path, O_RDWR);
+	if (index_fd == -1 && errno == ENOENT &&
+	    replace_index(INDEX_MIN_SLOTS, FALSE, TRUE))
+		return TRUE;
+	if (index_fd == -1)
+		index_fd = open(index_path, O_RDWR);	/* Lost the race? */
+	if (index_fd == -1 || fstat(index_fd, &info) != 0)
+	{
+		close_index();
+		return FALSE;
+	}
+	fcntl(index_fd, F_SETFD, FD_CLOEXEC);
+
+	if (info.st_size >= sizeof(IndexHeader))
+	{
+		index_map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, index_fd, 0);
+		if (index_map == MAP_FAILED)
+		{
+			index_map = NULL;
+			close_index();
+			return FALSE;
+		}
+		index_len = info.st_size;
+
+		if (memcmp(index_map->magic, INDEX_MAGIC, 8) == 0 &&
+		    index_map->n_slots >= INDEX_MIN_SLOTS &&
+		    index_map->n_slots <= INDEX_MAX_SLOTS &&
+		    (index_map->n_slots & (index_map->n_slots - 1)) == 0 &&
+		    index_len == sizeof(IndexHeader) +
+				 (gsize) index_map->n_slots * sizeof(IndexSlot))
+			return TRUE;
+	}
+
+	/* Not something we wrote. Start again. */
+	if (!lock_index(F_WRLCK))
+	{
+		close_index();
+		return FALSE;
+	}
+	if (!replace_index(INDEX_MIN_SLOTS, FALSE, FALSE))
+		return FALSE;
+	lock_index(F_UNLCK);
+	return TRUE;
+}
+
+static void close_index(void)
+{
+	if (index_map)
+		munmap(index_map, index_len);
+	index_map = NULL;
+	index_len = 0;
+	if (index_fd != -1)
+		close(index_fd);
+	index_fd = -1;
+}
+
+/* Write a new, empty index with n_slots slots over index_path and make it
+ * the current one. If 'keep', the valid slots of the current one are
+ * copied over first. If 'create', only do it if there is no index yet
+ * (so that starting processes don't each replace the others').
+ */
+static gboolean replace_index(guint32 n_slots, gboolean keep,
+			      gboolean create)
+{
+	gsize len = sizeof(IndexHeader) + (gsize) n_slots * sizeof(IndexSlot);
+	IndexHeader *map;
+	gchar *tmp, *dir;
+	int fd;
+
+	dir = g_path_get_dirname(index_path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	tmp = g_strdup_printf("%s.%ld", index_path, (long) getpid());
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		goto err;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (ftruncate(fd, len) != 0)
+		goto err;
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto err;
+
+	memcpy(map->magic, INDEX_MAGIC, 8);
+	map->n_slots = n_slots;
+	map->n_used = 0;
+
+	if (keep && index_map)
+	{
+		IndexSlot *old = (IndexSlot *) (index_map + 1);
+		guint32 i;
+
+		for (i = 0; i < index_map->n_slots; i++, old++)
+		{
+			IndexSlot *slot;
+
+			if (!old->check || old->check != slot_check(old))
+				continue;
+
+			slot = find_slot(map, old->md5, TRUE);
+			if (slot && !slot->check)
+			{
+				*slot = *old;
+				map->n_used++;
+			}
+		}
+	}
+
+	if (create ? link(tmp, index_path) != 0
+		   : rename(tmp, index_path) != 0)
+	{
+		munmap(map, len);
+		goto err;
+	}
+	if (create)
+		unlink(tmp);
+	g_free(tmp);
+
+	close_index();
+	index_fd = fd;
+	index_map = map;
+	index_len = len;
+
+	return TRUE;
+err:
+	if (fd != -1)
+	{
+		close(fd);
+		unlink(tmp);
+	}
+	g_free(tmp);
+	close_index();
+	return FALSE;
+}
+
+/* FNV-1a over the slot, up to the check itself. Never 0. */
+static guint32 slot_check(const IndexSlot *slot)
+{
+	const guint8 *p = (const guint8 *) slot;
+	guint32 hash = 2166136261u;
+	gsize i;
+
+	for (i = 0; i < G_STRUCT_OFFSET(IndexSlot, check); i++)
+		hash = (hash ^ p[i]) * 16777619u;
+
+	return hash ? hash : 1;
+}
+
+static gboolean parse_md5(const char *md5, guint8 *bin)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+	{
+		int hi = g_ascii_xdigit_value(md5[2 * i]);
+		int lo = hi < 0 ? -1 : g_ascii_xdigit_value(md5[2 * i + 1]);
+
+		if (lo < 0)
+			return FALSE;
+		bin[i] = (hi << 4) | lo;
+	}
+
+	return TRUE;
+}
+
+/* Find the slot in 'map' holding md5. If for_store, a free slot will do
+ * instead. NULL if there's no such slot within INDEX_PROBES of its home.
+ */
+static IndexSlot *find_slot(IndexHeader *map, const guint8 *md5,
+			    gboolean for_store)
+{
+	IndexSlot *slots = (IndexSlot *) (map + 1);
+	guint32 mask = map->n_slots - 1;
+	guint32 i, home;
+
+	memcpy(&home, md5, sizeof(home));
+
+	for (i = 0; i < INDEX_PROBES; i++)
+	{
+		IndexSlot *slot = &slots[(home + i) & mask];
+
+		if (!slot->check)
+			return for_store ? slot : NULL;
+
+		if (memcmp(slot->md5, md5, 16) == 0)
+			return slot;
+	}
+
+	return NULL;
+}
+
+/* Take or release the lock that other processes writing use.
+ * This doesn't lock out our own threads; index_mutex does that.
+ */
+static gboolean lock_index(short type)
+{
+	struct flock lb;
+
+	lb.l_type = type;
+	lb.l_whence = SEEK_SET;
+	lb.l_start = 0;
+	lb.l_len = 0;
+
+	while (fcntl(index_fd, F_SETLKW, &lb) == -1)
+		if (errno != EINTR)
+			return FALSE;
+
+	return TRUE;
+}
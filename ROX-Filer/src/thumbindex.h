@@ -0,0 +1,28 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * By Thomas Leonard, <tal197@users.sourceforge.net>.
+ */
+
+#ifndef _THUMBINDEX_H
+#define _THUMBINDEX_H
+
+#define THUMB_INDEX_JPEG 0x1	/* Thumbnail saved as .jpg, not .png */
+
+typedef struct _ThumbIndexEntry ThumbIndexEntry;
+
+/* What we knew about an image and its thumbnail when the thumbnail was
+ * last found to be up-to-date.
+ */
+struct _ThumbIndexEntry {
+	gint64	src_mtime, src_ctime, src_size;
+	gint64	thumb_mtime, thumb_size, thumb_ino;
+	guint32	width, height;	/* Of the image; 0 if not known */
+	guint32	flags;
+};
+
+gboolean thumbindex_lookup(const char *thumb_dir, const char *md5,
+			   ThumbIndexEntry *entry);
+void thumbindex_store(const char *thumb_dir, const char *md5,
+		      const ThumbIndexEntry *entry);
+
+#endif /* _THUMBINDEX_H */
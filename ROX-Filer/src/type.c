@@ -102,6 +102,7 @@ static GList *build_icon_theme(Option *option, xmlNode *node, guchar *label);
  * when rereading the config files.
  */
 static GHashTable *type_hash = NULL;
+static GRWLock type_hash_lock;	/* Types are added from other threads */
 
 /* Most things on Unix are text files, so this is the default type */
 MIME_type *text_plain;
@@ -124,8 +125,6 @@ static GtkIconTheme *icon_theme = NULL;
 static GtkIconTheme *rox_theme = NULL;
 static GtkIconTheme *gnome_theme = NULL;
 
-static GMutex m_xdg;
-
 void type_init(void)
 {
 	int	    i;
@@ -187,7 +186,9 @@ static MIME_type *get_mime_type(const gchar *type_name, gboolean can_create)
         MIME_type *mtype;
 	gchar *slash;
 
+	g_rw_lock_reader_lock(&type_hash_lock);
 	mtype = g_hash_table_lookup(type_hash, type_name);
+	g_rw_lock_reader_unlock(&type_hash_lock);
 	if (mtype || !can_create)
 		return mtype;
 
@@ -205,12 +206,22 @@ static MIME_type *get_mime_type(const gchar *type_name, gboolean can_create)
 	mtype->image = NULL;
 	mtype->comment = NULL;
 
-	g_mutex_lock(&m_xdg);
 	mtype->executable = xdg_mime_mime_type_subclass(type_name,
 						"application/x-executable");
-	g_mutex_unlock(&m_xdg);
 
-	g_hash_table_insert(type_hash, g_strdup(type_name), mtype);
+	g_rw_lock_writer_lock(&type_hash_lock);
+	MIME_type *other = g_hash_table_lookup(type_hash, type_name);
+	if (other)
+	{
+		/* Another thread got there first */
+		g_free(mtype->media_type);
+		g_free(mtype->subtype);
+		g_free(mtype);
+		mtype = other;
+	}
+	else
+		g_hash_table_insert(type_hash, g_strdup(type_name), mtype);
+	g_rw_lock_writer_unlock(&type_hash_lock);
 
 	return mtype;
 }
@@ -269,7 +280,9 @@ GList *mime_type_name_list(gboolean only_regular)
 	list.list=NULL;
 	list.only_regular=only_regular;
 
+	g_rw_lock_reader_lock(&type_hash_lock);
 	g_hash_table_foreach(type_hash, append_names, &list);
+	g_rw_lock_reader_unlock(&type_hash_lock);
 	list.list = g_list_sort(list.list, (GCompareFunc) strcmp);
 
 	return list.list;
@@ -314,22 +327,53 @@ MIME_type *type_get_type(const guchar *path)
 MIME_type *type_from_path(const char *path)
 {
 	MIME_type *mime_type = NULL;
-	const char *type_name;
 
 	/* Check for extended attribute first */
 	mime_type = xtype_get(path);
 	if (mime_type)
 		return mime_type;
 
-	/* Try name and contents next */
-	g_mutex_lock(&m_xdg);
-	type_name = xdg_mime_get_mime_type_for_file(path, NULL);
-	g_mutex_unlock(&m_xdg);
+	return type_from_path_no_xattr(path);
+}
 
+/* As type_from_path(), for files known to have no extended attributes */
+MIME_type *type_from_path_no_xattr(const char *path)
+{
+	const char *type_name;
+	MIME_type *mime_type = NULL;
+
+	/* Try name and contents. Holding the database keeps type_name valid
+	 * if it is reloaded meanwhile; other threads aren't held up.
+	 */
+	xdg_mime_hold();
+	type_name = xdg_mime_get_mime_type_for_file(path, NULL);
 	if (type_name)
-		return get_mime_type(type_name, TRUE);
+		mime_type = get_mime_type(type_name, TRUE);
+	xdg_mime_release();
 
-	return NULL;
+	return mime_type;
+}
+
+/* As type_from_path_no_xattr() for each of n regular files in the directory
+ * open as dir_fd, setting the matching elements of types. All the names are
+ * checked before any file is read, and the reads are issued together.
+ */
+void type_from_leafnames_at(int dir_fd, const char **leafnames,
+			    MIME_type **types, int n)
+{
+	const char **type_names;
+	int i;
+
+	type_names = g_new(const char *, n);
+
+	xdg_mime_hold();
+	xdg_mime_get_mime_types_for_files_at(dir_fd, leafnames, type_names, n);
+	for (i = 0; i < n; i++)
+		types[i] = type_names[i] ? get_mime_type(type_names[i], TRUE)
+					 : NULL;
+	xdg_mime_release();
+
+	g_free(type_names);
 }
 
 /* Returns the file/dir in Choices for handling this type.
@@ -1202,7 +1246,9 @@ static void options_changed(void)
 	if (o_icon_theme.has_changed)
 	{
 		set_icon_theme();
+		g_rw_lock_reader_lock(&type_hash_lock);
 		g_hash_table_foreach(type_hash, expire_timer, NULL);
+		g_rw_lock_reader_unlock(&type_hash_lock);
 		full_refresh();
 	}
 
@@ -1492,3 +1538,141 @@ GdkPixbuf *theme_load_icon(const gchar *icon_name, gint size,
 	return result;
 }
 
+
+#ifdef UNIT_TESTS
+# ifdef HAVE_MMAP
+/* mime.cache stores everything big-endian */
+static void cache_set32(GByteArray *cache, guint pos, guint32 value)
+{
+	cache->data[pos] = value >> 24;
+	cache->data[pos + 1] = value >> 16;
+	cache->data[pos + 2] = value >> 8;
+	cache->data[pos + 3] = value;
+}
+
+static guint32 cache_add(GByteArray *cache, const char *bytes, guint len)
+{
+	guint32 offset = cache->len;
+
+	g_byte_array_append(cache, (guint8 *) bytes, len);
+	return offset;
+}
+
+static void cache_set_match(GByteArray *cache, guint pos, int priority,
+			    const char *mime_type, guint32 matchlet)
+{
+	cache_set32(cache, pos, priority);
+	cache_set32(cache, pos + 4,
+		    cache_add(cache, mime_type, strlen(mime_type) + 1));
+	cache_set32(cache, pos + 8, 1);
+	cache_set32(cache, pos + 12, matchlet);
+}
+
+static void cache_set_matchlet(GByteArray *cache, guint pos,
+			       guint32 start, guint32 range,
+			       const char *value, const char *mask, guint len,
+			       guint32 child)
+{
+	cache_set32(cache, pos, start);
+	cache_set32(cache, pos + 4, range);
+	cache_set32(cache, pos + 8, 1);
+	cache_set32(cache, pos + 12, len);
+	cache_set32(cache, pos + 16, cache_add(cache, value, len));
+	cache_set32(cache, pos + 20, mask ? cache_add(cache, mask, len) : 0);
+	cache_set32(cache, pos + 24, child ? 1 : 0);
+	cache_set32(cache, pos + 28, child);
+}
+
+static void check_type(const char *data, const char *expected)
+{
+	g_assert_cmpstr(xdg_mime_get_mime_type_for_data(data, strlen(data),
+							NULL), ==, expected);
+}
+
+/* Types some data using only a mime.cache made here, so that it goes through
+ * the cache's magic rules (nested, masked and ranged).
+ */
+static void cache_magic_tests(void)
+{
+	GByteArray *cache;
+	gchar *old_home, *old_dirs;
+	gchar *dir, *mime_dir, *path;
+	gboolean saved;
+	int i;
+
+	cache = g_byte_array_new();
+	g_byte_array_set_size(cache, 236);
+	memset(cache->data, 0, cache->len);
+
+	cache->data[1] = 1;		/* Version 1.2 */
+	cache->data[3] = 2;
+	for (i = 4; i < 40; i += 4)
+		cache_set32(cache, i, 40);	/* Empty lists */
+	cache_set32(cache, 24, 48);	/* Magic */
+
+	cache_set32(cache, 48, 3);
+	cache_set32(cache, 52, 32);	/* Max extent */
+	cache_set32(cache, 56, 60);
+
+	cache_set_match(cache, 60, 80, "application/x-rox-nested", 108);
+	cache_set_match(cache, 76, 60, "application/x-rox-masked", 140);
+	cache_set_match(cache, 92, 50, "text/x-rox-ranged", 172);
+
+	cache_set_matchlet(cache, 108, 0, 1, "ROXT", NULL, 4, 204);
+	cache_set_matchlet(cache, 204, 4, 8, "deep", NULL, 4, 0);
+	cache_set_matchlet(cache, 140, 2, 1, "\x10\x20", "\xf0\xf0", 2, 0);
+	cache_set_matchlet(cache, 172, 0, 16, "hello", NULL, 5, 0);
+
+	dir = g_dir_make_tmp("rox-mime-XXXXXX", NULL);
+	g_assert(dir != NULL);
+	mime_dir = g_build_filename(dir, "mime", NULL);
+	path = g_build_filename(mime_dir, "mime.cache", NULL);
+	mkdir(mime_dir, 0700);
+	saved = g_file_set_contents(path, (gchar *) cache->data, cache->len,
+				    NULL);
+	g_assert(saved);
+
+	old_home = g_strdup(g_getenv("XDG_DATA_HOME"));
+	old_dirs = g_strdup(g_getenv("XDG_DATA_DIRS"));
+	g_setenv("XDG_DATA_HOME", dir, TRUE);
+	g_setenv("XDG_DATA_DIRS", dir, TRUE);
+	xdg_mime_shutdown();
+
+	check_type("ROXT1234deep", "application/x-rox-nested");
+	check_type("ROXT1234567890deep", "text/plain");
+	check_type("ROXT  hello", "text/x-rox-ranged");
+	check_type("ROXT  deep hello", "application/x-rox-nested");
+	check_type("ab\x1f\x2f", "application/x-rox-masked");
+	check_type("ab\x1f\x3fhello", "text/x-rox-ranged");
+	check_type("0123456789hello", "text/x-rox-ranged");
+	check_type("0123456789ABCDEFhello", "text/plain");
+
+	if (old_home)
+		g_setenv("XDG_DATA_HOME", old_home, TRUE);
+	else
+		g_unsetenv("XDG_DATA_HOME");
+	if (old_dirs)
+		g_setenv("XDG_DATA_DIRS", old_dirs, TRUE);
+	else
+		g_unsetenv("XDG_DATA_DIRS");
+	xdg_mime_shutdown();
+
+	unlink(path);
+	rmdir(mime_dir);
+	rmdir(dir);
+	g_free(path);
+	g_free(mime_dir);
+	g_free(dir);
+	g_free(old_home);
+	g_free(old_dirs);
+	g_byte_array_free(cache, TRUE);
+}
+# endif
+
+void type_tests(void)
+{
+# ifdef HAVE_MMAP
+	cache_magic_tests();	/* mime.cache is only read if it can be mapped */
+# endif
+}
+#endif
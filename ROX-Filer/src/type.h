@@ -40,6 +40,9 @@ const char *basetype_name(DirItem *item);
 MIME_type *type_get_type(const guchar *path);
 
 MIME_type *type_from_path(const char *path);
+MIME_type *type_from_path_no_xattr(const char *path);
+void type_from_leafnames_at(int dir_fd, const char **leafnames,
+			    MIME_type **types, int n);
 MaskedPixmap *type_to_icon(MIME_type *type);
 GdkAtom type_to_atom(MIME_type *type);
 MIME_type *mime_type_from_base_type(int base_type);
@@ -63,6 +66,10 @@ GtkIconInfo *theme_lookup_icon(const gchar *icon_name, gint size,
 GdkPixbuf *theme_load_icon(const gchar *icon_name, gint size,
 		GtkIconLookupFlags flags, GError **error);
 
+#ifdef UNIT_TESTS
+void type_tests(void);
+#endif
+
 #define EXECUTABLE_FILE(item) ((item)->mime_type && (item)->mime_type->executable && \
 				((item)->flags & ITEM_FLAG_EXEC_FILE))
 
@@ -50,6 +50,40 @@
 
 #define MIN_ITEM_WIDTH 64
 
+/* Names are laid out by a pool shared by all windows. Adding items makes a
+ * LayoutJob, split into chunks; the main thread takes the chunks in order
+ * as they are finished, doing any that no worker has started yet itself.
+ */
+#define LAYOUT_CHUNK 44
+static GThreadPool *layout_pool = NULL;
+
+typedef struct _LayoutJob LayoutJob;
+typedef struct _LayoutChunk LayoutChunk;
+
+typedef enum {
+	CHUNK_QUEUED,
+	CHUNK_RUNNING,
+	CHUNK_DONE,
+} ChunkState;
+
+struct _LayoutChunk {
+	LayoutJob	*job;
+	int		start, end;	/* Items [start, end) */
+	ChunkState	state;		/* (job->m) */
+};
+
+struct _LayoutJob {
+	FilerWindow	*fw;
+	CollectionItem	*items;
+	LayoutChunk	*chunks;
+	int		n_chunks;
+	gint		refs;		/* Ours, and one per chunk pushed */
+	gint		cut;		/* Chunks not started yet are cut */
+
+	GMutex		m;
+	GCond		done;
+};
+
 static gpointer parent_class = NULL;
 
 struct _ViewCollectionClass {
@@ -158,12 +192,26 @@ static void view_collection_start_lasso_box(ViewIface *view,
 static void view_collection_extend_tip(ViewIface *view, ViewIter *iter,
 					GString *tip);
 static gboolean view_collection_auto_scroll_callback(ViewIface *view);
+static void view_collection_get_visible_items(ViewIface *view,
+					      GPtrArray *items, int ahead);
 
 static DirItem *iter_next(ViewIter *iter);
 static DirItem *iter_prev(ViewIter *iter);
 static DirItem *iter_peek(ViewIter *iter);
 static void reset_thumb_func(ViewCollection *vc);
 static void clear_thumb_func(ViewCollection *vc);
+static gboolean estimating(Collection *collection);
+static LayoutJob *layout_start(FilerWindow *fw, Collection *collection,
+			       int start, int end);
+static void layout_wait(LayoutChunk *chunk);
+static void layout_finish(LayoutJob *job);
+static void layout_cut(LayoutJob *job);
+static void layout_chunk(LayoutChunk *chunk);
+static void layout_task(gpointer data, gpointer unused);
+static void layout_unref(LayoutJob *job);
+static void queue_measure(ViewCollection *vc);
+static gboolean measure_shown(ViewCollection *vc);
+static void fit_item_size(ViewCollection *vc);
 
 /****************************************************************
  *			EXTERNAL INTERFACE			*
@@ -229,9 +277,17 @@ GType view_collection_get_type(void)
 
 static void view_collection_destroy(GtkObject *view_collection)
 {
-	VIEW_COLLECTION(view_collection)->filer_window = NULL;
+	ViewCollection *vc = VIEW_COLLECTION(view_collection);
 
-	clear_thumb_func(VIEW_COLLECTION(view_collection));
+	vc->filer_window = NULL;
+
+	clear_thumb_func(vc);
+
+	if (vc->measure_idle)
+	{
+		g_source_remove(vc->measure_idle);
+		vc->measure_idle = 0;
+	}
 
 	(*GTK_OBJECT_CLASS(parent_class)->destroy)(view_collection);
 }
@@ -438,6 +494,8 @@ static void view_collection_init(GTypeInstance *object, gpointer gclass)
 
 	adj = view_collection->collection->vadj;
 	gtk_viewport_set_vadjustment(viewport, adj);
+	g_signal_connect_swapped(adj, "value-changed",
+			G_CALLBACK(queue_measure), view_collection);
 	gtk_viewport_set_hadjustment(viewport, NULL); /* Or Gtk will crash */
 	gtk_viewport_set_shadow_type(viewport, GTK_SHADOW_NONE);
 	gtk_container_add(GTK_CONTAINER(object), collection);
@@ -540,9 +598,15 @@ static void draw_cursor(GtkWidget *widget,
 	cairo_destroy(cr);
 }
 
+/* Load the thumbnails of items drawn lately, most recent first. Items that
+ * have been scrolled away since are left until they're drawn again.
+ */
 static gboolean next_thumb(ViewCollection *vc)
 {
 	int i;
+	int first, last;
+
+	collection_get_visible_rows(vc->collection, &first, &last);
 
 	for (i = 0; i < 3; i++)
 	{
@@ -552,10 +616,19 @@ static gboolean next_thumb(ViewCollection *vc)
 			g_object_unref(vc);
 			return FALSE;
 		} else {
-			int idx = GPOINTER_TO_INT(g_queue_pop_tail(vc->thumbs_queue));
+			int idx = GPOINTER_TO_INT(g_queue_pop_head(vc->thumbs_queue));
+			int row, col;
+
 			if (idx >= vc->collection->number_of_items)
 				continue;
 
+			collection_item_to_rowcol(vc->collection, idx, &row, &col);
+			if (row < first || row > last)
+			{
+				i--;	/* Skipping is cheap; don't count it */
+				continue;
+			}
+
 			FilerWindow    *fw = vc->filer_window;
 			CollectionItem *colitem = &vc->collection->items[idx];
 			DirItem        *item = (DirItem *) colitem->data;
@@ -610,6 +683,97 @@ static void reset_thumb_func(ViewCollection *vc)
 	vc->thumbs_queue = g_queue_new();
 }
 
+/* Too many items to lay out every name? */
+static gboolean estimating(Collection *collection)
+{
+	return o_display_estimate_over.int_value &&
+		collection->number_of_items > o_display_estimate_over.int_value;
+}
+
+static void queue_measure(ViewCollection *vc)
+{
+	if (!vc->measure_idle)
+		vc->measure_idle = g_idle_add((GSourceFunc) measure_shown, vc);
+}
+
+/* Measure the items with estimated sizes on screen, and a screenful
+ * either side, then fit the item size to what is known now.
+ */
+static gboolean measure_shown(ViewCollection *vc)
+{
+	Collection *collection = vc->collection;
+	FilerWindow *fw = vc->filer_window;
+	int first, last, rows, row, col;
+	gboolean measured = FALSE;
+
+	vc->measure_idle = 0;
+
+	if (!fw || fw->under_init)
+		return FALSE;
+
+	collection_get_visible_rows(collection, &first, &last);
+	rows = last - first + 1;
+	first = MAX(first - rows, 0);
+	last += rows;
+
+	for (row = first; row <= last; row++)
+	{
+		for (col = 0; col < collection->columns; col++)
+		{
+			int i = collection_rowcol_to_item(collection, row, col);
+			CollectionItem *ci;
+
+			if (i >= collection->number_of_items)
+				continue;
+
+			ci = &collection->items[i];
+			if (!((ViewData *) ci->view_data)->estimated)
+				continue;
+
+			display_update_view(fw, (DirItem *) ci->data,
+					(ViewData *) ci->view_data,
+					TRUE, FALSE);
+			measured = TRUE;
+		}
+	}
+
+	if (measured)
+	{
+		fit_item_size(vc);
+		gtk_widget_queue_draw(GTK_WIDGET(collection));
+	}
+
+	return FALSE;
+}
+
+/* Size the items to fit every name as now known, measured or estimated.
+ * Unlike update_item(), this may shrink them again after a guess was too
+ * big. Only arithmetic, so cheap enough to go over all the items.
+ */
+static void fit_item_size(ViewCollection *vc)
+{
+	Collection *collection = vc->collection;
+	FilerWindow *fw = vc->filer_window;
+	int width = MIN_ITEM_WIDTH;
+	int height = small_height;
+	int n = collection->number_of_items;
+	gfloat scale = .0;
+	int i;
+
+	/* Items past the one reaching the limit weren't sized at all */
+	if (collection->reached_scale != .0)
+		return;
+
+	if (n == 0 && fw->display_style != SMALL_ICONS)
+		height = ICON_HEIGHT;
+
+	for (i = 0; i < n && scale == .0; i++)
+		scale = calc_size(fw, &collection->items[i], &width, &height, n);
+
+	collection->reached_scale = scale;
+	collection_set_item_size(collection, width, height);
+}
+
 static int is_linked(FilerWindow *fw, DirItem *item)
 {
 	return !fw->right_link ? FALSE :
@@ -628,6 +792,7 @@ static void draw_item(GtkWidget *widget,
 	CollectionItem *colitem = &vc->collection->items[idx];
 	DirItem        *item = (DirItem *) colitem->data;
 	ViewData       *view = (ViewData *) colitem->view_data;
+	gboolean       selected = collection_item_selected(vc->collection, idx);
 	GdkColor       *select_colour = NULL, *type_colour;
 	GdkColor       *fg = &widget->style->fg[GTK_STATE_NORMAL];
 	Template       template;
@@ -637,6 +802,9 @@ static void draw_item(GtkWidget *widget,
 
 	g_return_if_fail(view != NULL);
 
+	if (item->base_type == TYPE_UNKNOWN && fw->directory)
+		dir_restat_first(fw->directory, item);
+
 	if (view->iconstatus == 0) {
 		if (fw->display_style == HUGE_ICONS && fw->sort_type == SORT_NAME &&
 				vc->collection->vadj->value == 0) return;
@@ -732,9 +900,12 @@ end_image:
 	cr = gdk_cairo_create(widget->window);
 	type_colour = type_get_colour(item, fg);
 
-	if (colitem->selected)
+	if (selected)
 		select_colour = &widget->style->base[fw->selection_state];
 
+	if (view->estimated)
+		queue_measure(vc);	/* Drawn with the guess until then */
+
 	if (!view->name)
 		view->name = make_layout(fw, item);
 	if (view->name_width == 0)
@@ -770,7 +941,7 @@ end_image:
 	}
 
 	draw_huge_icon(widget->window, widget->style, &template.icon, item,
-			sendi, colitem->selected, select_colour);
+			sendi, selected, select_colour);
 
 	//	g_clear_object(&(view->thumb));
 
@@ -783,11 +954,11 @@ end_image:
 				)
 			draw_dir_mark(cr, widget, &template.icon,
 					link ? &red :
-						colitem->selected ? select_colour : type_colour);
+						selected ? select_colour : type_colour);
 	}
 
 
-	fg = colitem->selected ?
+	fg = selected ?
 		&widget->style->text[fw->selection_state] : type_colour;
 
 	draw_string(cr, view->name,
@@ -1149,6 +1320,27 @@ static void view_collection_scroll_to_top(ViewIface *view)
 	gtk_adjustment_set_value(col->vadj, 0);
 }
 
+static void view_collection_get_visible_items(ViewIface *view,
+					      GPtrArray *items, int ahead)
+{
+	Collection *collection = ((ViewCollection *) view)->collection;
+	int first, last, row, col;
+
+	collection_get_visible_rows(collection, &first, &last);
+	last += (last - first + 1) * ahead;
+
+	for (row = first; row <= last; row++)
+	{
+		for (col = 0; col < collection->columns; col++)
+		{
+			int i = collection_rowcol_to_item(collection, row, col);
+
+			if (i < collection->number_of_items)
+				g_ptr_array_add(items, collection->items[i].data);
+		}
+	}
+}
+
 /* Create the handers for the View interface */
 static void view_collection_iface_init(gpointer giface, gpointer iface_data)
 {
@@ -1183,6 +1375,7 @@ static void view_collection_iface_init(gpointer giface, gpointer iface_data)
 	iface->extend_tip = view_collection_extend_tip;
 	iface->auto_scroll_callback = view_collection_auto_scroll_callback;
 	iface->scroll_to_top = view_collection_scroll_to_top;
+	iface->get_visible_items = view_collection_get_visible_items;
 }
 
 static void view_collection_extend_tip(ViewIface *view, ViewIter *iter,
@@ -1240,6 +1433,8 @@ static void size_allocate(GtkWidget *w, GtkAllocation *a, gpointer data)
 
 	col->vadj->step_increment = col->item_height;
 	col->vadj->page_increment = col->vadj->page_size;
+
+	queue_measure((ViewCollection *) data);
 }
 
 static gint coll_button_release(GtkWidget *widget,
@@ -1531,6 +1726,7 @@ static void view_collection_style_changed(ViewIface *view, int flags)
 	int		width = MIN_ITEM_WIDTH;
 	int		height = small_height;
 	int		n = col->number_of_items;
+	gboolean	estimate = estimating(col);
 
 	if (filer_window->under_init) return;
 
@@ -1564,11 +1760,19 @@ static void view_collection_style_changed(ViewIface *view, int flags)
 				(nosize = col->reached_scale == .0 &&
 				 !((ViewData *) ci->view_data)->name_width)
 		)
-			display_update_view(filer_window,
+		{
+			if (estimate && col->reached_scale == .0 &&
+					((flags & VIEW_UPDATE_NAME) || nosize))
+				display_estimate_view(filer_window,
+					(DirItem *) ci->data,
+					(ViewData *) ci->view_data);
+			else
+				display_update_view(filer_window,
 					(DirItem *) ci->data,
 					(ViewData *) ci->view_data,
 					(flags & VIEW_UPDATE_NAME) || nosize,
 					col->reached_scale != .0);
+		}
 
 		if (flags != VIEW_UPDATE_VIEWDATA && col->reached_scale == .0)
 			col->reached_scale = calc_size(filer_window, ci, &width, &height,
@@ -1578,6 +1782,9 @@ static void view_collection_style_changed(ViewIface *view, int flags)
 	if (flags != VIEW_UPDATE_VIEWDATA)
 		collection_set_item_size(col, width, height);
 
+	if (estimate)
+		queue_measure(view_collection);
+
 	reset_thumb_func(view_collection);
 
 	gtk_widget_queue_draw(GTK_WIDGET(view_collection));
@@ -1609,41 +1816,157 @@ static void view_collection_sort(ViewIface *view)
 {
 	ViewCollection	*view_collection = VIEW_COLLECTION(view);
 	FilerWindow	*filer_window = view_collection->filer_window;
+	Collection	*collection = view_collection->collection;
+	int		n = collection->number_of_items;
+	DirItem		**items = g_new(DirItem *, n);
+	guint		*perm = g_new(guint, n);
 
-	collection_qsort(view_collection->collection, sort_fn(filer_window),
-			filer_window->sort_order);
+	for (int i = 0; i < n; i++)
+		items[i] = collection->items[i].data;
+
+	if (display_sort_order(filer_window->sort_type,
+			       filer_window->sort_order, items, n, perm))
+		collection_reorder(collection, perm);
+
+	g_free(items);
+	g_free(perm);
 }
 
 
-#define PUSHWEIGHT 44
-static int oldnum, newnum, cutrest;
-static void addt(int start, ViewCollection *view)
+/* Make a job to lay out items [start, end) of the collection, in chunks.
+ * The items array mustn't be resized until layout_finish().
+ */
+static LayoutJob *layout_start(FilerWindow *fw, Collection *collection,
+			       int start, int end)
 {
-	start--; //to ignore NULL it is added 1
-	Collection *coll = view->collection;
-	FilerWindow *fw = view->filer_window;
+	LayoutJob *job = g_new(LayoutJob, 1);
+	int nprocs = g_get_num_processors();
+	int i;
+
+	job->fw = fw;
+	job->items = collection->items;
+	job->n_chunks = (end - start + LAYOUT_CHUNK - 1) / LAYOUT_CHUNK;
+	job->chunks = g_new(LayoutChunk, job->n_chunks);
+	job->refs = 1;
+	job->cut = FALSE;
+	g_mutex_init(&job->m);
+	g_cond_init(&job->done);
 
-	for (int i = start; i < newnum && i < start + PUSHWEIGHT; i++)
+	for (i = 0; i < job->n_chunks; i++)
 	{
-		CollectionItem *colitem = &coll->items[i];
-		display_update_view(fw, colitem->data, colitem->view_data, TRUE, cutrest);
+		LayoutChunk *chunk = &job->chunks[i];
+
+		chunk->job = job;
+		chunk->start = start + i * LAYOUT_CHUNK;
+		chunk->end = MIN(end, chunk->start + LAYOUT_CHUNK);
+		chunk->state = CHUNK_QUEUED;
 	}
+
+	if (nprocs == 1)
+		return job;	/* layout_wait() does them all */
+
+	if (!layout_pool)
+		layout_pool = g_thread_pool_new(layout_task, NULL,
+				nprocs, FALSE, NULL);
+
+	for (i = 0; i < job->n_chunks; i++)
+	{
+		g_atomic_int_inc(&job->refs);
+		g_thread_pool_push(layout_pool, &job->chunks[i], NULL);
+	}
+
+	return job;
 }
-static gpointer addloopt(ViewCollection *view)
+
+/* Return once the chunk is laid out. If no worker has started it yet, it
+ * is done here instead of waiting.
+ */
+static void layout_wait(LayoutChunk *chunk)
 {
-	int pross = g_get_num_processors();
-	GThreadPool *pool = g_thread_pool_new((GFunc)addt, view, pross, TRUE, NULL);
+	LayoutJob *job = chunk->job;
 
-	for (int i = oldnum; i < newnum; i += PUSHWEIGHT)
-		if (cutrest || pross == 1)
-			//pool_push is heavy
-			addt(i + 1, view);
-		else
-			g_thread_pool_push(pool, GINT_TO_POINTER(i + 1), NULL);
+	g_mutex_lock(&job->m);
+	if (chunk->state == CHUNK_QUEUED)
+	{
+		chunk->state = CHUNK_RUNNING;
+		g_mutex_unlock(&job->m);
+		layout_chunk(chunk);
+		return;
+	}
 
-	g_thread_pool_free(pool, FALSE, TRUE);
-	return NULL;
+	while (chunk->state != CHUNK_DONE)
+		g_cond_wait(&job->done, &job->m);
+	g_mutex_unlock(&job->m);
+}
+
+/* Wait for the rest of the chunks, and drop the job */
+static void layout_finish(LayoutJob *job)
+{
+	int i;
+
+	for (i = 0; i < job->n_chunks; i++)
+		layout_wait(&job->chunks[i]);
+
+	layout_unref(job);
+}
+
+/* The items have reached full size, so the names in chunks that haven't
+ * started yet can be cut instead of laid out (the rest are measured when
+ * drawn).
+ */
+static void layout_cut(LayoutJob *job)
+{
+	g_atomic_int_set(&job->cut, TRUE);
+}
+
+static void layout_chunk(LayoutChunk *chunk)
+{
+	LayoutJob *job = chunk->job;
+	gboolean cut = g_atomic_int_get(&job->cut);
+	int i;
+
+	for (i = chunk->start; i < chunk->end; i++)
+		display_update_view(job->fw, job->items[i].data,
+				job->items[i].view_data, TRUE, cut);
+
+	g_mutex_lock(&job->m);
+	chunk->state = CHUNK_DONE;
+	g_cond_broadcast(&job->done);
+	g_mutex_unlock(&job->m);
 }
+
+/* In layout_pool. The chunk may have been done by the main thread by
+ * now; it only keeps the job alive.
+ */
+static void layout_task(gpointer data, gpointer unused)
+{
+	LayoutChunk *chunk = (LayoutChunk *) data;
+	LayoutJob *job = chunk->job;
+	gboolean mine;
+
+	g_mutex_lock(&job->m);
+	mine = chunk->state == CHUNK_QUEUED;
+	if (mine)
+		chunk->state = CHUNK_RUNNING;
+	g_mutex_unlock(&job->m);
+
+	if (mine)
+		layout_chunk(chunk);
+
+	layout_unref(job);
+}
+
+static void layout_unref(LayoutJob *job)
+{
+	if (!g_atomic_int_dec_and_test(&job->refs))
+		return;
+
+	g_mutex_clear(&job->m);
+	g_cond_clear(&job->done);
+	g_free(job->chunks);
+	g_free(job);
+}
+
 static void view_collection_add_items(ViewIface *view, GPtrArray *items)
 {
 	ViewCollection	*view_collection = VIEW_COLLECTION(view);
@@ -1652,6 +1975,8 @@ static void view_collection_add_items(ViewIface *view, GPtrArray *items)
 	int old_w = collection->item_width;
 	int old_h = collection->item_height;
 	int mw = old_w, mh = old_h;
+	int oldnum, newnum;
+	gboolean cutrest;
 
 	oldnum = collection->number_of_items;
 
@@ -1669,24 +1994,69 @@ static void view_collection_add_items(ViewIface *view, GPtrArray *items)
 	newnum = collection->number_of_items;
 	cutrest = collection->reached_scale != .0;
 
-	GThread *loopt = g_thread_new("addloop", (GThreadFunc)addloopt, view_collection);
-	g_thread_yield();
-
-	if (!cutrest) for (int i = oldnum; i < newnum; i++)
+	if (estimating(collection))
 	{
-		CollectionItem *colitem = &collection->items[i];
-		ViewData *view = (ViewData *)colitem->view_data;
-		while (!view->name_width) g_thread_yield();
+		/* Guess the sizes; measure_shown() does the ones on screen */
+		for (int i = oldnum; i < newnum; i++)
+		{
+			CollectionItem *colitem = &collection->items[i];
 
-		if (.0 != (collection->reached_scale =
-				calc_size(filer_window, colitem, &mw, &mh, newnum)))
+			if (cutrest)
+			{
+				display_update_view(filer_window, colitem->data,
+						colitem->view_data, TRUE, TRUE);
+				continue;
+			}
+
+			display_estimate_view(filer_window, colitem->data,
+					colitem->view_data);
+			collection->reached_scale = calc_size(filer_window,
+					colitem, &mw, &mh, newnum);
+			cutrest = collection->reached_scale != .0;
+		}
+
+		queue_measure(view_collection);
+	}
+	else if (cutrest)
+	{
+		/* Already as big as they get; names are measured when drawn */
+		for (int i = oldnum; i < newnum; i++)
 		{
-			cutrest = 1;
-			break;
+			CollectionItem *colitem = &collection->items[i];
+
+			display_update_view(filer_window, colitem->data,
+					colitem->view_data, TRUE, TRUE);
 		}
 	}
+	else if (newnum > oldnum)
+	{
+		LayoutJob *job = layout_start(filer_window, collection,
+					      oldnum, newnum);
 
-	g_thread_join(loopt);
+		/* Size the items as their chunks come in */
+		for (int c = 0; c < job->n_chunks && !cutrest; c++)
+		{
+			LayoutChunk *chunk = &job->chunks[c];
+
+			layout_wait(chunk);
+
+			for (int i = chunk->start; i < chunk->end; i++)
+			{
+				if (.0 != (collection->reached_scale =
+						calc_size(filer_window,
+							&collection->items[i],
+							&mw, &mh, newnum)))
+				{
+					cutrest = TRUE;
+					break;
+				}
+			}
+		}
+
+		if (cutrest)
+			layout_cut(job);
+		layout_finish(job);
+	}
 
 	//D(time %f, (g_get_monotonic_time() - startt) / 1000000.0)
 
@@ -1698,7 +2068,8 @@ static void view_collection_add_items(ViewIface *view, GPtrArray *items)
 	if (oldnum != newnum)
 	{
 		gtk_widget_queue_resize(GTK_WIDGET(collection));
-		view_collection_sort(view);
+		collection_merge_sort(collection, oldnum,
+				sort_fn(filer_window), filer_window->sort_order);
 	}
 }
 
@@ -1859,7 +2230,8 @@ static DirItem *iter_init(ViewIter *iter)
 	iter->n_remaining--;
 	iter->i = i;
 
-	if (flags & VIEW_ITER_SELECTED && !collection->items[i].selected)
+	if (flags & VIEW_ITER_SELECTED &&
+	    !collection_item_selected(collection, i))
 		return iter->next(iter);
 	if (iter->flags & VIEW_ITER_DIR &&
 			((DirItem *) collection->items[i].data)->base_type != TYPE_DIRECTORY)
@@ -1898,7 +2270,7 @@ static DirItem *iter_next(ViewIter *iter)
 		g_return_val_if_fail(i >= 0 && i < n, NULL);
 
 		if (iter->flags & VIEW_ITER_SELECTED &&
-		    !collection->items[i].selected)
+		    !collection_item_selected(collection, i))
 			continue;
 
 		if (iter->flags & VIEW_ITER_DIR &&
@@ -1942,7 +2314,7 @@ static DirItem *iter_prev(ViewIter *iter)
 		g_return_val_if_fail(i >= 0 && i < n, NULL);
 
 		if (iter->flags & VIEW_ITER_SELECTED &&
-		    !collection->items[i].selected)
+		    !collection_item_selected(collection, i))
 			continue;
 
 		if (iter->flags & VIEW_ITER_DIR &&
@@ -2075,7 +2447,7 @@ static gboolean view_collection_get_selected(ViewIface *view, ViewIter *iter)
 	g_return_val_if_fail(iter->i >= 0 &&
 				iter->i < collection->number_of_items, FALSE);
 
-	return collection->items[iter->i].selected;
+	return collection_item_selected(collection, iter->i);
 }
 
 static void view_collection_select_only(ViewIface *view, ViewIter *iter)
@@ -2345,3 +2717,116 @@ static gboolean view_collection_auto_scroll_callback(ViewIface *view)
 
 	return TRUE;
 }
+
+#ifdef UNIT_TESTS
+/* n DirItems named like a big download directory, in no particular order */
+static DirItem **sort_test_items(int n)
+{
+	DirItem **items = g_new(DirItem *, n);
+	GRand *rand = g_rand_new_with_seed(42);
+
+	for (int i = 0; i < n; i++)
+	{
+		gchar *name = g_strdup_printf("file-%08x-%d.txt",
+				g_rand_int(rand), i);
+		items[i] = diritem_new(name);
+		diritem_collate_key(items[i]);
+		g_free(name);
+	}
+
+	g_rand_free(rand);
+	return items;
+}
+
+/* Add items to collection in batches as add_items() does when a directory
+ * arrives in parts, sorting after each by resorting everything or by
+ * merging in the new batch. Returns the time spent sorting.
+ */
+static gint64 add_batches(Collection *collection, DirItem **items,
+		int n, int batches, gboolean merge)
+{
+	gint64 total = 0;
+	int per = n / batches;
+
+	collection_clear(collection);
+	for (int b = 0; b < batches; b++)
+	{
+		int oldnum = collection->number_of_items;
+		gint64 start;
+
+		for (int i = b * per; i < (b + 1) * per; i++)
+			collection_insert(collection, items[i], NULL);
+
+		start = g_get_monotonic_time();
+		if (merge)
+			collection_merge_sort(collection, oldnum,
+					sort_by_name, GTK_SORT_ASCENDING);
+		else
+			collection_qsort(collection,
+					sort_by_name, GTK_SORT_ASCENDING);
+		total += g_get_monotonic_time() - start;
+	}
+
+	return total;
+}
+
+/* Merging in each batch gives the same order as resorting everything */
+void view_collection_sort_tests(void)
+{
+	int n = 2000, batches = 20;
+	DirItem **items = sort_test_items(n);
+	Collection *collection = COLLECTION(collection_new());
+	gpointer *order = g_new(gpointer, n);
+
+	g_object_ref_sink(collection);
+
+	add_batches(collection, items, n, batches, FALSE);
+	g_assert_cmpint(collection->number_of_items, ==, n);
+	for (int i = 0; i < n; i++)
+		order[i] = collection->items[i].data;
+	for (int i = 1; i < n; i++)
+		g_assert_cmpint(sort_by_name(order[i - 1], order[i]), <=, 0);
+
+	add_batches(collection, items, n, batches, TRUE);
+	g_assert_cmpint(collection->number_of_items, ==, n);
+	for (int i = 0; i < n; i++)
+		g_assert(collection->items[i].data == order[i]);
+
+	collection_clear(collection);
+	g_object_unref(collection);
+	for (int i = 0; i < n; i++)
+		diritem_free(items[i]);
+	g_free(items);
+	g_free(order);
+}
+
+/* Times the sorting done by add_items() when a directory arrives in
+ * batches: resorting everything each time, or merging in each batch.
+ * Adds $ROX_SORT_BENCH_SIZE (default 100000) items in 50 batches.
+ */
+void view_collection_sort_benchmark(void)
+{
+	const char *env_size = g_getenv("ROX_SORT_BENCH_SIZE");
+	int n = env_size ? atoi(env_size) : 100000;
+	int batches = 50;
+	Collection *collection = COLLECTION(collection_new());
+	DirItem **items;
+	gint64 qsort_time, merge_time;
+
+	n -= n % batches;
+	items = sort_test_items(n);
+	g_object_ref_sink(collection);
+
+	qsort_time = add_batches(collection, items, n, batches, FALSE);
+	merge_time = add_batches(collection, items, n, batches, TRUE);
+
+	g_print("%d items in %d batches: qsort %.1f ms, merge %.1f ms\n",
+			n, batches, qsort_time / 1000.0, merge_time / 1000.0);
+
+	collection_clear(collection);
+	g_object_unref(collection);
+	for (int i = 0; i < n; i++)
+		diritem_free(items[i]);
+	g_free(items);
+}
+#endif
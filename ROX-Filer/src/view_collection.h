@@ -16,6 +16,11 @@ typedef struct _ViewCollectionClass ViewCollectionClass;
 GtkWidget *view_collection_new(FilerWindow *filer_window);
 GType view_collection_get_type(void);
 
+#ifdef UNIT_TESTS
+void view_collection_sort_tests(void);
+void view_collection_sort_benchmark(void);
+#endif
+
 struct _ViewCollection {
 	GtkViewport viewport;
 
@@ -26,6 +31,8 @@ struct _ViewCollection {
 
 	GQueue		*thumbs_queue;
 	guint		thumb_func;
+
+	guint		measure_idle;	/* Measures estimated items shown */
 };
 
 #endif /* __VIEW_COLLECTION_H__ */
@@ -91,6 +91,8 @@ static void view_details_start_lasso_box(ViewIface *view,
 static void view_details_extend_tip(ViewIface *view,
 				    ViewIter *iter, GString *tip);
 static gboolean view_details_auto_scroll_callback(ViewIface *view);
+static void view_details_get_visible_items(ViewIface *view,
+					   GPtrArray *items, int ahead);
 
 static DirItem *iter_peek(ViewIter *iter);
 static DirItem *iter_prev(ViewIter *iter);
@@ -330,6 +332,11 @@ static void details_get_value(GtkTreeModel *tree_model,
 	if (item->base_type == TYPE_UNKNOWN)
 	{
 		GType type;
+
+		if (view_details->filer_window->directory)
+			dir_restat_first(
+				view_details->filer_window->directory, item);
+
 		type = details_get_column_type(tree_model, column);
 		g_value_init(value, type);
 		if (type == G_TYPE_STRING)
@@ -1170,6 +1177,30 @@ static void view_details_scroll_to_top(ViewIface *view)
 			0);
 }
 
+static void view_details_get_visible_items(ViewIface *view,
+					   GPtrArray *items, int ahead)
+{
+	ViewDetails *view_details = (ViewDetails *) view;
+	GtkTreePath *start, *end;
+	int first, last, i;
+
+	if (!gtk_tree_view_get_visible_range((GtkTreeView *) view,
+					     &start, &end))
+		return;
+
+	first = gtk_tree_path_get_indices(start)[0];
+	last = gtk_tree_path_get_indices(end)[0];
+	gtk_tree_path_free(start);
+	gtk_tree_path_free(end);
+
+	last += (last - first + 1) * ahead;
+	last = MIN(last, (int) view_details->items->len - 1);
+
+	for (i = first; i <= last; i++)
+		g_ptr_array_add(items,
+			((ViewItem *) view_details->items->pdata[i])->item);
+}
+
 
 #define ADD_TEXT_COLUMN_NS(name, model_column) \
 	cell = gtk_cell_renderer_text_new();	\
@@ -1308,6 +1339,7 @@ static void view_details_iface_init(gpointer giface, gpointer iface_data)
 	iface->extend_tip = view_details_extend_tip;
 	iface->auto_scroll_callback = view_details_auto_scroll_callback;
 	iface->scroll_to_top = view_details_scroll_to_top;
+	iface->get_visible_items = view_details_get_visible_items;
 }
 
 
@@ -1372,15 +1404,12 @@ static void resort(ViewDetails *view_details)
 {
 	ViewItem **items = (ViewItem **) view_details->items->pdata;
 	gint i, len = view_details->items->len;
+	DirItem **dir_items;
+	ViewItem **old;
 	guint *new_order;
 	GtkTreePath *path;
 	int wink_item = view_details->wink_item;
-
-	if (!len)
-		return;
-
-	for (i = len - 1; i >= 0; i--)
-		items[i]->old_pos = i;
+	gboolean changed;
 
 	switch (view_details->filer_window->sort_type)
 	{
@@ -1397,17 +1426,32 @@ static void resort(ViewDetails *view_details)
 			g_assert_not_reached();
 	}
 
-	g_ptr_array_sort_with_data(view_details->items,
-				   (GCompareDataFunc) wrap_sort,
-				   view_details);
+	if (!len)
+		return;
+
+	dir_items = g_new(DirItem *, len);
+	for (i = len - 1; i >= 0; i--)
+		dir_items[i] = items[i]->item;
 
 	new_order = g_new(guint, len);
+	changed = display_sort_order(view_details->filer_window->sort_type,
+				     view_details->filer_window->sort_order,
+				     dir_items, len, new_order);
+	g_free(dir_items);
+	if (!changed)
+	{
+		g_free(new_order);
+		return;
+	}
+
+	old = g_memdup(items, len * sizeof(ViewItem *));
 	for (i = len - 1; i >= 0; i--)
 	{
-		new_order[i] = items[i]->old_pos;
-		if (wink_item == items[i]->old_pos)
+		items[i] = old[new_order[i]];
+		if (wink_item == (int) new_order[i])
 			wink_item = i;
 	}
+	g_free(old);
 
 	view_details->wink_item = wink_item;
 
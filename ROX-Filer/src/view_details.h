@@ -16,7 +16,6 @@ struct _ViewItem {
 	DirItem *item;
 	MaskedPixmap *image;
 	GdkPixbuf *thumb;
-	int	old_pos;	/* Used while sorting */
 	gchar   *utf8_name;	/* NULL => leafname is valid */
 };
 
@@ -92,6 +92,7 @@ struct _ViewIfaceClass {
 	void (*extend_tip)(ViewIface *obj, ViewIter *iter, GString *tip);
 	gboolean (*auto_scroll_callback)(ViewIface *obj);
 	void (*scroll_to_top)(ViewIface *obj);
+	void (*get_visible_items)(ViewIface *obj, GPtrArray *items, int ahead);
 };
 
 #define VIEW_TYPE_IFACE           (view_iface_get_type())
@@ -152,5 +153,6 @@ void view_start_lasso_box(ViewIface *obj, GdkEventButton *event);
 void view_extend_tip(ViewIface *obj, ViewIter *iter, GString *tip);
 gboolean view_auto_scroll_callback(ViewIface *obj);
 void view_scroll_to_top(ViewIface *obj);
+void view_get_visible_items(ViewIface *obj, GPtrArray *items, int ahead);
 
 #endif /* __VIEW_IFACE_H__ */
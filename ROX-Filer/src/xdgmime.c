@@ -36,29 +36,64 @@
 #include "xdgmimealias.h"
 #include "xdgmimeparent.h"
 #include "xdgmimecache.h"
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 
 typedef struct XdgDirTimeList XdgDirTimeList;
 typedef struct XdgCallbackList XdgCallbackList;
+typedef struct XdgMimeState XdgMimeState;
 
-static int need_reread = TRUE;
 static time_t last_stat_time = 0;
 
-static XdgGlobHash *global_hash = NULL;
-static XdgMimeMagic *global_magic = NULL;
-static XdgAliasList *alias_list = NULL;
-static XdgParentList *parent_list = NULL;
-static XdgDirTimeList *dir_time_list = NULL;
 static XdgCallbackList *callback_list = NULL;
 
-XdgMimeCache **_caches = NULL;
-static int n_caches = 0;
+/* Everything loaded from the mime directories. A state is never changed
+ * once it has been loaded; when the files change, a new one replaces it.
+ * Each public function pins the current state for the calling thread
+ * (see xdg_mime_init), so lookups from several threads only share
+ * state_lock for long enough to take a reference.
+ */
+struct XdgMimeState
+{
+  int ref_count;
+  XdgGlobHash *glob_hash;
+  XdgMimeMagic *magic;
+  XdgAliasList *aliases;
+  XdgParentList *parents;
+  XdgDirTimeList *dir_times;	/* Files read, for xdg_check_dirs */
+  XdgMimeCache **caches;	/* NULL-terminated */
+  int cache_count;
+};
+
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static XdgMimeState *current_state = NULL;	/* (state_lock) */
+
+/* The state this thread is using, and how many calls deep it is */
+static __thread XdgMimeState *state = NULL;
+static __thread int state_depth = 0;
+
+#undef _caches
+#define global_hash	(state->glob_hash)
+#define global_magic	(state->magic)
+#define alias_list	(state->aliases)
+#define parent_list	(state->parents)
+#define dir_time_list	(state->dir_times)
+#define _caches		(state->caches)
+#define n_caches	(state->cache_count)
+
+XdgMimeCache **
+_xdg_mime_state_caches (void)
+{
+  return _caches;
+}
 
 const char xdg_mime_type_unknown[] = "application/octet-stream";
 const char xdg_mime_type_empty[] = "application/x-zerosize";
@@ -423,28 +458,122 @@ xdg_check_time_and_dirs (void)
   return retval;
 }
 
-/* Called in every public function.  It reloads the hash function if need be.
+static XdgMimeState *
+xdg_mime_state_load (void)
+{
+  XdgMimeState *saved = state;
+  XdgMimeState *loaded = calloc (1, sizeof (XdgMimeState));
+
+  loaded->ref_count = 1;	/* For current_state */
+
+  state = loaded;
+  global_hash = _xdg_glob_hash_new ();
+  global_magic = _xdg_mime_magic_new ();
+  alias_list = _xdg_mime_alias_list_new ();
+  parent_list = _xdg_mime_parent_list_new ();
+
+  xdg_run_command_on_dirs ((XdgDirectoryFunc) xdg_mime_init_from_directory,
+			   NULL);
+  state = saved;
+
+  return loaded;
+}
+
+static void
+xdg_mime_state_unref (XdgMimeState *old)
+{
+  int i;
+
+  if (__atomic_sub_fetch (&old->ref_count, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  xdg_dir_time_list_free (old->dir_times);
+  _xdg_glob_hash_free (old->glob_hash);
+  _xdg_mime_magic_free (old->magic);
+  _xdg_mime_alias_list_free (old->aliases);
+  _xdg_mime_parent_list_free (old->parents);
+
+  for (i = 0; i < old->cache_count; i++)
+    _xdg_mime_cache_unref (old->caches[i]);
+  free (old->caches);
+
+  free (old);
+}
+
+static void
+xdg_mime_run_callbacks (void)
+{
+  XdgCallbackList *list;
+
+  for (list = callback_list; list; list = list->next)
+    (list->callback) (list->data);
+}
+
+/* Called in every public function, paired with xdg_mime_done ().  Pins the
+ * current state for this thread, first replacing it if the files have
+ * changed.
  */
 static void
 xdg_mime_init (void)
 {
-  if (xdg_check_time_and_dirs ())
+  int reloaded = FALSE;
+
+  if (state_depth++ > 0)
+    return;
+
+  pthread_mutex_lock (&state_lock);
+
+  if (current_state)
     {
-      xdg_mime_shutdown ();
+      state = current_state;
+      if (xdg_check_time_and_dirs ())
+	{
+	  xdg_mime_state_unref (current_state);
+	  current_state = NULL;
+	  reloaded = TRUE;
+	}
     }
 
-  if (need_reread)
-    {
-      global_hash = _xdg_glob_hash_new ();
-      global_magic = _xdg_mime_magic_new ();
-      alias_list = _xdg_mime_alias_list_new ();
-      parent_list = _xdg_mime_parent_list_new ();
+  if (!current_state)
+    current_state = xdg_mime_state_load ();
 
-      xdg_run_command_on_dirs ((XdgDirectoryFunc) xdg_mime_init_from_directory,
-			       NULL);
+  state = current_state;
+  __atomic_add_fetch (&state->ref_count, 1, __ATOMIC_RELAXED);
 
-      need_reread = FALSE;
-    }
+  pthread_mutex_unlock (&state_lock);
+
+  if (reloaded)
+    xdg_mime_run_callbacks ();
+}
+
+static void
+xdg_mime_done (void)
+{
+  XdgMimeState *old = state;
+
+  assert (state_depth > 0);
+
+  if (--state_depth > 0)
+    return;
+
+  state = NULL;
+  xdg_mime_state_unref (old);
+}
+
+/* Strings returned by the lookup functions belong to the state that was
+ * current during the call. Callers that may run while the files are being
+ * reloaded can hold it across the call and their use of the result.
+ */
+void
+xdg_mime_hold (void)
+{
+  xdg_mime_init ();
+}
+
+void
+xdg_mime_release (void)
+{
+  xdg_mime_done ();
 }
 
 const char *
@@ -468,22 +597,45 @@ xdg_mime_get_mime_type_for_data (const void *data,
   else
     mime_type = _xdg_mime_magic_lookup_data (global_magic, data, len, result_prio, NULL, 0);
 
+  xdg_mime_done ();
+
   if (mime_type)
     return mime_type;
 
   return _xdg_binary_or_text_fallback(data, len);
 }
 
+static const char *
+get_mime_type_for_file (const char  *file_name,
+			struct stat *statbuf);
+
 const char *
 xdg_mime_get_mime_type_for_file (const char  *file_name,
                                  struct stat *statbuf)
 {
   const char *mime_type;
+
+  if (file_name == NULL)
+    return NULL;
+  if (! _xdg_utf8_validate (file_name))
+    return NULL;
+
+  xdg_mime_init ();
+  mime_type = get_mime_type_for_file (file_name, statbuf);
+  xdg_mime_done ();
+
+  return mime_type;
+}
+
+static const char *
+get_mime_type_for_file (const char  *file_name,
+			struct stat *statbuf)
+{
+  const char *mime_type;
   /* currently, only a few globs occur twice, and none
    * more often, so 5 seems plenty.
    */
   const char *mime_types[5];
-  FILE *file;
   unsigned char *data;
   int max_extent;
   int bytes_read;
@@ -491,13 +643,6 @@ xdg_mime_get_mime_type_for_file (const char  *file_name,
   const char *base_name;
   int n;
 
-  if (file_name == NULL)
-    return NULL;
-  if (! _xdg_utf8_validate (file_name))
-    return NULL;
-
-  xdg_mime_init ();
-
   if (_caches)
     return _xdg_mime_cache_get_mime_type_for_file (file_name, statbuf);
 
@@ -522,24 +667,9 @@ xdg_mime_get_mime_type_for_file (const char  *file_name,
    * be large and need getting from a stream instead of just reading it all
    * in. */
   max_extent = _xdg_mime_magic_get_buffer_extents (global_magic);
-  data = malloc (max_extent);
-  if (data == NULL)
+  bytes_read = _xdg_read_file_start (file_name, max_extent, &data);
+  if (bytes_read < 0)
     return XDG_MIME_TYPE_UNKNOWN;
-        
-  file = fopen (file_name, "r");
-  if (file == NULL)
-    {
-      free (data);
-      return XDG_MIME_TYPE_UNKNOWN;
-    }
-
-  bytes_read = fread (data, 1, max_extent, file);
-  if (ferror (file))
-    {
-      free (data);
-      fclose (file);
-      return XDG_MIME_TYPE_UNKNOWN;
-    }
 
   mime_type = _xdg_mime_magic_lookup_data (global_magic, data, bytes_read, NULL,
 					   mime_types, n);
@@ -548,11 +678,154 @@ xdg_mime_get_mime_type_for_file (const char  *file_name,
     mime_type = _xdg_binary_or_text_fallback (data, bytes_read);
 
   free (data);
-  fclose (file);
 
   return mime_type;
 }
 
+/* Files whose names don't settle their type are opened this many at a time */
+#define BATCH_OPEN_MAX 64
+
+typedef struct
+{
+  const char *globs[5];
+  int n_globs;
+  int fd;
+} BatchFile;
+
+static void
+get_mime_types_for_batch (int          dir_fd,
+			  const char  *file_names[],
+			  const char  *mime_types[],
+			  int          n_files,
+			  int          max_extent,
+			  unsigned char *data)
+{
+  BatchFile files[BATCH_OPEN_MAX];
+  int flags = O_RDONLY;
+  int i;
+
+#ifdef O_CLOEXEC
+  flags |= O_CLOEXEC;
+#endif
+
+  /* Names first; only open what they leave undecided, and tell the
+   * kernel about all of those before reading any, so the reads can
+   * overlap.
+   */
+  for (i = 0; i < n_files; i++)
+    {
+      BatchFile *file = &files[i];
+      const char *base_name = _xdg_get_base_name (file_names[i]);
+
+      file->fd = -1;
+      mime_types[i] = NULL;
+
+      if (! _xdg_utf8_validate (file_names[i]))
+	continue;
+
+      if (_caches)
+	file->n_globs = _xdg_mime_cache_get_mime_types_from_file_name (base_name,
+								       file->globs, 5);
+      else
+	file->n_globs = _xdg_glob_hash_lookup_file_name (global_hash, base_name,
+							 file->globs, 5);
+
+      if (file->n_globs == 1)
+	{
+	  mime_types[i] = file->globs[0];
+	  continue;
+	}
+
+      file->fd = openat (dir_fd, file_names[i], flags);
+      if (file->fd == -1)
+	{
+	  mime_types[i] = XDG_MIME_TYPE_UNKNOWN;
+	  continue;
+	}
+#ifdef POSIX_FADV_WILLNEED
+      posix_fadvise (file->fd, 0, max_extent, POSIX_FADV_WILLNEED);
+#endif
+    }
+
+  for (i = 0; i < n_files; i++)
+    {
+      BatchFile *file = &files[i];
+      const char *mime_type;
+      int bytes_read;
+
+      if (file->fd == -1)
+	continue;
+
+      bytes_read = _xdg_read_fd_start (file->fd, max_extent, data);
+      close (file->fd);
+
+      if (bytes_read < 0)
+	mime_type = XDG_MIME_TYPE_UNKNOWN;
+      else if (_caches && bytes_read == 0)
+	mime_type = XDG_MIME_TYPE_EMPTY;
+      else
+	{
+	  if (_caches)
+	    mime_type = _xdg_mime_cache_lookup_data (data, bytes_read,
+						     file->globs, file->n_globs);
+	  else
+	    mime_type = _xdg_mime_magic_lookup_data (global_magic, data, bytes_read,
+						     NULL, file->globs, file->n_globs);
+	  if (!mime_type)
+	    mime_type = _xdg_binary_or_text_fallback (data, bytes_read);
+	}
+
+      mime_types[i] = mime_type;
+    }
+}
+
+/* As xdg_mime_get_mime_type_for_file () for each of file_names, which are
+ * regular files (or links to them) in the directory open as dir_fd.  The
+ * results, which stay valid while the caller holds the database (see
+ * xdg_mime_hold ()), go in the matching elements of mime_types.
+ */
+void
+xdg_mime_get_mime_types_for_files_at (int          dir_fd,
+				      const char  *file_names[],
+				      const char  *mime_types[],
+				      int          n_files)
+{
+  unsigned char *data;
+  int max_extent;
+  int i;
+
+  xdg_mime_init ();
+
+  if (_caches)
+    max_extent = _xdg_mime_cache_get_max_buffer_extents ();
+  else
+    max_extent = _xdg_mime_magic_get_buffer_extents (global_magic);
+
+  data = malloc (max_extent > 0 ? max_extent : 1);
+
+  for (i = 0; i < n_files; i += BATCH_OPEN_MAX)
+    {
+      int n = n_files - i;
+
+      if (n > BATCH_OPEN_MAX)
+	n = BATCH_OPEN_MAX;
+
+      if (data)
+	get_mime_types_for_batch (dir_fd, file_names + i, mime_types + i, n,
+				  max_extent, data);
+      else
+	{
+	  int j;
+
+	  for (j = 0; j < n; j++)
+	    mime_types[i + j] = XDG_MIME_TYPE_UNKNOWN;
+	}
+    }
+
+  free (data);
+  xdg_mime_done ();
+}
+
 const char *
 xdg_mime_get_mime_type_from_file_name (const char *file_name)
 {
@@ -561,12 +834,13 @@ xdg_mime_get_mime_type_from_file_name (const char *file_name)
   xdg_mime_init ();
 
   if (_caches)
-    return _xdg_mime_cache_get_mime_type_from_file_name (file_name);
+    mime_type = _xdg_mime_cache_get_mime_type_from_file_name (file_name);
+  else if (!_xdg_glob_hash_lookup_file_name (global_hash, file_name, &mime_type, 1))
+    mime_type = XDG_MIME_TYPE_UNKNOWN;
 
-  if (_xdg_glob_hash_lookup_file_name (global_hash, file_name, &mime_type, 1))
-    return mime_type;
-  else
-    return XDG_MIME_TYPE_UNKNOWN;
+  xdg_mime_done ();
+
+  return mime_type;
 }
 
 int
@@ -574,12 +848,18 @@ xdg_mime_get_mime_types_from_file_name (const char *file_name,
 					const char  *mime_types[],
 					int          n_mime_types)
 {
+  int n;
+
   xdg_mime_init ();
   
   if (_caches)
-    return _xdg_mime_cache_get_mime_types_from_file_name (file_name, mime_types, n_mime_types);
-  
-  return _xdg_glob_hash_lookup_file_name (global_hash, file_name, mime_types, n_mime_types);
+    n = _xdg_mime_cache_get_mime_types_from_file_name (file_name, mime_types, n_mime_types);
+  else
+    n = _xdg_glob_hash_lookup_file_name (global_hash, file_name, mime_types, n_mime_types);
+
+  xdg_mime_done ();
+
+  return n;
 }
 
 int
@@ -590,67 +870,38 @@ xdg_mime_is_valid_mime_type (const char *mime_type)
   return _xdg_utf8_validate (mime_type);
 }
 
+/* Drops the current state, so that the files are read again by the next
+ * call.  Threads still using the old state keep it until they finish.
+ */
 void
 xdg_mime_shutdown (void)
 {
-  XdgCallbackList *list;
-
-  /* FIXME: Need to make this (and the whole library) thread safe */
-  if (dir_time_list)
-    {
-      xdg_dir_time_list_free (dir_time_list);
-      dir_time_list = NULL;
-    }
-	
-  if (global_hash)
-    {
-      _xdg_glob_hash_free (global_hash);
-      global_hash = NULL;
-    }
-  if (global_magic)
-    {
-      _xdg_mime_magic_free (global_magic);
-      global_magic = NULL;
-    }
-
-  if (alias_list)
-    {
-      _xdg_mime_alias_list_free (alias_list);
-      alias_list = NULL;
-    }
-
-  if (parent_list)
-    {
-      _xdg_mime_parent_list_free (parent_list);
-      parent_list = NULL;
-    }
-
-  if (_caches)
+  pthread_mutex_lock (&state_lock);
+  if (current_state)
     {
-      int i;
-
-      for (i = 0; i < n_caches; i++)
-        _xdg_mime_cache_unref (_caches[i]);
-      free (_caches);
-      _caches = NULL;
-      n_caches = 0;
+      xdg_mime_state_unref (current_state);
+      current_state = NULL;
     }
+  pthread_mutex_unlock (&state_lock);
 
-  for (list = callback_list; list; list = list->next)
-    (list->callback) (list->data);
-
-  need_reread = TRUE;
+  xdg_mime_run_callbacks ();
 }
 
 int
 xdg_mime_get_max_buffer_extents (void)
 {
+  int extents;
+
   xdg_mime_init ();
   
   if (_caches)
-    return _xdg_mime_cache_get_max_buffer_extents ();
+    extents = _xdg_mime_cache_get_max_buffer_extents ();
+  else
+    extents = _xdg_mime_magic_get_buffer_extents (global_magic);
+
+  xdg_mime_done ();
 
-  return _xdg_mime_magic_get_buffer_extents (global_magic);
+  return extents;
 }
 
 const char *
@@ -670,9 +921,13 @@ _xdg_mime_unalias_mime_type (const char *mime_type)
 const char *
 xdg_mime_unalias_mime_type (const char *mime_type)
 {
+  const char *unaliased;
+
   xdg_mime_init ();
+  unaliased = _xdg_mime_unalias_mime_type (mime_type);
+  xdg_mime_done ();
 
-  return _xdg_mime_unalias_mime_type (mime_type);
+  return unaliased;
 }
 
 int
@@ -694,9 +949,13 @@ int
 xdg_mime_mime_type_equal (const char *mime_a,
 			  const char *mime_b)
 {
+  int equal;
+
   xdg_mime_init ();
+  equal = _xdg_mime_mime_type_equal (mime_a, mime_b);
+  xdg_mime_done ();
 
-  return _xdg_mime_mime_type_equal (mime_a, mime_b);
+  return equal;
 }
 
 int
@@ -785,9 +1044,13 @@ int
 xdg_mime_mime_type_subclass (const char *mime,
 			     const char *base)
 {
+  int subclass;
+
   xdg_mime_init ();
+  subclass = _xdg_mime_mime_type_subclass (mime, base);
+  xdg_mime_done ();
 
-  return _xdg_mime_mime_type_subclass (mime, base);
+  return subclass;
 }
 
 char **
@@ -797,13 +1060,22 @@ xdg_mime_list_mime_parents (const char *mime)
   char **result;
   int i, n;
 
+  xdg_mime_init ();
+
   if (_caches)
-    return _xdg_mime_cache_list_mime_parents (mime);
+    {
+      result = _xdg_mime_cache_list_mime_parents (mime);
+      xdg_mime_done ();
+      return result;
+    }
 
   parents = xdg_mime_get_mime_parents (mime);
 
   if (!parents)
-    return NULL;
+    {
+      xdg_mime_done ();
+      return NULL;
+    }
 
   for (i = 0; parents[i]; i++) ;
   
@@ -811,6 +1083,8 @@ xdg_mime_list_mime_parents (const char *mime)
   result = (char **) malloc (n);
   memcpy (result, parents, n);
 
+  xdg_mime_done ();
+
   return result;
 }
 
@@ -818,12 +1092,16 @@ const char **
 xdg_mime_get_mime_parents (const char *mime)
 {
   const char *umime;
+  const char **parents;
 
   xdg_mime_init ();
 
   umime = _xdg_mime_unalias_mime_type (mime);
+  parents = _xdg_mime_parent_list_lookup (parent_list, umime);
+
+  xdg_mime_done ();
 
-  return _xdg_mime_parent_list_lookup (parent_list, umime);
+  return parents;
 }
 
 void 
@@ -841,6 +1119,8 @@ xdg_mime_dump (void)
   _xdg_glob_hash_dump (global_hash);
   printf ("\n*** GLOBS REVERSE TREE ***\n\n");
   _xdg_mime_cache_glob_dump ();
+
+  xdg_mime_done ();
 }
 
 
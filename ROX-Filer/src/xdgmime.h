@@ -53,6 +53,7 @@ typedef void (*XdgMimeDestroy)  (void *user_data);
 #ifdef XDG_PREFIX
 #define xdg_mime_get_mime_type_for_data       XDG_ENTRY(get_mime_type_for_data)
 #define xdg_mime_get_mime_type_for_file       XDG_ENTRY(get_mime_type_for_file)
+#define xdg_mime_get_mime_types_for_files_at  XDG_ENTRY(get_mime_types_for_files_at)
 #define xdg_mime_get_mime_type_from_file_name XDG_ENTRY(get_mime_type_from_file_name)
 #define xdg_mime_get_mime_types_from_file_name XDG_ENTRY(get_mime_types_from_file_name)
 #define xdg_mime_is_valid_mime_type           XDG_ENTRY(is_valid_mime_type)
@@ -64,6 +65,8 @@ typedef void (*XdgMimeDestroy)  (void *user_data);
 #define xdg_mime_unalias_mime_type            XDG_ENTRY(unalias_mime_type)
 #define xdg_mime_get_max_buffer_extents       XDG_ENTRY(get_max_buffer_extents)
 #define xdg_mime_shutdown                     XDG_ENTRY(shutdown)
+#define xdg_mime_hold                         XDG_ENTRY(hold)
+#define xdg_mime_release                      XDG_ENTRY(release)
 #define xdg_mime_dump                         XDG_ENTRY(dump)
 #define xdg_mime_register_reload_callback     XDG_ENTRY(register_reload_callback)
 #define xdg_mime_remove_callback              XDG_ENTRY(remove_callback)
@@ -90,6 +93,10 @@ const char  *xdg_mime_get_mime_type_for_data       (const void *data,
 						    int        *result_prio);
 const char  *xdg_mime_get_mime_type_for_file       (const char *file_name,
                                                     struct stat *statbuf);
+void         xdg_mime_get_mime_types_for_files_at  (int          dir_fd,
+						    const char  *file_names[],
+						    const char  *mime_types[],
+						    int          n_files);
 const char  *xdg_mime_get_mime_type_from_file_name (const char *file_name);
 int          xdg_mime_get_mime_types_from_file_name(const char *file_name,
 						    const char *mime_types[],
@@ -113,6 +120,8 @@ const char  *xdg_mime_get_icon                     (const char *mime);
 const char  *xdg_mime_get_generic_icon             (const char *mime);
 int          xdg_mime_get_max_buffer_extents       (void);
 void         xdg_mime_shutdown                     (void);
+void         xdg_mime_hold                         (void);
+void         xdg_mime_release                      (void);
 void         xdg_mime_dump                         (void);
 int          xdg_mime_register_reload_callback     (XdgMimeCallback  callback,
 						    void            *data,
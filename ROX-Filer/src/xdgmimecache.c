@@ -50,6 +50,7 @@
 
 #include "xdgmimecache.h"
 #include "xdgmimeint.h"
+#include "xdgmimemagic.h"
 
 #ifndef MAX
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
@@ -82,6 +83,8 @@ struct _XdgMimeCache
 
   size_t  size;
   char   *buffer;
+
+  XdgMimeMagic *magic;	/* The magic section, compiled */
 };
 
 #define GET_UINT16(cache,offset) (ntohs(*(xdg_uint16_t*)((cache) + (offset))))
@@ -101,6 +104,7 @@ _xdg_mime_cache_unref (XdgMimeCache *cache)
 
   if (cache->ref_count == 0)
     {
+      _xdg_mime_magic_free (cache->magic);
 #ifdef HAVE_MMAP
       munmap (cache->buffer, cache->size);
 #endif
@@ -108,6 +112,10 @@ _xdg_mime_cache_unref (XdgMimeCache *cache)
     }
 }
 
+#ifdef HAVE_MMAP
+static XdgMimeMagic *cache_magic_compile (XdgMimeCache *cache);
+#endif
+
 XdgMimeCache *
 _xdg_mime_cache_new_from_file (const char *file_name)
 {
@@ -151,6 +159,7 @@ _xdg_mime_cache_new_from_file (const char *file_name)
   cache->ref_count = 1;
   cache->buffer = buffer;
   cache->size = st.st_size;
+  cache->magic = cache_magic_compile (cache);
 
  done:
   if (fd != -1)
@@ -161,153 +170,75 @@ _xdg_mime_cache_new_from_file (const char *file_name)
   return cache;
 }
 
-static int
-cache_magic_matchlet_compare_to_data (XdgMimeCache *cache, 
-				      xdg_uint32_t  offset,
-				      const void   *data,
-				      size_t        len)
+#ifdef HAVE_MMAP
+/* Adds the matchlet at offset to the match being built, followed by its
+ * children one level further in.
+ */
+static void
+cache_magic_add_matchlet (XdgMimeCache *cache,
+			  XdgMimeMagic *magic,
+			  xdg_uint32_t  offset,
+			  int           indent)
 {
   xdg_uint32_t range_start = GET_UINT32 (cache->buffer, offset);
   xdg_uint32_t range_length = GET_UINT32 (cache->buffer, offset + 4);
   xdg_uint32_t data_length = GET_UINT32 (cache->buffer, offset + 12);
   xdg_uint32_t data_offset = GET_UINT32 (cache->buffer, offset + 16);
   xdg_uint32_t mask_offset = GET_UINT32 (cache->buffer, offset + 20);
-  
-  int i, j;
-
-  for (i = range_start; i < range_start + range_length; i++)
-    {
-      int valid_matchlet = TRUE;
-      
-      if (i + data_length > len)
-	return FALSE;
-
-      if (mask_offset)
-	{
-	  for (j = 0; j < data_length; j++)
-	    {
-	      if ((((unsigned char *)cache->buffer)[data_offset + j] & ((unsigned char *)cache->buffer)[mask_offset + j]) !=
-		  ((((unsigned char *) data)[j + i]) & ((unsigned char *)cache->buffer)[mask_offset + j]))
-		{
-		  valid_matchlet = FALSE;
-		  break;
-		}
-	    }
-	}
-      else
-	{
-	  valid_matchlet = memcmp(cache->buffer + data_offset, (unsigned char *)data + i, data_length) == 0;
-	}
-
-      if (valid_matchlet)
-	return TRUE;
-    }
-  
-  return FALSE;  
-}
-
-static int
-cache_magic_matchlet_compare (XdgMimeCache *cache, 
-			      xdg_uint32_t  offset,
-			      const void   *data,
-			      size_t        len)
-{
   xdg_uint32_t n_children = GET_UINT32 (cache->buffer, offset + 24);
   xdg_uint32_t child_offset = GET_UINT32 (cache->buffer, offset + 28);
 
   int i;
-  
-  if (cache_magic_matchlet_compare_to_data (cache, offset, data, len))
-    {
-      if (n_children == 0)
-	return TRUE;
-      
-      for (i = 0; i < n_children; i++)
-	{
-	  if (cache_magic_matchlet_compare (cache, child_offset + 32 * i,
-					    data, len))
-	    return TRUE;
-	}
-    }
-  
-  return FALSE;  
-}
 
-static const char *
-cache_magic_compare_to_data (XdgMimeCache *cache, 
-			     xdg_uint32_t  offset,
-			     const void   *data, 
-			     size_t        len, 
-			     int          *prio)
-{
-  xdg_uint32_t priority = GET_UINT32 (cache->buffer, offset);
-  xdg_uint32_t mimetype_offset = GET_UINT32 (cache->buffer, offset + 4);
-  xdg_uint32_t n_matchlets = GET_UINT32 (cache->buffer, offset + 8);
-  xdg_uint32_t matchlet_offset = GET_UINT32 (cache->buffer, offset + 12);
+  _xdg_mime_magic_add_matchlet (magic, indent, range_start, range_length,
+				data_length,
+				(unsigned char *) cache->buffer + data_offset,
+				mask_offset ? (unsigned char *) cache->buffer +
+					      mask_offset : NULL);
 
-  int i;
-
-  for (i = 0; i < n_matchlets; i++)
-    {
-      if (cache_magic_matchlet_compare (cache, matchlet_offset + i * 32, 
-					data, len))
-	{
-	  *prio = priority;
-	  
-	  return cache->buffer + mimetype_offset;
-	}
-    }
-
-  return NULL;
+  for (i = 0; i < n_children; i++)
+    cache_magic_add_matchlet (cache, magic, child_offset + 32 * i,
+			      indent + 1);
 }
 
-static const char *
-cache_magic_lookup_data (XdgMimeCache *cache, 
-			 const void   *data, 
-			 size_t        len, 
-			 int          *prio,
-			 const char   *mime_types[],
-			 int           n_mime_types)
+/* The matchlets in the cache form a tree for each match.  Rather than
+ * walking it for every file, load it into the same compiled table used for
+ * the magic file.
+ */
+static XdgMimeMagic *
+cache_magic_compile (XdgMimeCache *cache)
 {
+  XdgMimeMagic *magic;
   xdg_uint32_t list_offset;
   xdg_uint32_t n_entries;
   xdg_uint32_t offset;
 
-  int j, n;
+  int i, j;
 
-  *prio = 0;
+  magic = _xdg_mime_magic_new ();
 
   list_offset = GET_UINT32 (cache->buffer, 24);
   n_entries = GET_UINT32 (cache->buffer, list_offset);
   offset = GET_UINT32 (cache->buffer, list_offset + 8);
-  
+
   for (j = 0; j < n_entries; j++)
     {
-      const char *match;
-
-      match = cache_magic_compare_to_data (cache, offset + 16 * j, 
-					   data, len, prio);
-      if (match)
-	return match;
-      else
-	{
-	  xdg_uint32_t mimetype_offset;
-	  const char *non_match;
-	  
-	  mimetype_offset = GET_UINT32 (cache->buffer, offset + 16 * j + 4);
-	  non_match = cache->buffer + mimetype_offset;
-
-	  for (n = 0; n < n_mime_types; n++)
-	    {
-	      if (mime_types[n] && 
-		  _xdg_mime_mime_type_equal (mime_types[n], non_match))
-		mime_types[n] = NULL;
-	    }
-	}
+      xdg_uint32_t priority = GET_UINT32 (cache->buffer, offset + 16 * j);
+      xdg_uint32_t mimetype_offset = GET_UINT32 (cache->buffer, offset + 16 * j + 4);
+      xdg_uint32_t n_matchlets = GET_UINT32 (cache->buffer, offset + 16 * j + 8);
+      xdg_uint32_t matchlet_offset = GET_UINT32 (cache->buffer, offset + 16 * j + 12);
+
+      _xdg_mime_magic_add_match (magic, cache->buffer + mimetype_offset,
+				 priority);
+      for (i = 0; i < n_matchlets; i++)
+	cache_magic_add_matchlet (cache, magic, matchlet_offset + i * 32, 0);
     }
 
-  return NULL;
+  _xdg_mime_magic_finish (magic);
+
+  return magic;
 }
+#endif  /* HAVE_MMAP */
 
 static const char *
 cache_alias_lookup (const char *alias)
@@ -676,8 +607,8 @@ cache_get_mime_type_for_data (const void *data,
       int prio;
       const char *match;
 
-      match = cache_magic_lookup_data (cache, data, len, &prio, 
-				       mime_types, n_mime_types);
+      match = _xdg_mime_magic_lookup_data (cache->magic, data, len, &prio,
+					   mime_types, n_mime_types);
       if (prio > priority)
 	{
 	  priority = prio;
@@ -719,13 +650,23 @@ _xdg_mime_cache_get_mime_type_for_data (const void *data,
   return cache_get_mime_type_for_data (data, len, result_prio, NULL, 0);
 }
 
+/* As above, choosing between the glob results given */
+const char *
+_xdg_mime_cache_lookup_data (const void *data,
+			     size_t      len,
+			     const char *mime_types[],
+			     int         n_mime_types)
+{
+  return cache_get_mime_type_for_data (data, len, NULL,
+				       mime_types, n_mime_types);
+}
+
 const char *
 _xdg_mime_cache_get_mime_type_for_file (const char  *file_name,
 					struct stat *statbuf)
 {
   const char *mime_type;
   const char *mime_types[10];
-  FILE *file;
   unsigned char *data;
   int max_extent;
   int bytes_read;
@@ -763,24 +704,9 @@ _xdg_mime_cache_get_mime_type_for_file (const char  *file_name,
    * be large and need getting from a stream instead of just reading it all
    * in. */
   max_extent = _xdg_mime_cache_get_max_buffer_extents ();
-  data = malloc (max_extent);
-  if (data == NULL)
+  bytes_read = _xdg_read_file_start (file_name, max_extent, &data);
+  if (bytes_read < 0)
     return XDG_MIME_TYPE_UNKNOWN;
-        
-  file = fopen (file_name, "r");
-  if (file == NULL)
-    {
-      free (data);
-      return XDG_MIME_TYPE_UNKNOWN;
-    }
-
-  bytes_read = fread (data, 1, max_extent, file);
-  if (ferror (file))
-    {
-      free (data);
-      fclose (file);
-      return XDG_MIME_TYPE_UNKNOWN;
-    }
 
   mime_type = cache_get_mime_type_for_data (data, bytes_read, NULL,
 					    mime_types, n);
@@ -789,7 +715,6 @@ _xdg_mime_cache_get_mime_type_for_file (const char  *file_name,
     mime_type = _xdg_binary_or_text_fallback (data, bytes_read);
 
   free (data);
-  fclose (file);
 
   return mime_type;
 }
@@ -37,6 +37,7 @@ typedef struct _XdgMimeCache XdgMimeCache;
 #define _xdg_mime_cache_unref                         XDG_RESERVED_ENTRY(cache_unref)
 #define _xdg_mime_cache_get_max_buffer_extents        XDG_RESERVED_ENTRY(cache_get_max_buffer_extents)
 #define _xdg_mime_cache_get_mime_type_for_data        XDG_RESERVED_ENTRY(cache_get_mime_type_for_data)
+#define _xdg_mime_cache_lookup_data                   XDG_RESERVED_ENTRY(cache_lookup_data)
 #define _xdg_mime_cache_get_mime_type_for_file        XDG_RESERVED_ENTRY(cache_get_mime_type_for_file)
 #define _xdg_mime_cache_get_mime_type_from_file_name  XDG_RESERVED_ENTRY(cache_get_mime_type_from_file_name)
 #define _xdg_mime_cache_get_mime_types_from_file_name XDG_RESERVED_ENTRY(cache_get_mime_types_from_file_name)
@@ -46,9 +47,12 @@ typedef struct _XdgMimeCache XdgMimeCache;
 #define _xdg_mime_cache_get_icon                      XDG_RESERVED_ENTRY(cache_get_icon)
 #define _xdg_mime_cache_get_generic_icon              XDG_RESERVED_ENTRY(cache_get_generic_icon)
 #define _xdg_mime_cache_glob_dump                     XDG_RESERVED_ENTRY(cache_glob_dump)
+#define _xdg_mime_state_caches                        XDG_RESERVED_ENTRY(state_caches)
 #endif
 
-extern XdgMimeCache **_caches;
+/* The caches of the state the calling thread is using (see xdgmime.c) */
+XdgMimeCache **_xdg_mime_state_caches (void);
+#define _caches (_xdg_mime_state_caches ())
 
 XdgMimeCache *_xdg_mime_cache_new_from_file (const char   *file_name);
 XdgMimeCache *_xdg_mime_cache_ref           (XdgMimeCache *cache);
@@ -58,6 +62,10 @@ void          _xdg_mime_cache_unref         (XdgMimeCache *cache);
 const char  *_xdg_mime_cache_get_mime_type_for_data       (const void *data,
 		 				           size_t      len,
 							   int        *result_prio);
+const char  *_xdg_mime_cache_lookup_data                  (const void *data,
+							   size_t      len,
+							   const char *mime_types[],
+							   int         n_mime_types);
 const char  *_xdg_mime_cache_get_mime_type_for_file       (const char  *file_name,
 							   struct stat *statbuf);
 int          _xdg_mime_cache_get_mime_types_from_file_name (const char *file_name,
@@ -31,7 +31,11 @@
 
 #include "xdgmimeint.h"
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #ifndef	FALSE
 #define	FALSE	(0)
@@ -204,3 +208,72 @@ _xdg_binary_or_text_fallback(const void *data, size_t len)
 
   return XDG_MIME_TYPE_TEXTPLAIN;
 }
+
+/* Reads up to max_extent bytes from the start of fd, whatever its current
+ * position.  Returns the number read, or -1 on error.
+ */
+int
+_xdg_read_fd_start (int            fd,
+		    int            max_extent,
+		    unsigned char *data)
+{
+  int got = 0;
+
+  while (got < max_extent)
+    {
+      ssize_t n = pread (fd, data + got, max_extent - got, got);
+
+      if (n == 0)
+	break;
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      got += n;
+    }
+
+  return got;
+}
+
+/* Reads up to max_extent bytes from the start of file_name into a new
+ * buffer, which the caller frees.  Returns the number of bytes read (fewer
+ * for short files), or -1 on error, when *data is NULL.
+ */
+int
+_xdg_read_file_start (const char     *file_name,
+		      int             max_extent,
+		      unsigned char **data)
+{
+  int fd;
+  int got;
+  int flags = O_RDONLY;
+
+#ifdef O_CLOEXEC
+  flags |= O_CLOEXEC;
+#endif
+
+  *data = malloc (max_extent > 0 ? max_extent : 1);
+  if (*data == NULL)
+    return -1;
+
+  fd = open (file_name, flags);
+  if (fd == -1)
+    {
+      free (*data);
+      *data = NULL;
+      return -1;
+    }
+
+  got = _xdg_read_fd_start (fd, max_extent, *data);
+  close (fd);
+
+  if (got < 0)
+    {
+      free (*data);
+      *data = NULL;
+    }
+
+  return got;
+}
@@ -53,6 +53,8 @@ typedef unsigned int   xdg_uint32_t;
 #define _xdg_get_base_name   XDG_RESERVED_ENTRY(get_base_name)
 #define _xdg_convert_to_ucs4 XDG_RESERVED_ENTRY(convert_to_ucs4)
 #define _xdg_reverse_ucs4    XDG_RESERVED_ENTRY(reverse_ucs4)
+#define _xdg_read_file_start XDG_RESERVED_ENTRY(read_file_start)
+#define _xdg_read_fd_start   XDG_RESERVED_ENTRY(read_fd_start)
 #endif
 
 #define SWAP_BE16_TO_LE16(val) (xdg_uint16_t)(((xdg_uint16_t)(val) << 8)|((xdg_uint16_t)(val) >> 8))
@@ -74,5 +76,11 @@ xdg_unichar_t *_xdg_convert_to_ucs4 (const char *source, int *len);
 void           _xdg_reverse_ucs4 (xdg_unichar_t *source, int len);
 const char    *_xdg_get_base_name (const char    *file_name);
 const char    *_xdg_binary_or_text_fallback(const void *data, size_t len);
+int            _xdg_read_file_start (const char     *file_name,
+				     int             max_extent,
+				     unsigned char **data);
+int            _xdg_read_fd_start   (int             fd,
+				     int             max_extent,
+				     unsigned char  *data);
 
 #endif /* __XDG_MIME_INT_H__ */
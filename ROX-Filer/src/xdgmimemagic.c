@@ -38,6 +38,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 
 #ifndef	FALSE
 #define	FALSE	(0)
@@ -84,10 +85,62 @@ struct XdgMimeMagicMatchlet
 };
 
 
+/* Once loaded, the matches are compiled into flat arrays, so that a
+ * lookup walks contiguous memory rather than the lists above.  Matchlets
+ * become rules, in the same order, with the values and masks copied into
+ * one block of bytes.
+ */
+typedef struct XdgMagicRule XdgMagicRule;
+typedef struct XdgMagicEntry XdgMagicEntry;
+typedef struct XdgMagicTable XdgMagicTable;
+
+#define NO_MASK ((unsigned int) -1)
+
+struct XdgMagicRule
+{
+  unsigned int indent;
+  unsigned int offset;
+  unsigned int range_length;
+  unsigned int value_length;
+  unsigned int value;		/* Index into bytes */
+  unsigned int mask;		/* Index into bytes, or NO_MASK */
+  unsigned int skip;		/* Next rule with the same indent or less */
+};
+
+struct XdgMagicEntry
+{
+  const char *mime_type;	/* Belongs to the XdgMimeMagicMatch */
+  int priority;
+  unsigned int first_rule;
+  unsigned int end_rule;
+};
+
+/* Most entries test a few bytes at a fixed position, often 0.  Those
+ * whose top-level rules are all like that are indexed by the byte found
+ * there, for the MAGIC_INDEX_OFFSETS most common positions, so a file
+ * is only checked against entries that could match it.
+ */
+#define MAGIC_INDEX_OFFSETS 4
+
+struct XdgMagicTable
+{
+  XdgMagicRule *rules;
+  XdgMagicEntry *entries;	/* In priority order */
+  unsigned char *bytes;
+  unsigned int n_entries;
+  unsigned int n_words;		/* In each bitmap of entries */
+  unsigned int n_offsets;
+  unsigned int offsets[MAGIC_INDEX_OFFSETS];
+  uint64_t *by_byte;		/* [n_offsets][256][n_words] */
+  uint64_t *unindexed;		/* [n_words], to always check */
+};
+
 struct XdgMimeMagic
 {
   XdgMimeMagicMatch *match_list;
   int max_extent;
+  XdgMagicTable *table;
+  XdgMimeMagicMatch *adding;	/* See _xdg_mime_magic_add_match () */
 };
 
 static XdgMimeMagicMatch *
@@ -519,85 +572,338 @@ _xdg_mime_magic_parse_magic_line (FILE              *magic_file,
   return XDG_MIME_MAGIC_ERROR;
 }
 
+static void
+_xdg_magic_table_free (XdgMagicTable *table)
+{
+  if (table == NULL)
+    return;
+
+  free (table->rules);
+  free (table->entries);
+  free (table->bytes);
+  free (table->by_byte);
+  free (table->unindexed);
+  free (table);
+}
+
+/* TRUE if the matchlet tests one position, and its first byte is compared
+ * whole.
+ */
+static int
+_xdg_magic_matchlet_indexable (XdgMimeMagicMatchlet *matchlet)
+{
+  return matchlet->range_length == 1 && matchlet->value_length > 0 &&
+	 (matchlet->mask == NULL || matchlet->mask[0] == 0xff);
+}
+
 static int
-_xdg_mime_magic_matchlet_compare_to_data (XdgMimeMagicMatchlet *matchlet,
-					  const void           *data,
-					  size_t                len)
+_xdg_magic_offset_index (XdgMagicTable *table,
+			 unsigned int   offset)
+{
+  unsigned int i;
+
+  for (i = 0; i < table->n_offsets; i++)
+    if (table->offsets[i] == offset)
+      return i;
+
+  return -1;
+}
+
+/* Picks the MAGIC_INDEX_OFFSETS positions tested by the most top-level
+ * indexable matchlets.
+ */
+static void
+_xdg_magic_choose_offsets (XdgMimeMagic  *mime_magic,
+			   XdgMagicTable *table)
 {
-  int i, j;
-  for (i = matchlet->offset; i < matchlet->offset + matchlet->range_length; i++)
+  unsigned int *offsets = NULL, *counts = NULL;
+  unsigned int n = 0, i, j;
+  XdgMimeMagicMatch *match;
+  XdgMimeMagicMatchlet *matchlet;
+
+  for (match = mime_magic->match_list; match; match = match->next)
+    for (matchlet = match->matchlet; matchlet; matchlet = matchlet->next)
+      {
+	if (matchlet->indent != 0 || !_xdg_magic_matchlet_indexable (matchlet))
+	  continue;
+
+	for (i = 0; i < n && offsets[i] != matchlet->offset; i++)
+	  ;
+	if (i == n)
+	  {
+	    offsets = realloc (offsets, sizeof (unsigned int) * (n + 1));
+	    counts = realloc (counts, sizeof (unsigned int) * (n + 1));
+	    offsets[n] = matchlet->offset;
+	    counts[n++] = 0;
+	  }
+	counts[i]++;
+      }
+
+  table->n_offsets = 0;
+  while (table->n_offsets < MAGIC_INDEX_OFFSETS)
     {
-      int valid_matchlet = TRUE;
+      unsigned int best = 0;
+
+      for (i = 0, j = n; i < n; i++)
+	if (counts[i] > best)
+	  {
+	    best = counts[i];
+	    j = i;
+	  }
+      if (j == n)
+	break;
 
-      if (i + matchlet->value_length > len)
-	return FALSE;
+      table->offsets[table->n_offsets++] = offsets[j];
+      counts[j] = 0;
+    }
 
-      if (matchlet->mask)
+  free (offsets);
+  free (counts);
+}
+
+static void
+_xdg_magic_table_set (uint64_t     *bitmap,
+		      unsigned int  entry)
+{
+  bitmap[entry / 64] |= (uint64_t) 1 << (entry % 64);
+}
+
+static void
+_xdg_mime_magic_compile (XdgMimeMagic *mime_magic)
+{
+  XdgMagicTable *table;
+  XdgMimeMagicMatch *match;
+  XdgMimeMagicMatchlet *matchlet;
+  unsigned int n_entries = 0, n_rules = 0, n_bytes = 0;
+  unsigned int e, r, b;
+
+  _xdg_magic_table_free (mime_magic->table);
+  mime_magic->table = NULL;
+
+  for (match = mime_magic->match_list; match; match = match->next)
+    {
+      n_entries++;
+      for (matchlet = match->matchlet; matchlet; matchlet = matchlet->next)
 	{
-	  for (j = 0; j < matchlet->value_length; j++)
-	    {
-	      if ((matchlet->value[j] & matchlet->mask[j]) !=
-		  ((((unsigned char *) data)[j + i]) & matchlet->mask[j]))
-		{
-		  valid_matchlet = FALSE;
-		  break;
-		}
-	    }
+	  n_rules++;
+	  n_bytes += matchlet->value_length * (matchlet->mask ? 2 : 1);
 	}
-      else
+    }
+
+  if (n_entries == 0)
+    return;
+
+  table = calloc (1, sizeof (XdgMagicTable));
+  table->n_entries = n_entries;
+  table->n_words = (n_entries + 63) / 64;
+  table->entries = malloc (sizeof (XdgMagicEntry) * n_entries);
+  table->rules = malloc (sizeof (XdgMagicRule) * (n_rules ? n_rules : 1));
+  table->bytes = malloc (n_bytes ? n_bytes : 1);
+
+  e = r = b = 0;
+  for (match = mime_magic->match_list; match; match = match->next, e++)
+    {
+      XdgMagicEntry *entry = &table->entries[e];
+      unsigned int k;
+
+      entry->mime_type = match->mime_type;
+      entry->priority = match->priority;
+      entry->first_rule = r;
+
+      for (matchlet = match->matchlet; matchlet; matchlet = matchlet->next, r++)
 	{
-	  for (j = 0; j <  matchlet->value_length; j++)
+	  XdgMagicRule *rule = &table->rules[r];
+
+	  rule->indent = matchlet->indent;
+	  rule->offset = matchlet->offset;
+	  rule->range_length = matchlet->range_length;
+	  rule->value_length = matchlet->value_length;
+
+	  rule->value = b;
+	  memcpy (table->bytes + b, matchlet->value, matchlet->value_length);
+	  b += matchlet->value_length;
+
+	  rule->mask = NO_MASK;
+	  if (matchlet->mask)
 	    {
-	      if (matchlet->value[j] != ((unsigned char *) data)[j + i])
-		{
-		  valid_matchlet = FALSE;
-		  break;
-		}
+	      rule->mask = b;
+	      memcpy (table->bytes + b, matchlet->mask, matchlet->value_length);
+	      b += matchlet->value_length;
 	    }
 	}
-      if (valid_matchlet)
+      entry->end_rule = r;
+
+      for (k = entry->first_rule; k < entry->end_rule; k++)
+	{
+	  unsigned int skip = k + 1;
+
+	  while (skip < entry->end_rule &&
+		 table->rules[skip].indent > table->rules[k].indent)
+	    skip++;
+	  table->rules[k].skip = skip;
+	}
+    }
+
+  _xdg_magic_choose_offsets (mime_magic, table);
+  table->by_byte = calloc ((size_t) table->n_offsets * 256 * table->n_words,
+			   sizeof (uint64_t));
+  table->unindexed = calloc (table->n_words, sizeof (uint64_t));
+
+  e = 0;
+  for (match = mime_magic->match_list; match; match = match->next, e++)
+    {
+      int indexable = match->matchlet != NULL;
+
+      for (matchlet = match->matchlet; matchlet && indexable; matchlet = matchlet->next)
+	if (matchlet->indent == 0 &&
+	    (!_xdg_magic_matchlet_indexable (matchlet) ||
+	     _xdg_magic_offset_index (table, matchlet->offset) < 0))
+	  indexable = FALSE;
+
+      if (!indexable)
+	{
+	  _xdg_magic_table_set (table->unindexed, e);
+	  continue;
+	}
+
+      for (matchlet = match->matchlet; matchlet; matchlet = matchlet->next)
+	{
+	  int o;
+
+	  if (matchlet->indent != 0)
+	    continue;
+
+	  o = _xdg_magic_offset_index (table, matchlet->offset);
+	  _xdg_magic_table_set (table->by_byte +
+				((size_t) o * 256 + matchlet->value[0]) * table->n_words,
+				e);
+	}
+    }
+
+  mime_magic->table = table;
+}
+
+static int
+_xdg_magic_masked_equal (const unsigned char *data,
+			 const unsigned char *value,
+			 const unsigned char *mask,
+			 unsigned int         n)
+{
+  uint64_t d, v, m;
+
+  for (; n >= 8; n -= 8, data += 8, value += 8, mask += 8)
+    {
+      memcpy (&d, data, 8);
+      memcpy (&v, value, 8);
+      memcpy (&m, mask, 8);
+      if ((d ^ v) & m)
+	return FALSE;
+    }
+
+  for (; n; n--, data++, value++, mask++)
+    if ((*data ^ *value) & *mask)
+      return FALSE;
+
+  return TRUE;
+}
+
+static int
+_xdg_magic_rule_matches (const XdgMagicTable *table,
+			 const XdgMagicRule  *rule,
+			 const unsigned char *data,
+			 size_t               len)
+{
+  const unsigned char *value = table->bytes + rule->value;
+  size_t pos, last;
+
+  if ((size_t) rule->offset + rule->value_length > len)
+    return FALSE;
+
+  /* The last position the value could start at */
+  last = (size_t) rule->offset + rule->range_length - 1;
+  if (last > len - rule->value_length)
+    last = len - rule->value_length;
+
+  if (rule->mask == NO_MASK)
+    {
+      const unsigned char *p = data + rule->offset;
+      const unsigned char *end = data + last;
+
+      if (rule->value_length == 0)
 	return TRUE;
+
+      if (p == end)
+	return memcmp (p, value, rule->value_length) == 0;
+
+      /* Let memchr() find the places worth comparing */
+      while (p <= end)
+	{
+	  p = memchr (p, value[0], end - p + 1);
+	  if (p == NULL)
+	    return FALSE;
+	  if (memcmp (p, value, rule->value_length) == 0)
+	    return TRUE;
+	  p++;
+	}
+      return FALSE;
     }
+
+  for (pos = rule->offset; pos <= last; pos++)
+    if (_xdg_magic_masked_equal (data + pos, value, table->bytes + rule->mask,
+				 rule->value_length))
+      return TRUE;
+
   return FALSE;
 }
 
+/* As the old matchlet tree walk: a rule matches if it does and either
+ * it has no children or one of them matches.
+ */
 static int
-_xdg_mime_magic_matchlet_compare_level (XdgMimeMagicMatchlet *matchlet,
-					const void           *data,
-					size_t                len,
-					int                   indent)
+_xdg_magic_rules_match (const XdgMagicTable *table,
+			unsigned int         k,
+			unsigned int         end,
+			const unsigned char *data,
+			size_t               len,
+			unsigned int         indent)
 {
-  while ((matchlet != NULL) && (matchlet->indent == indent))
+  const XdgMagicRule *rules = table->rules;
+
+  while (k < end && rules[k].indent == indent)
     {
-      if (_xdg_mime_magic_matchlet_compare_to_data (matchlet, data, len))
+      if (_xdg_magic_rule_matches (table, &rules[k], data, len))
 	{
-	  if ((matchlet->next == NULL) ||
-	      (matchlet->next->indent <= indent))
+	  if (k + 1 == end || rules[k + 1].indent <= indent)
 	    return TRUE;
 
-	  if (_xdg_mime_magic_matchlet_compare_level (matchlet->next,
-						      data,
-						      len,
-						      indent + 1))
+	  if (_xdg_magic_rules_match (table, k + 1, end, data, len, indent + 1))
 	    return TRUE;
 	}
 
-      do
-	{
-	  matchlet = matchlet->next;
-	}
-      while (matchlet && matchlet->indent > indent);
+      k = rules[k].skip;
     }
 
   return FALSE;
 }
 
-static int
-_xdg_mime_magic_match_compare_to_data (XdgMimeMagicMatch *match,
-				       const void        *data,
-				       size_t             len)
+/* The first entry at or after e that could match, given the bitmap */
+static unsigned int
+_xdg_magic_next_candidate (const uint64_t *maybe,
+			   unsigned int    e,
+			   unsigned int    n_entries)
 {
-  return _xdg_mime_magic_matchlet_compare_level (match->matchlet, data, len, 0);
+  unsigned int w = e / 64;
+  uint64_t bits = maybe[w] & (~(uint64_t) 0 << (e % 64));
+  unsigned int n_words = (n_entries + 63) / 64;
+
+  while (bits == 0)
+    {
+      if (++w >= n_words)
+	return n_entries;
+      bits = maybe[w];
+    }
+
+  return w * 64 + __builtin_ctzll (bits);
 }
 
 static void
@@ -644,6 +950,7 @@ void
 _xdg_mime_magic_free (XdgMimeMagic *mime_magic)
 {
   if (mime_magic) {
+    _xdg_magic_table_free (mime_magic->table);
     _xdg_mime_magic_match_free (mime_magic->match_list);
     free (mime_magic);
   }
@@ -663,19 +970,60 @@ _xdg_mime_magic_lookup_data (XdgMimeMagic *mime_magic,
                              const char   *mime_types[],
                              int           n_mime_types)
 {
-  XdgMimeMagicMatch *match;
+  const XdgMagicTable *table = mime_magic->table;
+  const unsigned char *bytes = data;
   const char *mime_type;
+  uint64_t stack[32];
+  uint64_t *maybe;
+  unsigned int e, o, w;
   int n;
   int prio;
 
   prio = 0;
   mime_type = NULL;
-  for (match = mime_magic->match_list; match; match = match->next)
+
+  if (table == NULL)
+    goto no_match;
+
+  /* Which entries could match this data? */
+  maybe = table->n_words <= 32 ? stack :
+	  malloc (sizeof (uint64_t) * table->n_words);
+  memcpy (maybe, table->unindexed, sizeof (uint64_t) * table->n_words);
+  for (o = 0; o < table->n_offsets; o++)
+    {
+      const uint64_t *row;
+
+      if (table->offsets[o] >= len)
+	continue;
+
+      row = table->by_byte +
+	    ((size_t) o * 256 + bytes[table->offsets[o]]) * table->n_words;
+      for (w = 0; w < table->n_words; w++)
+	maybe[w] |= row[w];
+    }
+
+  for (e = 0; e < table->n_entries; e++)
     {
-      if (_xdg_mime_magic_match_compare_to_data (match, data, len))
+      const XdgMagicEntry *entry;
+
+      /* Entries that are skipped still count as non-matches below, when
+       * there are glob results to eliminate.
+       */
+      if (n_mime_types == 0)
+	{
+	  e = _xdg_magic_next_candidate (maybe, e, table->n_entries);
+	  if (e >= table->n_entries)
+	    break;
+	}
+
+      entry = &table->entries[e];
+
+      if ((maybe[e / 64] & ((uint64_t) 1 << (e % 64))) &&
+	  _xdg_magic_rules_match (table, entry->first_rule, entry->end_rule,
+				  bytes, len, 0))
 	{
-	  prio = match->priority;
-	  mime_type = match->mime_type;
+	  prio = entry->priority;
+	  mime_type = entry->mime_type;
 	  break;
 	}
       else 
@@ -683,12 +1031,16 @@ _xdg_mime_magic_lookup_data (XdgMimeMagic *mime_magic,
 	  for (n = 0; n < n_mime_types; n++)
 	    {
 	      if (mime_types[n] && 
-		  _xdg_mime_mime_type_equal (mime_types[n], match->mime_type))
+		  _xdg_mime_mime_type_equal (mime_types[n], entry->mime_type))
 		mime_types[n] = NULL;
 	    }
 	}
     }
 
+  if (maybe != stack)
+    free (maybe);
+
+ no_match:
   if (mime_type == NULL)
     {
       for (n = 0; n < n_mime_types; n++)
@@ -792,7 +1144,81 @@ _xdg_mime_magic_read_magic_file (XdgMimeMagic *mime_magic,
 	}
     }
   _xdg_mime_update_mime_magic_extents (mime_magic);
+  _xdg_mime_magic_compile (mime_magic);
+}
+
+#ifdef HAVE_MMAP
+/* Rules can also be given one at a time, as when they come from
+ * mime.cache (which is only read if it can be mapped).  Each match is followed by its matchlets, in the order they
+ * would appear in a magic file; _xdg_mime_magic_finish () then compiles
+ * them as for a file that has been read.
+ */
+static void
+_xdg_mime_magic_end_match (XdgMimeMagic *mime_magic)
+{
+  XdgMimeMagicMatch *match = mime_magic->adding;
+
+  if (match)
+    match->matchlet = _xdg_mime_magic_matchlet_mirror (match->matchlet);
+  mime_magic->adding = NULL;
+}
+
+void
+_xdg_mime_magic_add_match (XdgMimeMagic *mime_magic,
+			   const char   *mime_type,
+			   int           priority)
+{
+  XdgMimeMagicMatch *match;
+
+  _xdg_mime_magic_end_match (mime_magic);
+
+  match = _xdg_mime_magic_match_new ();
+  match->mime_type = strdup (mime_type);
+  match->priority = priority;
+  _xdg_mime_magic_insert_match (mime_magic, match);
+
+  mime_magic->adding = match;
+}
+
+void
+_xdg_mime_magic_add_matchlet (XdgMimeMagic        *mime_magic,
+			      int                  indent,
+			      int                  offset,
+			      unsigned int         range_length,
+			      unsigned int         value_length,
+			      const unsigned char *value,
+			      const unsigned char *mask)
+{
+  XdgMimeMagicMatch *match = mime_magic->adding;
+  XdgMimeMagicMatchlet *matchlet;
+
+  assert (match != NULL);
+
+  matchlet = _xdg_mime_magic_matchlet_new ();
+  matchlet->indent = indent;
+  matchlet->offset = offset;
+  matchlet->range_length = range_length;
+  matchlet->value_length = value_length;
+  matchlet->value = malloc (value_length ? value_length : 1);
+  memcpy (matchlet->value, value, value_length);
+  if (mask)
+    {
+      matchlet->mask = malloc (value_length ? value_length : 1);
+      memcpy (matchlet->mask, mask, value_length);
+    }
+
+  matchlet->next = match->matchlet;
+  match->matchlet = matchlet;
+}
+
+void
+_xdg_mime_magic_finish (XdgMimeMagic *mime_magic)
+{
+  _xdg_mime_magic_end_match (mime_magic);
+  _xdg_mime_update_mime_magic_extents (mime_magic);
+  _xdg_mime_magic_compile (mime_magic);
 }
+#endif  /* HAVE_MMAP */
 
 void
 _xdg_mime_magic_read_from_file (XdgMimeMagic *mime_magic,
@@ -39,6 +39,9 @@ typedef struct XdgMimeMagic XdgMimeMagic;
 #define _xdg_mime_magic_free                      XDG_RESERVED_ENTRY(magic_free)
 #define _xdg_mime_magic_get_buffer_extents        XDG_RESERVED_ENTRY(magic_get_buffer_extents)
 #define _xdg_mime_magic_lookup_data               XDG_RESERVED_ENTRY(magic_lookup_data)
+#define _xdg_mime_magic_add_match                 XDG_RESERVED_ENTRY(magic_add_match)
+#define _xdg_mime_magic_add_matchlet              XDG_RESERVED_ENTRY(magic_add_matchlet)
+#define _xdg_mime_magic_finish                    XDG_RESERVED_ENTRY(magic_finish)
 #endif
 
 
@@ -53,5 +56,16 @@ const char   *_xdg_mime_magic_lookup_data        (XdgMimeMagic *mime_magic,
 						  int          *result_prio,
 						  const char   *mime_types[],
 						  int           n_mime_types);
+void          _xdg_mime_magic_add_match          (XdgMimeMagic *mime_magic,
+						  const char   *mime_type,
+						  int           priority);
+void          _xdg_mime_magic_add_matchlet       (XdgMimeMagic        *mime_magic,
+						  int                  indent,
+						  int                  offset,
+						  unsigned int         range_length,
+						  unsigned int         value_length,
+						  const unsigned char *value,
+						  const unsigned char *mask);
+void          _xdg_mime_magic_finish             (XdgMimeMagic *mime_magic);
 
 #endif /* __XDG_MIME_MAGIC_H__ */